@@ -5,11 +5,14 @@
 #include <GL/gl.h>
 #include <stdio.h>
 #include <iostream>
+#include <algorithm>
 #include <chrono>
+#include <string>
 
 #define STB_TRUETYPE_IMPLEMENTATION
 #include "stb_truetype.h"
 #include "txt.h"
+#include "txt-piecetable.h"
 
 #define APPNAME "editor"
 
@@ -38,8 +41,18 @@ unsigned char temp_bitmap[512*512];
 stbtt_bakedchar mCharData[128]; // ASCII 32..126 is 95 glyphs
 GLuint mTextureId;
 
-static TxtBuffer txt;
-static TxtSelection selection(&txt);
+// The piece table reads an opened file page by page, as it is painted
+typedef TxtPieceStorage EditorStorage;
+
+static TxtBuffer<EditorStorage> txt;
+static TxtMultiSelection<EditorStorage> selection(&txt);
+
+// Ctrl+S writes a snapshot on a thread of its own, typing goes on while
+// a timer polls it for progress
+#define SAVE_TIMER 1
+
+static const char* filePath = nullptr;
+static std::unique_ptr<TxtBackgroundSave> saving;
 
 void stbtt_initfont(void)
 {
@@ -101,12 +114,27 @@ void getBakedQuad(int pw, int ph, int char_index, float *xpos, float *ypos, stbt
     *xpos += b->xadvance;
 }
 
-bool isSelected(int cur)
+// The selection at or behind cur, walking on from the one found for the
+// previous character: painting goes through the text in order
+const TxtSelection<EditorStorage>& selectionAt(txtcur cur, size_t& next)
+{
+    while (next + 1 < selection.count())
+    {
+        auto& current = selection[next];
+        auto end = current.cursorLength < 0 ? current.cursor : current.cursor + current.cursorLength;
+        if (end > cur || (current.cursorLength == 0 && end == cur)) break;
+
+        next++;
+    }
+    return selection[next];
+}
+
+bool isSelected(const TxtSelection<EditorStorage>& selection, int cur)
 {
     if (selection.cursorLength == 0) return false;
 
-    long selectionMin = selection.cursorLength < 0 ? selection.cursor + selection.cursorLength : selection.cursor;
-    long selectionMax = selection.cursorLength < 0 ? selection.cursor : selection.cursor + selection.cursorLength;
+    txtcur selectionMin = selection.cursorLength < 0 ? selection.cursor + selection.cursorLength : selection.cursor;
+    txtcur selectionMax = selection.cursorLength < 0 ? selection.cursor : selection.cursor + selection.cursorLength;
     return cur >= selectionMin && cur < selectionMax;
 }
 
@@ -118,9 +146,133 @@ const Color selectionColor = { 0.0f, 0.5f, 1.0f, 0.5f };
 const Color cursorColor = { 0.0f, 0.5f, 1.0f, 0.8f };
 const Color fontColor = { 0.0f, 0.25f, 0.5f, 1.0f };
 
-void drawSelection(float x, float y, const char *text)
+// The style ids of the buffer's decorations index this table: a span
+// colours its glyphs, the background behind them or a squiggle below
+enum class DecorationKinds
+{
+    Glyphs,
+    Background,
+    Squiggle,
+};
+
+struct DecorationStyle
+{
+    DecorationKinds kind;
+    Color color;
+};
+
+enum DecorationStyles
+{
+    KeywordStyle,
+    SearchHitStyle,
+    ErrorStyle,
+};
+
+const DecorationStyle decorationStyles[] = {
+    { DecorationKinds::Glyphs, { 0.5f, 0.0f, 0.5f, 1.0f } },
+    { DecorationKinds::Background, { 1.0f, 0.8f, 0.0f, 0.5f } },
+    { DecorationKinds::Squiggle, { 0.9f, 0.0f, 0.0f, 1.0f } },
+};
+
+// What the decorations make of every visible character, looked up once
+// per paint for the spans that overlap the visible text only
+static std::vector<const Color*> glyphColors;
+static std::vector<const Color*> backgroundColors;
+static std::vector<const Color*> squiggleColors;
+
+void decorateVisibleText(txtcur offset, txtsz size)
+{
+    static std::vector<TxtDecoration> spans;
+    spans.clear();
+    txt.decorations().find(offset, offset + size, spans);
+
+    glyphColors.assign(size, nullptr);
+    backgroundColors.assign(size, nullptr);
+    squiggleColors.assign(size, nullptr);
+
+    for (auto& span : spans)
+    {
+        if (span.style < 0 || span.style >= int(sizeof(decorationStyles) / sizeof(decorationStyles[0]))) continue;
+
+        auto& style = decorationStyles[span.style];
+        auto& colors = style.kind == DecorationKinds::Glyphs ? glyphColors
+                     : style.kind == DecorationKinds::Background ? backgroundColors : squiggleColors;
+
+        auto start = span.start > offset ? span.start - offset : 0;
+        auto end = span.end < offset + size ? span.end - offset : size;
+        for (auto i = start; i < end; i++) colors[i] = &style.color;
+    }
+}
+
+// F3 marks every occurrence of the selected text as a search hit. The
+// text is read in blocks, which keeps a paged file paged: every block
+// starts with the end of the one before that a hit could still begin in.
+#define SEARCH_BLOCK (1 << 16)
+
+void markSearchHits()
+{
+    auto& decorations = txt.decorations();
+    decorations.clear();
+
+    auto& current = selection[0];
+    if (current.cursorLength == 0) return;
+
+    auto start = current.cursorLength < 0 ? current.cursor + current.cursorLength : current.cursor;
+    auto size = current.cursorLength < 0 ? -current.cursorLength : current.cursorLength;
+    std::string needle(size, '\0');
+    txt.copy(&needle[0], start, size);
+
+    static std::string block;
+    block.clear();
+
+    txtcur blockStart = 0;
+    for (txtcur position = 0; position < txt.bufferSize(); )
+    {
+        auto count = std::min(txtsz(SEARCH_BLOCK), txt.bufferSize() - position);
+        auto kept = block.size();
+        block.resize(kept + count);
+        txt.copy(&block[kept], position, count);
+        position += count;
+
+        size_t searched = 0;
+        for (auto hit = block.find(needle); hit != std::string::npos; hit = block.find(needle, hit + needle.size()))
+        {
+            decorations.add(blockStart + txtcur(hit), blockStart + txtcur(hit + needle.size()), SearchHitStyle);
+            searched = hit + needle.size();
+        }
+
+        // a hit that is not complete yet, but not inside the last one
+        auto tail = block.size() > needle.size() - 1 ? block.size() - (needle.size() - 1) : 0;
+        if (tail < searched) tail = searched;
+        block.erase(0, tail);
+        blockStart += txtcur(tail);
+    }
+}
+
+// Copies the lines that are inside the window to text and moves y to
+// where the first of them is drawn. Returns the offset of that line, so
+// painting only ever reads the visible part of the text.
+txtcur visibleText(float& y, std::vector<char>& text)
 {
-    long cur = 0;
+    auto lines = txt.lineCount();
+    auto first = y > windowHeight ? txtsz((y - windowHeight) / _config.fontSize) : 0;
+    if (first >= lines) first = lines - 1;
+
+    auto last = first + txtsz(windowHeight / _config.fontSize) + 2;
+    auto start = txt.lineStart(first);
+    auto end = last < lines ? txt.lineStart(last) : txt.bufferSize();
+
+    text.resize(end - start + 1);
+    txt.copy(text.data(), start, end - start);
+    text[end - start] = '\0';
+
+    y -= first * _config.fontSize;
+    return start;
+}
+
+void drawSelection(float x, float y, const char *text, txtcur offset)
+{
+    txtcur cur = offset;
     float initialX = x;
 
     stbtt_aligned_quad q;
@@ -136,12 +288,38 @@ void drawSelection(float x, float y, const char *text)
     glEnable (GL_BLEND);
     glBlendFunc(GL_ONE_MINUS_DST_COLOR,GL_ZERO);
 
-    while (text[cur - 1])
+    size_t next = selection.find(offset);
+    if (next >= selection.count()) next = selection.count() - 1;
+
+    for (const char* c = text; c == text || c[-1]; ++c)
     {
-        int c = (unsigned char)text[cur];
         getBakedQuad(512, 512, 'g', &x, &y, &q);
 
-        if (selection.cursorLength == 0 && cur == selection.cursor)
+        auto index = cur - offset;
+        if (index < txtcur(backgroundColors.size()) && backgroundColors[index] != nullptr)
+        {
+            auto& color = *backgroundColors[index];
+            glColor4f(color.r, color.g, color.b, color.a);
+            glVertex2f(q.x0, q.y1 + _config.fontSize);
+            glVertex2f(q.x1, q.y1);
+            glVertex2f(q.x1, q.y1 + _config.fontSize);
+            glVertex2f(q.x0, q.y1 + _config.fontSize);
+            glVertex2f(q.x1, q.y1);
+            glVertex2f(q.x0, q.y1);
+            glColor4f(selectionColor.r, selectionColor.g, selectionColor.b, selectionColor.a);
+        }
+        if (index < txtcur(squiggleColors.size()) && squiggleColors[index] != nullptr)
+        {
+            auto& color = *squiggleColors[index];
+            glColor4f(color.r, color.g, color.b, color.a);
+            glVertex2f(q.x0, q.y1 + 2.0f);
+            glVertex2f((q.x0 + q.x1) / 2.0f, q.y1);
+            glVertex2f(q.x1, q.y1 + 2.0f);
+            glColor4f(selectionColor.r, selectionColor.g, selectionColor.b, selectionColor.a);
+        }
+
+        auto& current = selectionAt(cur, next);
+        if (current.cursorLength == 0 && cur == current.cursor)
         {
             glColor4f(cursorColor.r, cursorColor.g, cursorColor.b, cursorColor.a);
             glVertex2f(q.x0-1.0f, q.y1 + _config.fontSize);
@@ -155,7 +333,7 @@ void drawSelection(float x, float y, const char *text)
         }
         else
         {
-            if (isSelected(cur))
+            if (isSelected(current, cur))
             {
                 glVertex2f(q.x0, q.y1 + _config.fontSize);
                 glVertex2f(q.x1, q.y1);
@@ -166,7 +344,7 @@ void drawSelection(float x, float y, const char *text)
             }
         }
 
-        if (c == '\n')
+        if (*c == '\n')
         {
             x = initialX;
             y -= _config.fontSize;
@@ -184,7 +362,7 @@ void drawSelection(float x, float y, const char *text)
 
 void drawText(float x, float y, const char *text)
 {
-    long cur = 0;
+    txtcur cur = 0;
     float initialX = x;
 
     // assume orthographic projection with units = screen pixels, origin at top left
@@ -195,7 +373,8 @@ void drawText(float x, float y, const char *text)
 
     while (text[cur])
     {
-        glColor4f(fontColor.r, fontColor.g, fontColor.b, fontColor.a);
+        auto& color = cur < txtcur(glyphColors.size()) && glyphColors[cur] != nullptr ? *glyphColors[cur] : fontColor;
+        glColor4f(color.r, color.g, color.b, color.a);
 
         int c = (unsigned char)text[cur];
         if (c == '\n')
@@ -302,7 +481,7 @@ char wParamToChar(WPARAM wParam, bool shift, bool capslock)
 void cutSelectionToClipboard()
 {
     // TODO cut to clipboard
-    txt.removeText(selection);
+    selection.addText("", 0);
 }
 
 void copySelectionToClipboard()
@@ -317,6 +496,39 @@ void pasteSelectionFromClipboard()
     selection.addText(dummy);
 }
 
+void updateTitle(HWND hwnd)
+{
+    char title[256];
+    auto name = filePath != nullptr ? filePath : szTitle;
+
+    if (saving)
+        snprintf(title, sizeof(title), "%s%s - saving %d%%", name, txt.dirty() ? "*" : "",
+                 saving->size() > 0 ? int(saving->written() * 100 / saving->size()) : 100);
+    else
+        snprintf(title, sizeof(title), "%s%s", name, txt.dirty() ? "*" : "");
+
+    SetWindowText(hwnd, title);
+}
+
+void startSave(HWND hwnd)
+{
+    if (filePath == nullptr || saving) return;
+
+    saving = txt.saveInBackground(filePath);
+    SetTimer(hwnd, SAVE_TIMER, 100, NULL);
+}
+
+void checkSave(HWND hwnd)
+{
+    if (!saving || !saving->done()) return;
+
+    if (saving->succeeded()) txt.markSaved(saving->version());
+    else std::cerr << "could not save " << filePath << std::endl;
+
+    saving.reset();
+    KillTimer(hwnd, SAVE_TIMER);
+}
+
 const float white[] = { 255.0f, 255.0f, 255.0f };
 const float grey[] = { 155.0f, 155.0f, 155.0f };
 static bool splitter_grabbed = false;
@@ -341,10 +553,15 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT message, WPARAM wParam, LPARAM lParam)
     {
         if (ctrl && !shift && 'Z' == wParam) txt.undo();
         else if (ctrl && shift && 'Z' == wParam) txt.redo();
+        else if (ctrl && 'S' == wParam) startSave(hwnd);
         else if (ctrl && 'A' == wParam) selection.selectAll();
         else if (ctrl && 'X' == wParam) cutSelectionToClipboard();
         else if (ctrl && 'C' == wParam) copySelectionToClipboard();
         else if (ctrl && 'V' == wParam) pasteSelectionFromClipboard();
+        else if (VK_F3 == wParam) markSearchHits();
+        else if (ctrl && alt && VK_UP == wParam) selection.addCursorAbove();
+        else if (ctrl && alt && VK_DOWN == wParam) selection.addCursorBelow();
+        else if (VK_ESCAPE == wParam && selection.count() > 1) selection.collapse();
         else if (VK_ESCAPE == wParam) DestroyWindow(hwnd);
         else if (VK_CONTROL == wParam) ctrl = true;
         else if (VK_MENU == wParam) alt = true;
@@ -360,10 +577,21 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT message, WPARAM wParam, LPARAM lParam)
         else if (VK_END == wParam) selection.end(shift, ctrl);
         else if (!alt) selection.addChar(wParamToChar(wParam, shift, capslock));
 
+        updateTitle(hwnd);
         InvalidateRect(hwnd, NULL, false);
         break;
     }
 
+    case WM_TIMER:
+    {
+        if (SAVE_TIMER == wParam)
+        {
+            checkSave(hwnd);
+            updateTitle(hwnd);
+        }
+        break;
+    }
+
     case WM_MOUSEMOVE:
     {
         int xPos = GET_X_LPARAM(lParam);
@@ -424,6 +652,7 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT message, WPARAM wParam, LPARAM lParam)
 
     case WM_DESTROY:
     {
+        if (saving) saving->wait();
         PostQuitMessage(0);
         break;
     }
@@ -448,8 +677,12 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT message, WPARAM wParam, LPARAM lParam)
         auto x = _config.split + _config.margin + _config.padding + scrollx;
         auto y = windowHeight - _config.fontSize - _config.margin - _config.padding - scrolly;
 
-        drawSelection(x, y, txt.buffer());
-        drawText(x, y, txt.buffer());
+        static std::vector<char> text;
+        auto offset = visibleText(y, text);
+        decorateVisibleText(offset, txtsz(text.size() - 1));
+
+        drawSelection(x, y, text.data(), offset);
+        drawText(x, y, text.data());
 
         SwapBuffers(hdc);
         wglMakeCurrent(hdc,0);
@@ -480,6 +713,12 @@ int main(int argc, char* argv[])
 
     pWindowText = "Hello Windows!";
 
+    if (argc > 1)
+    {
+        filePath = argv[1];
+        if (!txt.openPaged(filePath)) std::cerr << "could not open " << filePath << std::endl;
+    }
+
     // Fill in window class structure with parameters that describe
     // the main window.
 
@@ -0,0 +1,183 @@
+#include "../txt-kernels.h"
+#include "../txt-lineindex.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+/*
+ * Microbenchmarks for the byte kernels. Every move shifts a block up by
+ * one byte, like inserting a character in front of it does. The newline
+ * scans run over text with lines of 1 to 120 bytes, "index" is a full
+ * TxtLineIndex::load on one thread and on one thread per core.
+ *
+ * usage: editor-bench [max size in MB, default 1024]
+ */
+
+typedef void (*MoveFunction)(txtchr* destination, const txtchr* source, txtsz size);
+
+static void byteLoopMove(txtchr* destination, const txtchr* source, txtsz size)
+{
+    // what moveTextUp used to do
+    for (txtsz i = size - 1; i >= 0; i--) destination[i] = source[i];
+}
+
+static void libcMove(txtchr* destination, const txtchr* source, txtsz size)
+{
+    std::memmove(destination, source, size);
+}
+
+static double measure(MoveFunction move, txtchr* buffer, txtsz size)
+{
+    // repeat small moves until at least 256 MB went through the kernel
+    long repeat = (256L << 20) / size;
+    if (repeat < 1) repeat = 1;
+
+    auto start = std::chrono::steady_clock::now();
+    for (long i = 0; i < repeat; i++)
+    {
+        move(buffer + (i & 1), buffer + 1 - (i & 1), size);
+    }
+    auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    return double(size) * repeat / seconds / (1 << 30);
+}
+
+static txtsz byteLoopLines(const txtchr* text, txtsz size)
+{
+    // what building the index with findNextLineStart would cost
+    txtsz count = 0;
+    for (txtsz i = 0; i < size; i++)
+    {
+        if (text[i] == '\n') count++;
+    }
+    return count;
+}
+
+static double measureScan(txtsz (*scan)(const txtchr*, txtsz, std::vector<txtcur>&), const std::vector<txtchr>& text)
+{
+    long repeat = (1L << 30) / txtsz(text.size());
+    if (repeat < 1) repeat = 1;
+
+    std::vector<txtcur> positions;
+    volatile txtsz sink = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (long i = 0; i < repeat; i++)
+    {
+        sink = sink + scan(text.data(), txtsz(text.size()), positions);
+    }
+    auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    return double(text.size()) * repeat / seconds / (1 << 30);
+}
+
+static const TxtKernels* scanKernels;
+
+static txtsz scanByteLoop(const txtchr* text, txtsz size, std::vector<txtcur>&)
+{
+    return byteLoopLines(text, size);
+}
+
+static txtsz scanCount(const txtchr* text, txtsz size, std::vector<txtcur>&)
+{
+    return scanKernels->countNewlines(text, size);
+}
+
+static txtsz scanFind(const txtchr* text, txtsz size, std::vector<txtcur>& positions)
+{
+    positions.resize(size / 16 + 64);
+    txtsz count = 0;
+    for (txtsz block = 0; block < size; block += 65536)
+    {
+        count += scanKernels->findNewlines(text + block, size - block < 65536 ? size - block : 65536, positions.data());
+    }
+    return count;
+}
+
+static int indexThreads;
+
+static txtsz scanIndex(const txtchr* text, txtsz size, std::vector<txtcur>&)
+{
+    TxtLineIndex index;
+    index.load(text, size, indexThreads);
+    return index.lineCount();
+}
+
+static void benchmarkNewlines(txtsz maxSize)
+{
+    const TxtKernelTypes types[] = { TxtKernelTypes::Scalar, TxtKernelTypes::SSE2, TxtKernelTypes::AVX2 };
+
+    std::printf("\n%10s%12s", "size", "byte loop");
+    for (auto type : types)
+    {
+        if (txtKernels(type) == nullptr) continue;
+        std::printf("%9s cnt%9s fnd", txtKernels(type)->name, txtKernels(type)->name);
+    }
+    auto cores = int(std::thread::hardware_concurrency());
+    std::printf("%10s 1t%9s %2dt   (GB/s)\n", "index", "index", cores);
+
+    for (txtsz size = 1024; size <= maxSize; size *= 16)
+    {
+        std::vector<txtchr> text(size);
+        unsigned seed = 1;
+        for (txtsz i = 0; i < size; i++)
+        {
+            seed = seed * 1103515245 + 12345;
+            text[i] = (seed >> 16) % 60 == 0 ? '\n' : 'x';
+        }
+
+        if (size >= (1L << 30)) std::printf("%8lldGB", size >> 30);
+        else if (size >= (1L << 20)) std::printf("%8lldMB", size >> 20);
+        else std::printf("%8lldKB", size >> 10);
+
+        std::printf("%12.2f", measureScan(scanByteLoop, text));
+        for (auto type : types)
+        {
+            scanKernels = txtKernels(type);
+            if (scanKernels == nullptr) continue;
+            std::printf("%13.2f%13.2f", measureScan(scanCount, text), measureScan(scanFind, text));
+        }
+        indexThreads = 1;
+        std::printf("%13.2f", measureScan(scanIndex, text));
+        indexThreads = cores;
+        std::printf("%13.2f\n", measureScan(scanIndex, text));
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    txtsz maxSize = (argc > 1 ? std::atoll(argv[1]) : 1024) * (txtsz(1) << 20);
+
+    struct { const char* name; MoveFunction move; } candidates[] = {
+        { "byte loop", byteLoopMove },
+        { "memmove", libcMove },
+        { "txtMove", txtMove },
+    };
+
+    std::printf("best kernels: %s\n\n%10s", txtBestKernels().name, "size");
+    for (auto& candidate : candidates) std::printf("%12s", candidate.name);
+    std::printf("   (GB/s)\n");
+
+    for (txtsz size = 1024; size <= maxSize; size *= 16)
+    {
+        std::vector<txtchr> buffer(size + 1, 'x');
+
+        if (size >= (1L << 30)) std::printf("%8lldGB", size >> 30);
+        else if (size >= (1L << 20)) std::printf("%8lldMB", size >> 20);
+        else std::printf("%8lldKB", size >> 10);
+
+        for (auto& candidate : candidates)
+        {
+            if (candidate.move == nullptr) std::printf("%12s", "-");
+            else std::printf("%12.2f", measure(candidate.move, buffer.data(), size));
+        }
+        std::printf("\n");
+    }
+
+    benchmarkNewlines(maxSize);
+
+    return 0;
+}
@@ -1,11 +1,38 @@
 #define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
 #include "doctest.h"
 #include "../txt.h"
+#include "../txt-anchors.h"
+#include "../txt-decorations.h"
+#include "../txt-gapbuffer.h"
+#include "../txt-history.h"
+#include "../txt-kernels.h"
+#include "../txt-lineindex.h"
+#include "../txt-piecetable.h"
+#include "../txt-rope.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <limits>
 #include <string>
+#include <thread>
 
-TEST_CASE("default constructor should result in an empty buffer")
+typedef doctest::Types<
+    TxtBuffer<TxtArrayStorage>,
+    TxtBuffer<TxtGapStorage>,
+    TxtBuffer<TxtPieceStorage>,
+    TxtBuffer<TxtRopeStorage>
+> TxtBuffers;
+
+typedef doctest::Types<
+    TxtArrayStorage,
+    TxtGapStorage,
+    TxtPieceStorage,
+    TxtRopeStorage
+> TxtStorages;
+
+TEST_CASE_TEMPLATE("default constructor should result in an empty buffer", T, TxtBuffers)
 {
-    TxtBuffer buffer;
+    T buffer;
 
     CHECK(buffer.buffer()[0] == '\0');
     CHECK(buffer.bufferSize() == 0);
@@ -13,9 +40,9 @@ TEST_CASE("default constructor should result in an empty buffer")
     CHECK(buffer.redoCount() == 0);
 }
 
-TEST_CASE("adding text twice to an empty buffer should result in a buffer containing the added text")
+TEST_CASE_TEMPLATE("adding text twice to an empty buffer should result in a buffer containing the added text", T, TxtBuffers)
 {
-    TxtBuffer buffer;
+    T buffer;
 
     buffer.addText(0, 0, "hello", 5);
 
@@ -30,9 +57,9 @@ TEST_CASE("adding text twice to an empty buffer should result in a buffer contai
     CHECK(std::string(buffer.buffer()) == std::string("helololo"));
 }
 
-TEST_CASE("adding and removing text to an empty buffer should result in the correct text")
+TEST_CASE_TEMPLATE("adding and removing text to an empty buffer should result in the correct text", T, TxtBuffers)
 {
-    TxtBuffer buffer;
+    T buffer;
 
     buffer.addText(0, 0, "hello", 5);
 
@@ -47,9 +74,9 @@ TEST_CASE("adding and removing text to an empty buffer should result in the corr
     CHECK(std::string(buffer.buffer()) == std::string("heo"));
 }
 
-TEST_CASE("adding a text and removing all text to an empty buffer should result in an empty buffer")
+TEST_CASE_TEMPLATE("adding a text and removing all text to an empty buffer should result in an empty buffer", T, TxtBuffers)
 {
-    TxtBuffer buffer;
+    T buffer;
 
     buffer.addText(0, 0, "hello", 5);
 
@@ -64,9 +91,9 @@ TEST_CASE("adding a text and removing all text to an empty buffer should result
     CHECK(std::string(buffer.buffer()) == std::string(""));
 }
 
-TEST_CASE("adding a text to an empty buffer and undoing should result in an empty buffer")
+TEST_CASE_TEMPLATE("adding a text to an empty buffer and undoing should result in an empty buffer", T, TxtBuffers)
 {
-    TxtBuffer buffer;
+    T buffer;
 
     buffer.addText(0, 0, "hello", 5);
 
@@ -81,9 +108,9 @@ TEST_CASE("adding a text to an empty buffer and undoing should result in an empt
     CHECK(std::string(buffer.buffer()) == std::string(""));
 }
 
-TEST_CASE("adding a text to an empty buffer, undoing and redoing should result in the added text")
+TEST_CASE_TEMPLATE("adding a text to an empty buffer, undoing and redoing should result in the added text", T, TxtBuffers)
 {
-    TxtBuffer buffer;
+    T buffer;
 
     buffer.addText(0, 0, "hello", 5);
 
@@ -106,9 +133,9 @@ TEST_CASE("adding a text to an empty buffer, undoing and redoing should result i
     CHECK(buffer.redo() == false);
 }
 
-TEST_CASE("adding a text to an empty buffer, undoing and adding text again should reset redo count")
+TEST_CASE_TEMPLATE("adding a text to an empty buffer, undoing and adding text again should reset redo count", T, TxtBuffers)
 {
-    TxtBuffer buffer;
+    T buffer;
 
     buffer.addText(0, 0, "hello", 5);
     buffer.addText(3, 0, "olo", 3);
@@ -137,9 +164,9 @@ TEST_CASE("adding a text to an empty buffer, undoing and adding text again shoul
     CHECK(std::string(buffer.buffer()) == std::string("helololo"));
 }
 
-TEST_CASE("adding a text over a selection range should work")
+TEST_CASE_TEMPLATE("adding a text over a selection range should work", T, TxtBuffers)
 {
-    TxtBuffer buffer;
+    T buffer;
 
     buffer.addText(0, 0, "hello", 5);
     buffer.addText(2, 2, "rr", 2);
@@ -147,9 +174,9 @@ TEST_CASE("adding a text over a selection range should work")
     CHECK(std::string(buffer.buffer()) == std::string("herro"));
 }
 
-TEST_CASE("adding a text over a negative selection range should work")
+TEST_CASE_TEMPLATE("adding a text over a negative selection range should work", T, TxtBuffers)
 {
-    TxtBuffer buffer;
+    T buffer;
 
     buffer.addText(0, 0, "hello", 5);
     buffer.addText(4, -2, "rr", 2);
@@ -157,9 +184,9 @@ TEST_CASE("adding a text over a negative selection range should work")
     CHECK(std::string(buffer.buffer()) == std::string("herro"));
 }
 
-TEST_CASE("findLineStart should work")
+TEST_CASE_TEMPLATE("findLineStart should work", T, TxtBuffers)
 {
-    TxtBuffer buffer;
+    T buffer;
 
     buffer.addText(0, 0, "hello\ntest\nbla", 15);
 
@@ -179,27 +206,27 @@ TEST_CASE("findLineStart should work")
     CHECK(buffer.findLineStart(15) == 10);
 }
 
-TEST_CASE("findLineStart with a position outside the text should return -1")
+TEST_CASE_TEMPLATE("findLineStart with a position outside the text should return -1", T, TxtBuffers)
 {
-    TxtBuffer buffer;
+    T buffer;
 
     buffer.addText(0, 0, "hello\ntest\nbla", 15);
 
     CHECK(buffer.findLineStart(16) == -1);
 }
 
-TEST_CASE("findLineStart with a negative position should return -1")
+TEST_CASE_TEMPLATE("findLineStart with a negative position should return -1", T, TxtBuffers)
 {
-    TxtBuffer buffer;
+    T buffer;
 
     buffer.addText(0, 0, "hello\ntest\nbla", 15);
 
     CHECK(buffer.findLineStart(-2) == -1);
 }
 
-TEST_CASE("findNextLineStart should work")
+TEST_CASE_TEMPLATE("findNextLineStart should work", T, TxtBuffers)
 {
-    TxtBuffer buffer;
+    T buffer;
 
     buffer.addText(0, 0, "hello\ntest\nbla", 15);
 
@@ -219,20 +246,1608 @@ TEST_CASE("findNextLineStart should work")
     CHECK(buffer.findNextLineStart(15) == -1);
 }
 
-TEST_CASE("findNextLineStart with a position outside the text should return -1")
+TEST_CASE_TEMPLATE("findNextLineStart with a position outside the text should return -1", T, TxtBuffers)
 {
-    TxtBuffer buffer;
+    T buffer;
 
     buffer.addText(0, 0, "hello\ntest\nbla", 15);
 
     CHECK(buffer.findNextLineStart(16) == -1);
 }
 
-TEST_CASE("findNextLineStart with a negative position should return -1")
+TEST_CASE_TEMPLATE("findNextLineStart with a negative position should return -1", T, TxtBuffers)
 {
-    TxtBuffer buffer;
+    T buffer;
 
     buffer.addText(0, 0, "hello\ntest\nbla", 15);
 
     CHECK(buffer.findNextLineStart(-2) == -1);
 }
+
+TEST_CASE_TEMPLATE("edits in different places should result in the correct text", T, TxtBuffers)
+{
+    T buffer;
+
+    buffer.addText(0, 0, "hello world", 11);
+    buffer.addText(5, 0, ",", 1);
+    buffer.addText(0, 0, ">> ", 3);
+    buffer.removeText(3, 2);
+    buffer.addText(buffer.bufferSize(), 0, "!", 1);
+    buffer.addText(4, 2, "LL", 2);
+
+    CHECK(std::string(buffer.buffer()) == std::string(">> lLL, world!"));
+    CHECK(buffer.bufferSize() == 14);
+}
+
+TEST_CASE_TEMPLATE("at should read the terminator at the end of the text", T, TxtBuffers)
+{
+    T buffer;
+    CHECK(buffer.at(0) == '\0');
+
+    buffer.addText(0, 0, "hello world", 11);
+    CHECK(buffer.at(10) == 'd');
+    CHECK(buffer.at(buffer.bufferSize()) == '\0');
+
+    buffer.removeText(0, 6);
+    buffer.addText(2, 0, std::string(5000, 'x'));
+    CHECK(buffer.at(buffer.bufferSize() - 1) == 'd');
+    CHECK(buffer.at(buffer.bufferSize()) == '\0');
+}
+
+TEST_CASE("a gap buffer should grow when more text is typed than fits in the gap")
+{
+    TxtBuffer<TxtGapStorage> buffer;
+    std::string expected;
+
+    for (int i = 0; i < 1000; i++)
+    {
+        txtchr c = 'a' + (i % 26);
+        buffer.addText(i / 2, 0, &c, 1);
+        expected.insert(expected.begin() + i / 2, c);
+    }
+
+    CHECK(buffer.bufferSize() == 1000);
+    CHECK(std::string(buffer.buffer()) == expected);
+    CHECK(buffer.at(0) == expected[0]);
+    CHECK(buffer.at(999) == expected[999]);
+}
+
+TEST_CASE("undo and redo on a gap buffer should restore the text")
+{
+    TxtBuffer<TxtGapStorage> buffer;
+
+    buffer.addText(0, 0, "hello", 5);
+    buffer.removeText(1, 3);
+
+    CHECK(std::string(buffer.buffer()) == std::string("ho"));
+    CHECK(buffer.undo() == true);
+    CHECK(std::string(buffer.buffer()) == std::string("hello"));
+    CHECK(buffer.undo() == true);
+    CHECK(std::string(buffer.buffer()) == std::string(""));
+    CHECK(buffer.redo() == true);
+    CHECK(buffer.redo() == true);
+    CHECK(std::string(buffer.buffer()) == std::string("ho"));
+}
+
+TEST_CASE("a piece table should keep the loaded text as original and edit on top of it")
+{
+    TxtBuffer<TxtPieceStorage> buffer;
+
+    buffer.load("first line\nsecond line\n", 23);
+
+    CHECK(buffer.undoCount() == 0);
+    CHECK(buffer.bufferSize() == 23);
+
+    buffer.addText(6, 4, "row", 3);
+    buffer.addText(buffer.bufferSize(), 0, "third", 5);
+    buffer.removeText(0, 6);
+
+    CHECK(std::string(buffer.buffer()) == std::string("row\nsecond line\nthird"));
+    CHECK(buffer.at(4) == 's');
+
+    CHECK(buffer.undo() == true);
+    CHECK(buffer.undo() == true);
+    CHECK(buffer.undo() == true);
+    CHECK(buffer.undo() == false);
+    CHECK(std::string(buffer.buffer()) == std::string("first line\nsecond line\n"));
+
+    CHECK(buffer.redo() == true);
+    CHECK(buffer.redo() == true);
+    CHECK(buffer.redo() == true);
+    CHECK(buffer.redo() == false);
+    CHECK(std::string(buffer.buffer()) == std::string("row\nsecond line\nthird"));
+}
+
+TEST_CASE("typing into a piece table should grow one piece instead of adding a piece per character")
+{
+    TxtPieceStorage storage;
+
+    storage.load("hello world", 11);
+    storage.insert(5, ",", 1);
+    storage.insert(6, " dear", 5);
+    storage.insert(11, "!", 1);
+
+    CHECK(std::string(storage.data()) == std::string("hello, dear! world"));
+    CHECK(storage.pieceCount() == 3);
+
+    std::vector<TxtPiece> pieces;
+    CHECK(storage.pieces(3, 10, pieces) == true);
+    CHECK(pieces.size() == 3);
+    CHECK(pieces[0].source == TxtPieceSources::Original);
+    CHECK(pieces[0].length == 2);
+    CHECK(pieces[1].source == TxtPieceSources::Added);
+    CHECK(pieces[1].length == 7);
+}
+
+TEST_CASE("a rope should give the same text and line starts as the array buffer")
+{
+    TxtBuffer<TxtArrayStorage> array;
+    TxtBuffer<TxtRopeStorage> rope;
+
+    std::string line;
+    for (int i = 0; i < 200; i++)
+    {
+        line += char('a' + i % 26);
+    }
+    line += '\n';
+
+    for (int i = 0; i < 500; i++)
+    {
+        array.addText((i * 7919) % (array.bufferSize() + 1), 0, line.c_str(), txtsz(line.size()));
+        rope.addText((i * 7919) % (rope.bufferSize() + 1), 0, line.c_str(), txtsz(line.size()));
+    }
+    array.removeText(1000, 40000);
+    rope.removeText(1000, 40000);
+    array.addText(20, 0, "\n\n", 2);
+    rope.addText(20, 0, "\n\n", 2);
+
+    REQUIRE(rope.bufferSize() == array.bufferSize());
+    CHECK(std::string(rope.buffer()) == std::string(array.buffer()));
+
+    for (txtcur i = 0; i < array.bufferSize(); i += 97)
+    {
+        CHECK(rope.at(i) == array.at(i));
+        CHECK(rope.findLineStart(i) == array.findLineStart(i));
+        CHECK(rope.findNextLineStart(i) == array.findNextLineStart(i));
+    }
+
+    while (rope.undo());
+    CHECK(rope.bufferSize() == 0);
+}
+
+TEST_CASE("a rope should find lines and offsets without walking the text")
+{
+    TxtRopeStorage rope;
+    std::string text;
+
+    for (int i = 0; i < 100000; i++)
+    {
+        text += "line ";
+        text += std::to_string(i);
+        text += '\n';
+    }
+
+    rope.load(text.c_str(), txtsz(text.size()));
+
+    CHECK(rope.size() == txtsz(text.size()));
+    CHECK(rope.lineCount() == 100001);
+    CHECK(rope.depth() <= 4);
+    CHECK(rope.lineStart(0) == 0);
+    CHECK(rope.lineStart(1) == 7);
+    CHECK(rope.lineStart(12345) == txtcur(text.find("line 12345\n")));
+    CHECK(rope.lineOf(txtcur(text.find("line 54321\n")) + 3) == 54321);
+    CHECK(rope.lineStart(100001) == -1);
+
+    rope.erase(7, txtcur(text.find("line 99999\n")) - 7);
+
+    CHECK(rope.lineCount() == 3);
+    CHECK(std::string(rope.data()) == std::string("line 0\nline 99999\n"));
+    CHECK(rope.depth() == 1);
+}
+
+static_assert(isTxtStorage<TxtArrayStorage>::value, "TxtArrayStorage is a storage engine");
+static_assert(isTxtStorage<TxtGapStorage>::value, "TxtGapStorage is a storage engine");
+static_assert(isTxtStorage<TxtPieceStorage>::value, "TxtPieceStorage is a storage engine");
+static_assert(isTxtStorage<TxtRopeStorage>::value, "TxtRopeStorage is a storage engine");
+static_assert(!isTxtStorage<std::string>::value, "std::string is not a storage engine");
+
+TEST_CASE_TEMPLATE("a large paste should grow the capacity geometrically and shrink it again after deleting", T, doctest::Types<TxtArrayStorage, TxtGapStorage>)
+{
+    T storage;
+    std::string text(10 * 1024 * 1024, 'x');
+
+    storage.insert(0, "ab", 2);
+    storage.insert(1, text.c_str(), txtsz(text.size()));
+
+    CHECK(storage.size() == txtsz(text.size()) + 2);
+    CHECK(storage.capacity() < 2 * storage.size() + 2);
+    CHECK(storage.at(0) == 'a');
+    CHECK(storage.at(storage.size() - 1) == 'b');
+
+    auto capacity = storage.capacity();
+    storage.erase(1, storage.size() / 2);
+
+    CHECK(storage.capacity() == capacity);
+
+    storage.erase(1, storage.size() - 2);
+
+    CHECK(storage.capacity() < capacity / 4);
+    CHECK(std::string(storage.data()) == std::string("ab"));
+}
+
+TEST_CASE_TEMPLATE("reserving capacity should keep it after removing text", T, doctest::Types<TxtArrayStorage, TxtGapStorage>)
+{
+    T storage;
+
+    storage.reserve(100000);
+    CHECK(storage.capacity() > 100000);
+
+    storage.insert(0, "hello", 5);
+    storage.erase(0, 5);
+
+    CHECK(storage.capacity() > 100000);
+    CHECK(storage.size() == 0);
+}
+
+TEST_CASE_TEMPLATE("the block growth policy should grow in steps of 16 bytes and never shrink", T,
+                   doctest::Types<TxtBasicArrayStorage<TxtBlockGrowth>, TxtBasicGapStorage<TxtBlockGrowth> >)
+{
+    T storage;
+
+    storage.insert(0, "hello world, hello world", 24);
+    CHECK(storage.capacity() == 32);
+
+    storage.erase(0, 20);
+    CHECK(storage.capacity() == 32);
+    CHECK(std::string(storage.data()) == std::string("orld"));
+}
+
+TEST_CASE_TEMPLATE("removing text should work with embedded NULs", T, TxtBuffers)
+{
+    T buffer;
+
+    buffer.addText(0, 0, "ab\0cd\0ef", 8);
+    buffer.removeText(1, 1);
+
+    CHECK(buffer.bufferSize() == 7);
+    CHECK(std::string(buffer.buffer(), 7) == std::string("a\0cd\0ef", 7));
+
+    buffer.removeText(4, 3);
+
+    CHECK(std::string(buffer.buffer(), 5) == std::string("a\0cd\0", 5));
+}
+
+TEST_CASE("every available length kernel should find the terminator at any alignment")
+{
+    std::vector<txtchr> text(300, 'x');
+
+    for (auto type : { TxtKernelTypes::Scalar, TxtKernelTypes::SSE2, TxtKernelTypes::AVX2 })
+    {
+        auto kernels = txtKernels(type);
+        if (kernels == nullptr) continue;
+
+        CAPTURE(kernels->name);
+
+        for (txtsz start = 0; start < 40; start++)
+        {
+            for (txtsz length : { 0, 1, 15, 16, 31, 32, 33, 100, 200 })
+            {
+                text[start + length] = '\0';
+                CHECK(kernels->length(text.data() + start) == length);
+                text[start + length] = 'x';
+            }
+        }
+    }
+}
+
+TEST_CASE_TEMPLATE("a selection should take text with an explicit length, including NULs", S, TxtStorages)
+{
+    TxtBuffer<S> buffer;
+    TxtSelection<S> selection(&buffer);
+
+    selection.addText("hello");
+    selection.addText(std::string_view("\0\0", 2));
+    selection.addText(std::string("world"));
+    selection.cursor = 1;
+    selection.cursorLength = 3;
+    selection.addText("ipp", 3);
+
+    CHECK(buffer.bufferSize() == 12);
+    CHECK(std::string(buffer.buffer(), 12) == std::string("hippo\0\0world", 12));
+    CHECK(selection.cursor == 4);
+    CHECK(selection.cursorLength == 0);
+}
+
+TEST_CASE_TEMPLATE("the line index should follow edits, undo and redo", S, TxtStorages)
+{
+    TxtBuffer<S> buffer;
+
+    buffer.load("first\nsecond\nthird");
+    buffer.addText(3, 0, "a\nb\n\nc", 6);
+    buffer.removeText(2, 9);
+    buffer.addText(buffer.bufferSize(), 0, "\nlast\n", 6);
+    buffer.removeText(0, 1);
+    buffer.undo();
+    buffer.undo();
+    buffer.redo();
+
+    std::string text(buffer.buffer(), buffer.bufferSize());
+    txtsz lines = 1;
+    for (txtcur i = 0; i < txtcur(text.size()); i++)
+    {
+        CHECK(buffer.lineOf(i) == lines - 1);
+        if (text[i] == '\n')
+        {
+            CHECK(buffer.lineStart(lines) == i + 1);
+            lines++;
+        }
+    }
+    CHECK(buffer.lineCount() == lines);
+    CHECK(buffer.lineOf(buffer.bufferSize()) == lines - 1);
+    CHECK(buffer.lineStart(lines) == -1);
+}
+
+TEST_CASE("a line index should match a scan of the text after many edits")
+{
+    TxtLineIndex index;
+    std::string text;
+    unsigned seed = 12345;
+
+    for (int i = 0; i < 2000; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        auto position = txtcur((seed >> 8) % (text.size() + 1));
+        if (seed % 3 == 0 && !text.empty())
+        {
+            auto size = txtsz((seed >> 4) % 40);
+            if (position + size > txtcur(text.size())) size = txtsz(text.size()) - position;
+            text.erase(position, size);
+            index.erase(position, size);
+        }
+        else
+        {
+            std::string inserted = (seed % 5 == 0) ? "x\n\ny" : (seed % 7 == 0) ? "\n" : "abc";
+            text.insert(position, inserted);
+            index.insert(position, inserted.c_str(), txtsz(inserted.size()));
+        }
+    }
+
+    std::vector<txtcur> starts(1, 0);
+    for (size_t i = 0; i < text.size(); i++)
+    {
+        if (text[i] == '\n') starts.push_back(txtcur(i + 1));
+    }
+
+    REQUIRE(index.lineCount() == txtsz(starts.size()));
+    for (size_t line = 0; line < starts.size(); line++)
+    {
+        CHECK(index.lineStart(txtsz(line)) == starts[line]);
+    }
+    for (txtcur i = 0; i <= txtcur(text.size()); i += 7)
+    {
+        auto line = std::upper_bound(starts.begin(), starts.end(), i) - starts.begin() - 1;
+        CHECK(index.lineOf(i) == line);
+    }
+}
+
+TEST_CASE("anchors should move like positions updated after every edit")
+{
+    TxtAnchors anchors;
+    std::vector<txtcur> positions;
+    std::vector<int> handles;
+    txtsz size = 1000;
+    unsigned seed = 4321;
+
+    for (int i = 0; i < 3000; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        auto position = txtcur((seed >> 8) % (size + 1));
+        if (seed % 5 == 0 || positions.empty())
+        {
+            handles.push_back(anchors.add(position));
+            positions.push_back(position);
+        }
+        else if (seed % 11 == 0)
+        {
+            auto which = (seed >> 4) % handles.size();
+            anchors.remove(handles[which]);
+            handles.erase(handles.begin() + which);
+            positions.erase(positions.begin() + which);
+        }
+        else if (seed % 3 == 0)
+        {
+            auto erased = txtsz((seed >> 4) % 50);
+            if (position + erased > size) erased = size - position;
+            anchors.erase(position, erased);
+            size -= erased;
+            for (auto& p : positions)
+            {
+                if (p > position + erased) p -= erased;
+                else if (p > position) p = position;
+            }
+        }
+        else
+        {
+            auto inserted = txtsz((seed >> 4) % 20 + 1);
+            anchors.insert(position, inserted);
+            size += inserted;
+            for (auto& p : positions)
+            {
+                if (p > position) p += inserted;
+            }
+        }
+    }
+
+    REQUIRE(anchors.count() == handles.size());
+    for (size_t i = 0; i < handles.size(); i++)
+    {
+        CHECK(anchors.position(handles[i]) == positions[i]);
+    }
+}
+
+TEST_CASE("decorations should move like spans updated after every edit and be found by range")
+{
+    TxtDecorations decorations;
+    std::vector<TxtDecoration> spans;
+    std::vector<int> handles;
+    txtsz size = 1000;
+    unsigned seed = 9876;
+
+    for (int i = 0; i < 3000; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        auto position = txtcur((seed >> 8) % (size + 1));
+        if (seed % 4 == 0 || spans.empty())
+        {
+            auto end = position + txtsz((seed >> 4) % 30);
+            if (end > size) end = size;
+            handles.push_back(decorations.add(position, end, int(i)));
+            spans.push_back({ position, end, int(i) });
+        }
+        else if (seed % 11 == 0)
+        {
+            auto which = (seed >> 4) % handles.size();
+            decorations.remove(handles[which]);
+            handles.erase(handles.begin() + which);
+            spans.erase(spans.begin() + which);
+        }
+        else if (seed % 3 == 0)
+        {
+            auto erased = txtsz((seed >> 4) % 50);
+            if (position + erased > size) erased = size - position;
+            decorations.erase(position, erased);
+            size -= erased;
+            for (auto& span : spans)
+            {
+                for (auto p : { &span.start, &span.end })
+                {
+                    if (*p > position + erased) *p -= erased;
+                    else if (*p > position) *p = position;
+                }
+            }
+        }
+        else
+        {
+            auto inserted = txtsz((seed >> 4) % 20 + 1);
+            decorations.insert(position, inserted);
+            size += inserted;
+            for (auto& span : spans)
+            {
+                if (span.start >= position) span.start += inserted;
+                if (span.end > position || span.start > position) span.end += inserted;
+            }
+        }
+    }
+
+    REQUIRE(decorations.count() == handles.size());
+    for (size_t i = 0; i < handles.size(); i++)
+    {
+        auto span = decorations.get(handles[i]);
+        CHECK(span.start == spans[i].start);
+        CHECK(span.end == spans[i].end);
+        CHECK(span.style == spans[i].style);
+    }
+
+    for (txtcur from = 0; from < size; from += 97)
+    {
+        std::vector<TxtDecoration> found;
+        decorations.find(from, from + 40, found);
+
+        size_t expected = 0;
+        for (auto& span : spans)
+        {
+            if (span.start < from + 40 && span.end > from) expected++;
+        }
+        CHECK(found.size() == expected);
+        for (size_t i = 0; i < found.size(); i++)
+        {
+            CHECK(found[i].start < from + 40);
+            CHECK(found[i].end > from);
+            if (i > 0) CHECK(found[i - 1].start <= found[i].start);
+        }
+    }
+}
+
+TEST_CASE("every available newline kernel should count and find the newlines at any alignment")
+{
+    std::string text;
+    for (int i = 0; i < 20000; i++)
+    {
+        text += (i * 7 % 13 == 0 || i % 1000 < 40) ? '\n' : char('a' + i % 26);
+    }
+
+    for (auto type : { TxtKernelTypes::Scalar, TxtKernelTypes::SSE2, TxtKernelTypes::AVX2 })
+    {
+        auto kernels = txtKernels(type);
+        if (kernels == nullptr) continue;
+
+        CAPTURE(kernels->name);
+
+        for (txtsz start : { 0, 1, 17, 63 })
+        {
+            auto size = txtsz(text.size()) - start - 5;
+
+            std::vector<txtcur> expected;
+            for (txtsz i = 0; i < size; i++)
+            {
+                if (text[start + i] == '\n') expected.push_back(i);
+            }
+
+            std::vector<txtcur> positions(expected.size());
+            CHECK(kernels->countNewlines(text.c_str() + start, size) == txtsz(expected.size()));
+            CHECK(kernels->findNewlines(text.c_str() + start, size, positions.data()) == txtsz(expected.size()));
+            CHECK(positions == expected);
+        }
+    }
+}
+
+TEST_CASE_TEMPLATE("loading a CRLF text should end lines in front of the CR", S, TxtStorages)
+{
+    TxtBuffer<S> buffer;
+    TxtSelection<S> selection(&buffer);
+
+    buffer.load("one\r\ntwo\nthree\r\n\r\n\rfour");
+
+    CHECK(buffer.lineCount() == 5);
+    CHECK(buffer.lineEnd(0) == 3);
+    CHECK(buffer.lineEnd(1) == 8);
+    CHECK(buffer.lineEnd(2) == 14);
+    CHECK(buffer.lineEnd(3) == 16);
+    CHECK(buffer.lineEnd(4) == buffer.bufferSize());
+    CHECK(buffer.lineEnd(5) == -1);
+
+    selection.cursor = 1;
+    selection.end(false, false);
+    CHECK(selection.cursor == 3);
+}
+
+TEST_CASE("loading a line index should scan across blocks")
+{
+    std::string text;
+    std::vector<txtcur> starts(1, 0);
+    for (int i = 0; i < 30000; i++)
+    {
+        text += "line ";
+        text += std::to_string(i * 31 % 977);
+        text += '\n';
+        starts.push_back(txtcur(text.size()));
+    }
+    text += "tail";
+
+    TxtLineIndex index;
+    index.load(text.c_str(), txtsz(text.size()));
+
+    std::vector<txtcur> indexed;
+    for (txtsz line = 0; line < index.lineCount(); line++)
+    {
+        indexed.push_back(index.lineStart(line));
+    }
+    CHECK(indexed == starts);
+}
+
+TEST_CASE("loading a line index on several threads should give the lines a walk over the text finds")
+{
+    TxtArrayStorage storage;
+    std::string text;
+    unsigned seed = 7;
+    for (int i = 0; i < 600000; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        auto r = (seed >> 16) % 50;
+        text += r == 0 ? '\n' : r == 1 ? '\r' : r == 2 ? '\0' : char('a' + r % 26);
+    }
+    text += "\n\n";
+    storage.load(text.c_str(), txtsz(text.size()));
+
+    std::vector<txtcur> starts(1, 0);
+    for (auto start = storage.findNextLineStart(0); start >= 0 && start < storage.size(); start = storage.findNextLineStart(start))
+    {
+        starts.push_back(start);
+    }
+    starts.push_back(storage.size());
+
+    for (int threads : { 1, 3, 8 })
+    {
+        CAPTURE(threads);
+
+        TxtLineIndex index;
+        index.load(text.c_str(), txtsz(text.size()), threads);
+
+        std::vector<txtcur> indexed;
+        for (txtsz line = 0; line < index.lineCount(); line++)
+        {
+            indexed.push_back(index.lineStart(line));
+        }
+        CHECK(indexed == starts);
+        CHECK(index.lineOf(txtcur(text.size())) == index.lineCount() - 1);
+
+        index.insert(starts[1000] + 1, "x\ny", 3);
+        CHECK(index.lineCount() == txtsz(starts.size()) + 1);
+        CHECK(index.lineStart(1001) == starts[1000] + 3);
+    }
+}
+
+TEST_CASE_TEMPLATE("opening a file should give its text and lines", S, TxtStorages)
+{
+    const char* path = "txt-tests-open.txt";
+    std::string text;
+    while (text.size() < 8192)
+    {
+        text += "line " + std::to_string(text.size()) + "\r\n";
+    }
+    text.resize(8192);
+
+    auto file = std::fopen(path, "wb");
+    REQUIRE(file != nullptr);
+    std::fwrite(text.data(), 1, text.size(), file);
+    std::fclose(file);
+
+    TxtBuffer<S> buffer;
+    buffer.addText(0, 0, "old");
+
+    REQUIRE(buffer.open(path, TxtAccessPatterns::Sequential));
+    CHECK(buffer.undoCount() == 0);
+    CHECK(buffer.bufferSize() == 8192);
+    CHECK(std::string(buffer.buffer()) == text);
+    CHECK(buffer.lineStart(1) == txtcur(text.find('\n') + 1));
+
+    buffer.addText(4, 0, "\n", 1);
+    buffer.removeText(8000, 10);
+    CHECK(buffer.lineStart(1) == 5);
+    buffer.undo();
+    buffer.undo();
+    CHECK(std::string(buffer.buffer()) == text);
+
+    CHECK(!buffer.open("txt-tests-missing/file.txt"));
+    std::remove(path);
+}
+
+TEST_CASE("a file size should only be taken when a txtsz can count it")
+{
+    txtsz size = -1;
+    CHECK(txtFileSize(0, size));
+    CHECK(size == 0);
+    CHECK(txtFileSize(123456, size));
+    CHECK(size == 123456);
+
+    // past what a 32 bit long could count
+    CHECK(txtFileSize(4LL << 30, size));
+    CHECK(size == 4LL << 30);
+    CHECK(txtFileSize(std::numeric_limits<long long>::max(), size));
+    CHECK(size == std::numeric_limits<txtsz>::max());
+
+    size = -1;
+    CHECK(!txtFileSize(-1, size));
+    CHECK(size == -1);
+    CHECK(!txtFileSize(std::numeric_limits<long long>::min(), size));
+    CHECK(size == -1);
+}
+
+TEST_CASE("a piece table should read an opened file from its mapping until it is edited")
+{
+    const char* path = "txt-tests-mapped.txt";
+    auto file = std::fopen(path, "wb");
+    REQUIRE(file != nullptr);
+    std::fputs("mapped\ntext\n", file);
+    std::fclose(file);
+
+    TxtFileMapping mapping;
+    REQUIRE(mapping.open(path));
+    auto mapped = mapping.data();
+
+    TxtPieceStorage storage;
+    storage.load(std::move(mapping));
+
+    CHECK(mapping.size() == 0);
+    CHECK(storage.data() == mapped);
+    CHECK(std::string(storage.data()) == "mapped\ntext\n");
+
+    storage.erase(0, 7);
+    CHECK(storage.data() == mapped + 7);
+
+    storage.insert(0, "a ", 2);
+    CHECK(storage.data() != mapped);
+    CHECK(std::string(storage.data()) == "a text\n");
+
+    std::remove(path);
+}
+
+TEST_CASE("a paged file should read pages on demand and keep the cache within its budget")
+{
+    const char* path = "txt-tests-paged.txt";
+    std::string text;
+    for (int i = 0; i < 1000; i++)
+    {
+        text += char('a' + i % 26);
+    }
+
+    auto file = std::fopen(path, "wb");
+    REQUIRE(file != nullptr);
+    std::fwrite(text.data(), 1, text.size(), file);
+    std::fclose(file);
+
+    TxtPagedFile paged;
+    REQUIRE(paged.open(path, 64, 16));
+    CHECK(paged.size() == 1000);
+    CHECK(paged.cachedSize() == 0);
+
+    CHECK(paged.at(999) == text[999]);
+    CHECK(paged.cachedSize() == 16);
+
+    std::string copied(300, ' ');
+    paged.copy(&copied[0], 7, 300);
+    CHECK(copied == text.substr(7, 300));
+    CHECK(paged.cachedSize() == 64);
+
+    // the page with offset 300 was used last, it has to survive
+    paged.at(0);
+    paged.at(20);
+    paged.at(40);
+    CHECK(paged.at(300) == text[300]);
+    CHECK(paged.cachedSize() == 64);
+
+    paged.setBudget(16);
+    CHECK(paged.cachedSize() == 16);
+
+    CHECK(!paged.open("txt-tests-missing/file.txt"));
+    std::remove(path);
+}
+
+TEST_CASE("a paged piece table should index lines and edit without making the text contiguous")
+{
+    const char* path = "txt-tests-paged-lines.txt";
+    std::string text;
+    for (int i = 0; i < 20000; i++)
+    {
+        text += "line " + std::to_string(i) + "\n";
+    }
+
+    auto file = std::fopen(path, "wb");
+    REQUIRE(file != nullptr);
+    std::fwrite(text.data(), 1, text.size(), file);
+    std::fclose(file);
+
+    TxtBuffer<TxtPieceStorage> buffer;
+    REQUIRE(buffer.openPaged(path, 4 * TXT_PAGE_SIZE));
+    CHECK(buffer.storage().paged());
+
+    CHECK(buffer.lineCount() == 20001);
+    CHECK(buffer.lineStart(12345) == txtcur(text.find("line 12345\n")));
+    CHECK(buffer.at(buffer.lineStart(19999) + 5) == '1');
+
+    buffer.addText(buffer.lineStart(3), 0, "new\n", 4);
+    CHECK(buffer.lineCount() == 20002);
+
+    std::string line(8, ' ');
+    buffer.copy(&line[0], buffer.lineStart(3), 8);
+    CHECK(line == "new\nline");
+
+    buffer.undo();
+    CHECK(std::string(buffer.buffer()) == text);
+
+    std::remove(path);
+}
+
+static std::string readFile(const char* path)
+{
+    std::string text;
+    auto file = std::fopen(path, "rb");
+    if (file == nullptr) return text;
+
+    char block[4096];
+    for (size_t count; (count = std::fread(block, 1, sizeof(block), file)) > 0; )
+    {
+        text.append(block, count);
+    }
+    std::fclose(file);
+    return text;
+}
+
+TEST_CASE_TEMPLATE("saving should write the text from the storage segments and replace the file", S, TxtStorages)
+{
+    const char* path = "txt-tests-save.txt";
+    std::string line;
+    for (int i = 0; i < 300; i++)
+    {
+        line += char('a' + i % 26);
+    }
+    line += '\n';
+
+    TxtBuffer<S> buffer;
+    for (int i = 0; i < 200; i++)
+    {
+        buffer.addText((i * 7919) % (buffer.bufferSize() + 1), 0, line);
+    }
+    buffer.removeText(500, 10000);
+    buffer.addText(3, 0, std::string_view("\0\r\n", 3));
+
+    int segments = 0;
+    buffer.storage().segments([&segments](const TxtSegment*, int count)
+    {
+        segments += count;
+        return true;
+    });
+    CHECK(segments >= 1);
+
+    auto file = std::fopen(path, "wb");
+    REQUIRE(file != nullptr);
+    std::fputs("old text", file);
+    std::fclose(file);
+
+    REQUIRE(buffer.save(path));
+    CHECK(readFile(path) == std::string(buffer.buffer(), buffer.bufferSize()));
+
+    CHECK(!buffer.save("txt-tests-missing/file.txt"));
+    std::remove(path);
+}
+
+TEST_CASE("saving a paged or mapped piece table over its own file should keep the text")
+{
+    // On Windows the save replaces a file the buffer still holds open,
+    // which works for a paged file, whose handle shares delete access,
+    // but not for a mapped one: a mapped view blocks the rename
+    const char* path = "txt-tests-save-paged.txt";
+    for (bool paged : { true, false })
+    {
+        std::string text;
+        for (int i = 0; i < 50000; i++)
+        {
+            text += "line " + std::to_string(i) + "\n";
+        }
+
+        auto file = std::fopen(path, "wb");
+        REQUIRE(file != nullptr);
+        std::fwrite(text.data(), 1, text.size(), file);
+        std::fclose(file);
+
+        {
+            TxtBuffer<TxtPieceStorage> buffer;
+            REQUIRE((paged ? buffer.openPaged(path, 2 * TXT_PAGE_SIZE) : buffer.open(path)));
+            buffer.addText(100000, 0, "inserted\n");
+            buffer.removeText(10, 20);
+
+#ifdef _WIN32
+            bool replaceable = paged;
+#else
+            bool replaceable = true;
+#endif
+            if (!replaceable)
+            {
+                // the failed save leaves the file and the buffer as they were
+                CHECK(!buffer.save(path));
+                CHECK(readFile(path) == text);
+                CHECK(buffer.dirty());
+            }
+            else
+            {
+                text.insert(100000, "inserted\n");
+                text.erase(10, 20);
+
+                REQUIRE(buffer.save(path));
+                CHECK(readFile(path) == text);
+
+                // the text still comes from the replaced file
+                buffer.addText(300000, 0, "again\n");
+                text.insert(300000, "again\n");
+                REQUIRE(buffer.save(path));
+                CHECK(readFile(path) == text);
+            }
+        }
+
+        CHECK(std::remove(path) == 0);
+    }
+}
+
+TEST_CASE("a file writer should write large segments in chunks at their offsets")
+{
+    const char* path = "txt-tests-writer.txt";
+    std::string large(5 * TXT_WRITE_CHUNK + 123, 'x');
+    for (size_t i = 0; i < large.size(); i += 4093)
+    {
+        large[i] = char('a' + i % 26);
+    }
+
+    std::vector<TxtSegment> segments;
+    std::string expected;
+    for (int i = 0; i < 3 * TXT_SEGMENT_BATCH; i++)
+    {
+        auto size = i % 7 == 3 ? txtsz(large.size()) - i : txtsz(i % 5);
+        segments.push_back({ large.data() + i, size });
+        expected.append(large.data() + i, size_t(size));
+    }
+
+    TxtFileWriter writer;
+    REQUIRE(writer.open(path));
+    REQUIRE(writer.write(segments.data(), int(segments.size())));
+    CHECK(writer.written() == txtsz(expected.size()));
+    REQUIRE(writer.commit());
+    CHECK(readFile(path) == expected);
+
+    std::remove(path);
+}
+
+TEST_CASE_TEMPLATE("saving in the background should write the snapshot while the buffer is edited", S, TxtStorages)
+{
+    const char* path = "txt-tests-background.txt";
+    TxtBuffer<S> buffer;
+    CHECK(!buffer.dirty());
+
+    std::string text;
+    for (int i = 0; i < 20000; i++)
+    {
+        text += "line " + std::to_string(i) + "\n";
+    }
+    buffer.load(text);
+    CHECK(!buffer.dirty());
+
+    buffer.addText(10, 0, "first edit\n");
+    CHECK(buffer.dirty());
+    text.insert(10, "first edit\n");
+
+    auto save = buffer.saveInBackground(path);
+    auto saved = buffer.version();
+    CHECK(save->version() == saved);
+    CHECK(save->size() == txtsz(text.size()));
+
+    for (int i = 0; i < 100; i++)
+    {
+        buffer.addText((i * 7919) % buffer.bufferSize(), 0, "typing");
+    }
+    buffer.removeText(0, 1000);
+
+    REQUIRE(save->wait());
+    CHECK(save->done());
+    CHECK(save->succeeded());
+    CHECK(save->written() == save->size());
+    CHECK(readFile(path) == text);
+
+    buffer.markSaved(save->version());
+    CHECK(buffer.dirty());
+    for (int i = 0; i < 101; i++)
+    {
+        buffer.undo();
+    }
+    CHECK(buffer.version() == saved);
+    CHECK(!buffer.dirty());
+
+    buffer.undo();
+    CHECK(buffer.dirty());
+    buffer.redo();
+    CHECK(!buffer.dirty());
+    buffer.redo();
+    CHECK(buffer.dirty());
+
+    REQUIRE(buffer.save(path));
+    CHECK(!buffer.dirty());
+
+    auto failing = buffer.saveInBackground("txt-tests-missing/file.txt");
+    CHECK(!failing->wait());
+    CHECK(!failing->succeeded());
+
+    std::remove(path);
+}
+
+static std::string snapshotText(const TxtSnapshot& snapshot)
+{
+    std::string text;
+    snapshot.segments([&text](const TxtSegment* segments, int count)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            text.append(segments[i].text, size_t(segments[i].size));
+        }
+        return true;
+    });
+    return text;
+}
+
+TEST_CASE_TEMPLATE("a snapshot should keep its text while the buffer is edited", S, TxtStorages)
+{
+    std::string text;
+    for (int i = 0; i < 5000; i++)
+    {
+        text += "line " + std::to_string(i) + "\n";
+    }
+
+    TxtBuffer<S> buffer;
+    buffer.load(text);
+    auto first = buffer.snapshot();
+    CHECK(first->size() == txtsz(text.size()));
+
+    // a reader on another thread while the buffer is edited
+    bool same = true;
+    std::thread reader([&first, &text, &same]()
+    {
+        for (int i = 0; i < 20; i++)
+        {
+            same = same && snapshotText(*first) == text;
+        }
+    });
+
+    buffer.addText(10, 0, "inserted\n");
+    buffer.removeText(100, 5000);
+    buffer.addText(buffer.bufferSize(), 0, std::string(100000, 'x'));
+    std::string edited(buffer.buffer(), buffer.bufferSize());
+
+    auto second = buffer.snapshot();
+    buffer.undo();
+    buffer.addText(0, 0, "changed again");
+    buffer.load("loaded");
+
+    reader.join();
+    CHECK(same);
+    CHECK(snapshotText(*first) == text);
+    CHECK(snapshotText(*second) == edited);
+
+    std::string part(20, '\0');
+    second->copy(&part[0], 5, 20);
+    CHECK(part == edited.substr(5, 20));
+
+    first.reset();
+    CHECK(snapshotText(*second) == edited);
+    CHECK(std::string(buffer.buffer(), buffer.bufferSize()) == "loaded");
+}
+
+TEST_CASE("a snapshot of a paged piece table should read the file through its own handle")
+{
+    const char* path = "txt-tests-snapshot-paged.txt";
+    std::string text;
+    for (int i = 0; i < 50000; i++)
+    {
+        text += "line " + std::to_string(i) + "\n";
+    }
+
+    auto file = std::fopen(path, "wb");
+    REQUIRE(file != nullptr);
+    std::fwrite(text.data(), 1, text.size(), file);
+    std::fclose(file);
+
+    TxtBuffer<TxtPieceStorage> buffer;
+    REQUIRE(buffer.openPaged(path, 2 * TXT_PAGE_SIZE));
+    auto snapshot = buffer.snapshot();
+    buffer.addText(1000, 0, "inserted\n");
+
+    std::string read;
+    std::thread reader([&snapshot, &read]()
+    {
+        read = snapshotText(*snapshot);
+    });
+    CHECK(buffer.lineCount() == 50002);
+    reader.join();
+
+    CHECK(read == text);
+    CHECK(buffer.storage().paged());
+    std::remove(path);
+}
+
+TEST_CASE("undo and redo on a rope should switch between persistent versions")
+{
+    CHECK(canRestore<TxtRopeStorage>::value);
+    CHECK(!canRestore<TxtPieceStorage>::value);
+
+    std::string text;
+    for (int i = 0; i < 20000; i++)
+    {
+        text += "line " + std::to_string(i) + "\n";
+    }
+
+    TxtBuffer<TxtRopeStorage> buffer;
+    buffer.load(text);
+
+    std::vector<std::string> versions = { text };
+    buffer.addText(100, 0, "typed");
+    buffer.removeText(5000, 70000);
+    buffer.addText(buffer.bufferSize(), 0, std::string(10000, 'x'));
+    buffer.removeText(0, buffer.bufferSize());
+    buffer.addText(0, 0, "replaced");
+    for (int i = 0; i < 5; i++)
+    {
+        buffer.undo();
+    }
+    for (int i = 0; i < 5; i++)
+    {
+        buffer.redo();
+        versions.push_back(std::string(buffer.buffer(), buffer.bufferSize()));
+    }
+    CHECK(versions.back() == "replaced");
+
+    for (int i = 4; i >= 0; i--)
+    {
+        REQUIRE(buffer.undo());
+        CHECK(std::string(buffer.buffer(), buffer.bufferSize()) == versions[size_t(i)]);
+        CHECK(buffer.lineCount() == txtsz(std::count(versions[size_t(i)].begin(), versions[size_t(i)].end(), '\n')) + 1);
+    }
+    CHECK(!buffer.undo());
+
+    for (int i = 1; i <= 5; i++)
+    {
+        REQUIRE(buffer.redo());
+        CHECK(std::string(buffer.buffer(), buffer.bufferSize()) == versions[size_t(i)]);
+    }
+    CHECK(!buffer.redo());
+
+    buffer.undo();
+    buffer.undo();
+    buffer.addText(3, 0, "new branch");
+    CHECK(!buffer.redo());
+    buffer.undo();
+    CHECK(std::string(buffer.buffer(), buffer.bufferSize()) == versions[3]);
+}
+
+TEST_CASE("the history should log event text contiguously and cut the redo events on a new edit")
+{
+    TxtHistory history;
+    history.clear(1);
+    CHECK(history.undoCount() == 0);
+    CHECK(history.redoCount() == 0);
+    CHECK(history.current().version == 1);
+
+    for (int i = 0; i < 1000; i++)
+    {
+        auto& event = history.add(EditEventTypes::Insertion, i, 1, 2 + i);
+        *history.addText(1) = char('a' + i % 26);
+        CHECK(event.text == size_t(i));
+    }
+    auto& pieced = history.add(EditEventTypes::Deletion, 0, 5, 2000);
+    history.pieceLog().push_back({ TxtPieceSources::Added, 0, 5 });
+    pieced.pieceCount = 1;
+    CHECK(history.undoCount() == 1001);
+
+    size_t count = 0;
+    auto undone = history.undo(count);
+    REQUIRE(undone != nullptr);
+    CHECK(undone->version == 2000);
+    CHECK(history.pieces(*undone)->length == 5);
+    for (int i = 0; i < 500; i++)
+    {
+        undone = history.undo(count);
+    }
+    CHECK(undone->position == 500);
+    CHECK(*history.text(*undone) == char('a' + 500 % 26));
+    CHECK(history.current().version == 501);
+    CHECK(history.redoCount() == 501);
+
+    auto redone = history.redo(count);
+    REQUIRE(redone != nullptr);
+    CHECK(redone->position == 500);
+
+    auto& branch = history.add(EditEventTypes::Insertion, 7, 3, 3000);
+    CHECK(branch.text == 501);
+    CHECK(branch.pieces == 0);
+    CHECK(history.redoCount() == 0);
+    CHECK(history.redo(count) == nullptr);
+    CHECK(history.undoCount() == 502);
+
+    history.clear(4000);
+    CHECK(history.undoCount() == 0);
+    CHECK(history.undo(count) == nullptr);
+}
+
+TEST_CASE_TEMPLATE("typing and deleting runs of characters should undo as one event each", S, TxtStorages)
+{
+    TxtBuffer<S> buffer;
+    TxtSelection<S> selection(&buffer);
+
+    for (auto c : std::string("hello world"))
+    {
+        selection.addChar(c);
+    }
+    CHECK(buffer.undoCount() == 2);
+    CHECK(buffer.undo());
+    CHECK(std::string(buffer.buffer(), buffer.bufferSize()) == "hello ");
+    CHECK(buffer.redo());
+    CHECK(std::string(buffer.buffer(), buffer.bufferSize()) == "hello world");
+
+    // a backspace run stops in front of the blank before the word, a
+    // forward delete run after a jump of the cursor
+    for (int i = 0; i < 6; i++)
+    {
+        selection.backspace(false, false);
+    }
+    CHECK(buffer.undoCount() == 4);
+    CHECK(buffer.undo());
+    CHECK(std::string(buffer.buffer(), buffer.bufferSize()) == "hello ");
+    CHECK(buffer.redo());
+    CHECK(std::string(buffer.buffer(), buffer.bufferSize()) == "hello");
+
+    selection.cursor = 0;
+    selection.addChar('>');
+    selection.del(false, false);
+    selection.del(false, false);
+    CHECK(std::string(buffer.buffer(), buffer.bufferSize()) == ">llo");
+    CHECK(buffer.undoCount() == 6);
+    CHECK(buffer.undo());
+    CHECK(std::string(buffer.buffer(), buffer.bufferSize()) == ">hello");
+    CHECK(buffer.redo());
+
+    // a paste, a save and a pause end a run
+    selection.cursor = buffer.bufferSize();
+    selection.addText("!!");
+    selection.addChar('?');
+    CHECK(buffer.undoCount() == 8);
+    buffer.markSaved(buffer.version());
+    selection.addChar('?');
+    CHECK(buffer.undoCount() == 9);
+    buffer.setRunPause(10);
+    std::this_thread::sleep_for(std::chrono::milliseconds(30));
+    selection.addChar('?');
+    CHECK(buffer.undoCount() == 10);
+    CHECK(buffer.undo());
+    CHECK(buffer.undo());
+    CHECK(!buffer.dirty());
+    CHECK(std::string(buffer.buffer(), buffer.bufferSize()) == ">llo!!?");
+
+    buffer.setRunPause(TXT_RUN_PAUSE);
+    buffer.load("");
+    for (int i = 0; i < 10000; i++)
+    {
+        buffer.addText(i, 0, "x", 1);
+    }
+    CHECK(buffer.undoCount() == 1);
+    CHECK(buffer.undo());
+    CHECK(buffer.bufferSize() == 0);
+}
+
+TEST_CASE_TEMPLATE("a transaction should undo and redo as one step and roll back when not committed", S, TxtStorages)
+{
+    TxtBuffer<S> buffer;
+    buffer.load("one two one three one");
+
+    buffer.addText(4, 3, "2");
+    CHECK(buffer.undoCount() == 1);
+    CHECK(std::string(buffer.buffer(), buffer.bufferSize()) == "one 2 one three one");
+
+    {
+        TxtTransaction<S> transaction(&buffer);
+        for (txtcur position : { 16, 6, 0 })
+        {
+            TxtTransaction<S> inner(&buffer);
+            buffer.removeText(position, 3);
+            buffer.addText(position, 0, "1");
+            inner.commit();
+        }
+        transaction.commit();
+    }
+    CHECK(std::string(buffer.buffer(), buffer.bufferSize()) == "1 2 1 three 1");
+    CHECK(buffer.undoCount() == 2);
+
+    buffer.addText(buffer.bufferSize(), 0, "!");
+    CHECK(buffer.undoCount() == 3);
+    CHECK(buffer.undo());
+    CHECK(buffer.undo());
+    CHECK(std::string(buffer.buffer(), buffer.bufferSize()) == "one 2 one three one");
+    CHECK(buffer.redoCount() == 2);
+    CHECK(buffer.redo());
+    CHECK(std::string(buffer.buffer(), buffer.bufferSize()) == "1 2 1 three 1");
+    CHECK(buffer.undo());
+    CHECK(buffer.undo());
+    CHECK(std::string(buffer.buffer(), buffer.bufferSize()) == "one two one three one");
+
+    {
+        TxtTransaction<S> transaction(&buffer);
+        buffer.removeText(0, 8);
+        buffer.addText(0, 0, "gone");
+    }
+    CHECK(std::string(buffer.buffer(), buffer.bufferSize()) == "one two one three one");
+    CHECK(buffer.undoCount() == 0);
+    CHECK(buffer.redoCount() == 0);
+    CHECK(!buffer.dirty());
+}
+
+TEST_CASE_TEMPLATE("a batch of edits should make every edit in one pass and undo as one step", S, TxtStorages)
+{
+    std::string text;
+    for (int i = 0; i < 200; i++)
+    {
+        text += "word " + std::to_string(i) + (i % 10 == 9 ? "\n" : " ");
+    }
+
+    // every batch shrinks, grows, and does both between its edits
+    std::vector<std::vector<std::pair<txtsz, std::string> > > batches = {
+        { { 4, "" }, { 1, "" }, { 3, "x" } },
+        { { 0, "longer" }, { 2, "four" }, { 1, "" } },
+        { { 5, "" }, { 0, "inserted text" }, { 0, "more" }, { 3, "" }, { 1, "ab" } },
+    };
+
+    for (auto& batch : batches)
+    {
+        TxtBuffer<S> buffer;
+        buffer.load(text);
+
+        std::vector<TxtEdit> edits;
+        auto expected = text;
+        txtsz shift = 0;
+        for (size_t i = 0; i < batch.size(); i++)
+        {
+            txtcur position = txtcur(i * 97 + 13);
+            edits.push_back({ position, batch[i].first, batch[i].second.data(), txtsz(batch[i].second.size()) });
+            expected.replace(size_t(position + shift), size_t(batch[i].first), batch[i].second);
+            shift += txtsz(batch[i].second.size()) - batch[i].first;
+        }
+
+        REQUIRE(buffer.applyEdits(edits));
+        CHECK(std::string(buffer.buffer(), buffer.bufferSize()) == expected);
+        CHECK(buffer.lineCount() == txtsz(std::count(expected.begin(), expected.end(), '\n')) + 1);
+        CHECK(buffer.undoCount() == 1);
+
+        CHECK(buffer.undo());
+        CHECK(std::string(buffer.buffer(), buffer.bufferSize()) == text);
+        CHECK(buffer.lineStart(1) == txtcur(text.find('\n') + 1));
+        CHECK(buffer.redo());
+        CHECK(std::string(buffer.buffer(), buffer.bufferSize()) == expected);
+    }
+
+    TxtBuffer<S> buffer;
+    buffer.load("abcdef");
+    CHECK(!buffer.applyEdits({ { 2, 2, "x", 1 }, { 3, 0, "y", 1 } }));
+    CHECK(!buffer.applyEdits({ { 4, 4, "x", 1 } }));
+    CHECK(buffer.applyEdits({ { 2, 0, "x", 1 }, { 2, 0, "y", 1 }, { 6, 0, "z", 1 } }));
+    CHECK(std::string(buffer.buffer(), buffer.bufferSize()) == "abxycdefz");
+    CHECK(buffer.undoCount() == 1);
+}
+
+TEST_CASE_TEMPLATE("typing with several cursors should edit at every cursor in one undo step", S, TxtStorages)
+{
+    TxtBuffer<S> buffer;
+    buffer.load("one\ntwo\nthree\n");
+
+    TxtMultiSelection<S> cursors(&buffer);
+    cursors.addCursorBelow();
+    cursors.addCursorBelow();
+    CHECK(cursors.count() == 3);
+    CHECK(cursors[1].cursor == 4);
+
+    cursors.addChar('>');
+    cursors.addChar(' ');
+    CHECK(std::string(buffer.buffer(), buffer.bufferSize()) == "> one\n> two\n> three\n");
+    CHECK(buffer.undoCount() == 2);
+    CHECK(cursors[2].cursor == 14);
+
+    cursors.end(false, false);
+    cursors.backspace(false, false);
+    CHECK(std::string(buffer.buffer(), buffer.bufferSize()) == "> on\n> tw\n> thre\n");
+    CHECK(buffer.undo());
+    CHECK(std::string(buffer.buffer(), buffer.bufferSize()) == "> one\n> two\n> three\n");
+
+    // cursors that meet are merged, a selection swallows the cursors in it
+    cursors.home(false, false);
+    cursors.moveLeft(false, false);
+    CHECK(cursors.count() == 3);
+    cursors.add(0, 5);
+    CHECK(cursors.count() == 2);
+    CHECK(cursors[0].cursorLength == 5);
+    cursors.addText("x");
+    CHECK(std::string(buffer.buffer(), buffer.bufferSize()) == "x\n> twox\n> three\n");
+    CHECK(cursors[1].cursor == 8);
+    CHECK(cursors.find(2) == 1);
+    CHECK(cursors.find(9) == 2);
+
+    // a single cursor types runs again
+    cursors.collapse();
+    CHECK(cursors.count() == 1);
+    cursors.addChar('a');
+    cursors.addChar('b');
+    CHECK(std::string(buffer.buffer(), buffer.bufferSize()) == "xab\n> twox\n> three\n");
+    CHECK(buffer.undo());
+    CHECK(std::string(buffer.buffer(), buffer.bufferSize()) == "x\n> twox\n> three\n");
+}
+
+TEST_CASE_TEMPLATE("a block selection should edit the same columns of every line in one undo step", S, TxtStorages)
+{
+    TxtBuffer<S> buffer;
+    buffer.load("first line\nab\nthird line\r\nfourth\n");
+
+    CHECK(buffer.columnOffset(1, 1) == 12);
+    CHECK(buffer.columnOffset(1, 5) == 13);
+    CHECK(buffer.columnOffset(2, 20) == 24);
+
+    TxtBlockSelection<S> block(&buffer);
+    block.select(buffer.columnOffset(3, 5), 1);
+    CHECK(block.firstLine == 0);
+    CHECK(block.lastLine == 3);
+    CHECK(block.leftColumn == 1);
+    CHECK(block.rightColumn == 5);
+
+    block.addText("--");
+    CHECK(std::string(buffer.buffer(), buffer.bufferSize()) == "f-- line\na--\nt-- line\r\nf--h\n");
+    CHECK(buffer.undoCount() == 1);
+    CHECK(block.leftColumn == 3);
+    CHECK(block.rightColumn == 3);
+
+    block.backspace(false, false);
+    block.addChar('+');
+    CHECK(std::string(buffer.buffer(), buffer.bufferSize()) == "f-+ line\na-+\nt-+ line\r\nf-+h\n");
+
+    block.firstLine = 1;
+    block.lastLine = 2;
+    block.del(false, false);
+    CHECK(std::string(buffer.buffer(), buffer.bufferSize()) == "f-+ line\na-+\nt-+line\r\nf-+h\n");
+
+    CHECK(buffer.undoCount() == 4);
+    for (int i = 0; i < 4; i++)
+    {
+        CHECK(buffer.undo());
+    }
+    CHECK(std::string(buffer.buffer(), buffer.bufferSize()) == "first line\nab\nthird line\r\nfourth\n");
+}
+
+TEST_CASE_TEMPLATE("anchors should follow the edits, undo and redo of a buffer", S, TxtStorages)
+{
+    TxtBuffer<S> buffer;
+    buffer.load("one two three");
+
+    auto& anchors = buffer.anchors();
+    auto front = anchors.add(0);
+    auto two = anchors.add(4);
+    auto inside = anchors.add(5);
+    auto back = anchors.add(13);
+
+    buffer.addText(4, 0, "and ");
+    CHECK(anchors.position(front) == 0);
+    CHECK(anchors.position(two) == 4);
+    CHECK(anchors.position(inside) == 9);
+    CHECK(anchors.position(back) == 17);
+
+    buffer.removeText(8, 4);
+    CHECK(anchors.position(two) == 4);
+    CHECK(anchors.position(inside) == 8);
+    CHECK(anchors.position(back) == 13);
+
+    CHECK(buffer.undo());
+    CHECK(anchors.position(inside) == 8);
+    CHECK(anchors.position(back) == 17);
+    CHECK(buffer.undo());
+    CHECK(anchors.position(back) == 13);
+    CHECK(anchors.position(inside) == 4);
+    CHECK(buffer.redo());
+    CHECK(anchors.position(inside) == 4);
+    CHECK(anchors.position(back) == 17);
+
+    // the end of a replaced range is erased with it
+    TxtEdit edits[] = { { 0, 3, "1", 1 }, { 11, 1, "", 0 }, { 14, 3, "ree!", 4 } };
+    CHECK(buffer.applyEdits(edits, 3));
+    CHECK(std::string(buffer.buffer(), buffer.bufferSize()) == "1 and twothree!");
+    CHECK(anchors.position(front) == 0);
+    CHECK(anchors.position(two) == 2);
+    CHECK(anchors.position(back) == 11);
+    CHECK(buffer.undo());
+    CHECK(anchors.position(two) == 4);
+    CHECK(anchors.position(back) == 14);
+
+    anchors.remove(inside);
+    CHECK(anchors.count() == 3);
+    buffer.load("reloaded");
+    CHECK(anchors.count() == 0);
+}
+
+TEST_CASE_TEMPLATE("decorations should follow the edits, undo and redo of a buffer", S, TxtStorages)
+{
+    TxtBuffer<S> buffer;
+    buffer.load("int main() { return 0; }");
+
+    auto& decorations = buffer.decorations();
+    auto keyword = decorations.add(0, 3, 1);
+    auto body = decorations.add(11, 24, 2);
+    auto number = decorations.add(20, 21, 3);
+
+    buffer.addText(0, 0, "static ");
+    buffer.addText(26, 0, " 1 +");
+    CHECK(std::string(buffer.buffer(), buffer.bufferSize()) == "static int main() { return 1 + 0; }");
+    CHECK(decorations.get(keyword).start == 7);
+    CHECK(decorations.get(keyword).end == 10);
+    CHECK(decorations.get(body).start == 18);
+    CHECK(decorations.get(body).end == 35);
+    CHECK(decorations.get(number).start == 31);
+
+    std::vector<TxtDecoration> found;
+    decorations.find(25, 32, found);
+    REQUIRE(found.size() == 2);
+    CHECK(found[0].style == 2);
+    CHECK(found[1].style == 3);
+
+    buffer.removeText(27, 5);
+    CHECK(decorations.get(number).start == 27);
+    CHECK(decorations.get(number).end == 27);
+    CHECK(decorations.get(body).end == 30);
+
+    CHECK(buffer.undo());
+    CHECK(decorations.get(body).end == 35);
+    CHECK(buffer.undo());
+    CHECK(buffer.undo());
+    CHECK(decorations.get(keyword).start == 0);
+    CHECK(decorations.get(body).start == 11);
+    CHECK(decorations.get(body).end == 24);
+    CHECK(buffer.redo());
+    CHECK(decorations.get(keyword).start == 7);
+
+    decorations.remove(body);
+    found.clear();
+    decorations.find(0, buffer.bufferSize(), found);
+    CHECK(found.size() == 2);
+}
+
+TEST_CASE("positions should map between versions like anchors through the edits between them")
+{
+    TxtBuffer<TxtArrayStorage> buffer;
+    buffer.load(std::string(500, 'x'));
+
+    std::vector<unsigned long> versions(1, buffer.version());
+    std::vector<std::vector<txtcur> > moved(1);
+    std::vector<int> anchors;
+    for (txtcur position = 0; position <= 500; position += 25)
+    {
+        anchors.push_back(buffer.anchors().add(position));
+        moved[0].push_back(position);
+    }
+
+    unsigned seed = 2024;
+    for (int i = 0; i < 300; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        auto position = txtcur((seed >> 8) % (buffer.bufferSize() + 1));
+        if (seed % 3 == 0) buffer.removeText(position, std::min(txtsz((seed >> 4) % 30), buffer.bufferSize() - position));
+        else buffer.addText(position, 0, std::string((seed >> 4) % 20 + 1, 'y'));
+        buffer.breakRun();
+
+        versions.push_back(buffer.version());
+        moved.emplace_back();
+        for (auto anchor : anchors) moved.back().push_back(buffer.anchors().position(anchor));
+    }
+
+    for (size_t v = 0; v < versions.size(); v += 7)
+    {
+        for (size_t a = 0; a < anchors.size(); a++)
+        {
+            CHECK(buffer.mapPosition(moved[0][a], versions[0], versions[v]) == moved[v][a]);
+        }
+    }
+
+    // going back, every way between two versions gives the same position
+    for (size_t v = 1; v < versions.size(); v += 13)
+    {
+        for (txtcur position = 0; position < 400; position += 37)
+        {
+            auto stepped = position;
+            for (auto back = v; back > 3; back--) stepped = buffer.mapPosition(stepped, versions[back], versions[back - 1]);
+            if (v > 3) CHECK(buffer.mapPosition(position, versions[v], versions[3]) == stepped);
+
+            auto forward = buffer.mapPosition(position, versions[3], versions[v]);
+            auto steppedForward = position;
+            for (size_t next = 3; next < v; next++) steppedForward = buffer.mapPosition(steppedForward, versions[next], versions[next + 1]);
+            if (v > 3) CHECK(forward == steppedForward);
+        }
+    }
+
+    // undone versions that a new edit cut off are gone
+    CHECK(buffer.undo());
+    CHECK(buffer.undo());
+    CHECK(buffer.mapPosition(moved[0][3], versions[0], versions.back()) == moved.back()[3]);
+    buffer.addText(0, 0, "z");
+    CHECK(buffer.mapPosition(10, versions[0], versions.back()) == -1);
+    CHECK(buffer.mapPosition(moved[0][3], versions[0], buffer.version()) == moved[versions.size() - 3][3] + 1);
+
+    // and so are the versions merged into a run of keystrokes
+    auto typed = buffer.version();
+    buffer.addText(1, 0, "z");
+    CHECK(buffer.mapPosition(0, typed, buffer.version()) == -1);
+}
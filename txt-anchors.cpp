@@ -0,0 +1,201 @@
+#include "txt-anchors.h"
+
+TxtAnchors::TxtAnchors()
+    : _root(-1), _seed(2463534242u), _count(0)
+{ }
+
+void TxtAnchors::clear()
+{
+    _nodes.clear();
+    _free.clear();
+    _root = -1;
+    _count = 0;
+}
+
+void TxtAnchors::tag(int node, txtcur collapse, txtsz shift)
+{
+    if (node < 0) return;
+
+    auto& n = _nodes[node];
+    if (collapse >= 0)
+    {
+        n.position = collapse;
+        n.collapse = collapse;
+        n.shift = 0;
+    }
+    n.position += shift;
+    n.shift += shift;
+}
+
+void TxtAnchors::push(int node)
+{
+    auto& n = _nodes[node];
+    if (n.collapse < 0 && n.shift == 0) return;
+
+    tag(n.left, n.collapse, n.shift);
+    tag(n.right, n.collapse, n.shift);
+    n.collapse = -1;
+    n.shift = 0;
+}
+
+void TxtAnchors::setLeft(int node, int left)
+{
+    _nodes[node].left = left;
+    if (left >= 0) _nodes[left].parent = node;
+}
+
+void TxtAnchors::setRight(int node, int right)
+{
+    _nodes[node].right = right;
+    if (right >= 0) _nodes[right].parent = node;
+}
+
+int TxtAnchors::merge(int left, int right)
+{
+    if (left < 0) return right;
+    if (right < 0) return left;
+
+    if (_nodes[left].priority > _nodes[right].priority)
+    {
+        push(left);
+        setRight(left, merge(_nodes[left].right, right));
+        return left;
+    }
+
+    push(right);
+    setLeft(right, merge(left, _nodes[right].left));
+    return right;
+}
+
+// Puts the anchors in front of position in left, and with inclusive the
+// ones at it as well, the rest in right
+void TxtAnchors::split(int node, txtcur position, bool inclusive, int& left, int& right)
+{
+    if (node < 0)
+    {
+        left = right = -1;
+        return;
+    }
+
+    push(node);
+
+    auto& n = _nodes[node];
+    if (n.position < position || (inclusive && n.position == position))
+    {
+        int rightLeft, rightRight;
+        split(n.right, position, inclusive, rightLeft, rightRight);
+        setRight(node, rightLeft);
+        left = node;
+        right = rightRight;
+    }
+    else
+    {
+        int leftLeft, leftRight;
+        split(n.left, position, inclusive, leftLeft, leftRight);
+        setLeft(node, leftRight);
+        left = leftLeft;
+        right = node;
+    }
+
+    if (left >= 0) _nodes[left].parent = -1;
+    if (right >= 0) _nodes[right].parent = -1;
+}
+
+int TxtAnchors::add(txtcur position)
+{
+    // xorshift, the priorities only have to be spread well
+    _seed ^= _seed << 13;
+    _seed ^= _seed >> 17;
+    _seed ^= _seed << 5;
+
+    Node node = { -1, -1, -1, _seed, position, -1, 0 };
+
+    int anchor;
+    if (!_free.empty())
+    {
+        anchor = _free.back();
+        _free.pop_back();
+        _nodes[anchor] = node;
+    }
+    else
+    {
+        _nodes.push_back(node);
+        anchor = int(_nodes.size() - 1);
+    }
+
+    int left, right;
+    split(_root, position, true, left, right);
+    _root = merge(merge(left, anchor), right);
+    _nodes[_root].parent = -1;
+    _count++;
+
+    return anchor;
+}
+
+void TxtAnchors::remove(int anchor)
+{
+    // The children take the place of the anchor, under the same tags
+    push(anchor);
+
+    auto& n = _nodes[anchor];
+    auto parent = n.parent;
+    auto merged = merge(n.left, n.right);
+
+    if (parent < 0)
+    {
+        _root = merged;
+        if (merged >= 0) _nodes[merged].parent = -1;
+    }
+    else if (_nodes[parent].left == anchor)
+    {
+        setLeft(parent, merged);
+    }
+    else
+    {
+        setRight(parent, merged);
+    }
+
+    _free.push_back(anchor);
+    _count--;
+}
+
+txtcur TxtAnchors::position(int anchor) const
+{
+    // the nearer an ancestor, the older its tag
+    auto position = _nodes[anchor].position;
+    for (auto node = _nodes[anchor].parent; node >= 0; node = _nodes[node].parent)
+    {
+        if (_nodes[node].collapse >= 0) position = _nodes[node].collapse;
+        position += _nodes[node].shift;
+    }
+    return position;
+}
+
+size_t TxtAnchors::count() const
+{
+    return _count;
+}
+
+void TxtAnchors::insert(txtcur position, txtsz size)
+{
+    if (_root < 0 || size <= 0) return;
+
+    int left, right;
+    split(_root, position, true, left, right);
+    tag(right, -1, size);
+    _root = merge(left, right);
+    _nodes[_root].parent = -1;
+}
+
+void TxtAnchors::erase(txtcur position, txtsz size)
+{
+    if (_root < 0 || size <= 0) return;
+
+    int left, middle, right;
+    split(_root, position, true, left, right);
+    split(right, position + size, false, middle, right);
+    tag(middle, position, 0);
+    tag(right, -1, -size);
+    _root = merge(merge(left, middle), right);
+    _nodes[_root].parent = -1;
+}
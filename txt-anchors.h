@@ -0,0 +1,64 @@
+#ifndef TXT_ANCHORS_H
+#define TXT_ANCHORS_H
+
+#include "txt-storage.h"
+
+/*
+ * --- Anchors ---
+ * An anchor is a position that moves along with the text around it.
+ * Text inserted in front of an anchor shifts it back, text inserted
+ * right at it goes behind it, and erasing text around it pulls it to
+ * the start of the erased range. Bookmarks, search hits or diagnostics
+ * keep an anchor instead of a txtcur, which goes stale with any edit.
+ *
+ * The anchors are kept in a treap ordered by position, the nodes live
+ * in one vector and refer to each other by index. An edit splits off
+ * the anchors it moves and tags the root of that subtree with the
+ * shift, or with the position the anchors of an erased range collapse
+ * to. The tags are pushed down to the children only when a later
+ * operation passes through, so an edit costs O(log n) however many
+ * anchors it moves. Reading an anchor applies the tags on its way up
+ * to the root. A removed anchor's handle is reused.
+ */
+
+class TxtAnchors
+{
+    struct Node
+    {
+        int left;
+        int right;
+        int parent;
+        unsigned priority;
+        txtcur position;    // still to be tagged by the ancestors
+        txtcur collapse;    // pending for the children, -1 when none, comes before the shift
+        txtsz shift;        // pending for the children
+    };
+
+    std::vector<Node> _nodes;
+    std::vector<int> _free;
+    int _root;
+    unsigned _seed;
+    size_t _count;
+
+    void tag(int node, txtcur collapse, txtsz shift);
+    void push(int node);
+    void setLeft(int node, int left);
+    void setRight(int node, int right);
+    int merge(int left, int right);
+    void split(int node, txtcur position, bool inclusive, int& left, int& right);
+public:
+    TxtAnchors();
+
+    void clear();
+
+    int add(txtcur position);
+    void remove(int anchor);
+    txtcur position(int anchor) const;
+    size_t count() const;
+
+    // The edits of the text
+    void insert(txtcur position, txtsz size);
+    void erase(txtcur position, txtsz size);
+};
+
+#endif // TXT_ANCHORS_H
@@ -0,0 +1,274 @@
+#include "txt-decorations.h"
+
+TxtDecorations::TxtDecorations()
+    : _root(-1), _seed(2463534242u), _count(0)
+{ }
+
+void TxtDecorations::clear()
+{
+    _nodes.clear();
+    _free.clear();
+    _root = -1;
+    _count = 0;
+}
+
+void TxtDecorations::tag(int node, txtsz shift)
+{
+    if (node < 0) return;
+
+    auto& n = _nodes[node];
+    n.start += shift;
+    n.end += shift;
+    n.maxEnd += shift;
+    n.shift += shift;
+}
+
+void TxtDecorations::push(int node)
+{
+    auto& n = _nodes[node];
+    if (n.shift == 0) return;
+
+    tag(n.left, n.shift);
+    tag(n.right, n.shift);
+    n.shift = 0;
+}
+
+void TxtDecorations::update(int node)
+{
+    // the children still miss the shift of node
+    auto& n = _nodes[node];
+    n.maxEnd = n.end;
+    if (n.left >= 0 && _nodes[n.left].maxEnd + n.shift > n.maxEnd) n.maxEnd = _nodes[n.left].maxEnd + n.shift;
+    if (n.right >= 0 && _nodes[n.right].maxEnd + n.shift > n.maxEnd) n.maxEnd = _nodes[n.right].maxEnd + n.shift;
+}
+
+void TxtDecorations::setLeft(int node, int left)
+{
+    _nodes[node].left = left;
+    if (left >= 0) _nodes[left].parent = node;
+}
+
+void TxtDecorations::setRight(int node, int right)
+{
+    _nodes[node].right = right;
+    if (right >= 0) _nodes[right].parent = node;
+}
+
+int TxtDecorations::merge(int left, int right)
+{
+    if (left < 0) return right;
+    if (right < 0) return left;
+
+    if (_nodes[left].priority > _nodes[right].priority)
+    {
+        push(left);
+        setRight(left, merge(_nodes[left].right, right));
+        update(left);
+        return left;
+    }
+
+    push(right);
+    setLeft(right, merge(left, _nodes[right].left));
+    update(right);
+    return right;
+}
+
+// Puts the spans that start in front of position in left, the rest in
+// right
+void TxtDecorations::split(int node, txtcur position, int& left, int& right)
+{
+    if (node < 0)
+    {
+        left = right = -1;
+        return;
+    }
+
+    push(node);
+
+    auto& n = _nodes[node];
+    if (n.start < position)
+    {
+        int rightLeft, rightRight;
+        split(n.right, position, rightLeft, rightRight);
+        setRight(node, rightLeft);
+        left = node;
+        right = rightRight;
+    }
+    else
+    {
+        int leftLeft, leftRight;
+        split(n.left, position, leftLeft, leftRight);
+        setLeft(node, leftRight);
+        left = leftLeft;
+        right = node;
+    }
+    update(node);
+
+    if (left >= 0) _nodes[left].parent = -1;
+    if (right >= 0) _nodes[right].parent = -1;
+}
+
+// Grows the spans that start in front of position and end behind it
+void TxtDecorations::grow(int node, txtcur position, txtsz size)
+{
+    if (node < 0 || _nodes[node].maxEnd <= position) return;
+
+    push(node);
+    if (_nodes[node].end > position) _nodes[node].end += size;
+    grow(_nodes[node].left, position, size);
+    grow(_nodes[node].right, position, size);
+    update(node);
+}
+
+// Cuts the erased range out of the spans that start in front of it
+void TxtDecorations::cut(int node, txtcur position, txtsz size)
+{
+    if (node < 0 || _nodes[node].maxEnd <= position) return;
+
+    push(node);
+    auto& n = _nodes[node];
+    if (n.end > position) n.end = n.end >= position + size ? n.end - size : position;
+    cut(n.left, position, size);
+    cut(n.right, position, size);
+    update(node);
+}
+
+// Moves the spans that start in the erased range to its start
+void TxtDecorations::collapse(int node, txtcur position, txtsz size)
+{
+    if (node < 0) return;
+
+    push(node);
+    auto& n = _nodes[node];
+    n.start = position;
+    n.end = n.end >= position + size ? n.end - size : position;
+    collapse(n.left, position, size);
+    collapse(n.right, position, size);
+    update(node);
+}
+
+int TxtDecorations::add(txtcur start, txtcur end, int style)
+{
+    // xorshift, the priorities only have to be spread well
+    _seed ^= _seed << 13;
+    _seed ^= _seed >> 17;
+    _seed ^= _seed << 5;
+
+    if (end < start) end = start;
+    Node node = { -1, -1, -1, _seed, start, end, end, 0, style };
+
+    int decoration;
+    if (!_free.empty())
+    {
+        decoration = _free.back();
+        _free.pop_back();
+        _nodes[decoration] = node;
+    }
+    else
+    {
+        _nodes.push_back(node);
+        decoration = int(_nodes.size() - 1);
+    }
+
+    int left, right;
+    split(_root, start, left, right);
+    _root = merge(merge(left, decoration), right);
+    _nodes[_root].parent = -1;
+    _count++;
+
+    return decoration;
+}
+
+void TxtDecorations::remove(int decoration)
+{
+    // The children take the place of the span, under the same shifts
+    push(decoration);
+
+    auto& n = _nodes[decoration];
+    auto parent = n.parent;
+    auto merged = merge(n.left, n.right);
+
+    if (parent < 0)
+    {
+        _root = merged;
+        if (merged >= 0) _nodes[merged].parent = -1;
+    }
+    else if (_nodes[parent].left == decoration)
+    {
+        setLeft(parent, merged);
+    }
+    else
+    {
+        setRight(parent, merged);
+    }
+
+    for (auto node = parent; node >= 0; node = _nodes[node].parent)
+    {
+        update(node);
+    }
+
+    _free.push_back(decoration);
+    _count--;
+}
+
+TxtDecoration TxtDecorations::get(int decoration) const
+{
+    txtsz shift = 0;
+    for (auto node = _nodes[decoration].parent; node >= 0; node = _nodes[node].parent)
+    {
+        shift += _nodes[node].shift;
+    }
+
+    auto& n = _nodes[decoration];
+    return { n.start + shift, n.end + shift, n.style };
+}
+
+size_t TxtDecorations::count() const
+{
+    return _count;
+}
+
+void TxtDecorations::find(int node, txtsz shift, txtcur from, txtcur to, std::vector<TxtDecoration>& decorations) const
+{
+    if (node < 0 || _nodes[node].maxEnd + shift <= from) return;
+
+    auto& n = _nodes[node];
+    find(n.left, shift + n.shift, from, to, decorations);
+
+    // nothing behind a span that starts behind the range can overlap it
+    if (n.start + shift >= to) return;
+
+    if (n.end + shift > from) decorations.push_back({ n.start + shift, n.end + shift, n.style });
+    find(n.right, shift + n.shift, from, to, decorations);
+}
+
+void TxtDecorations::find(txtcur from, txtcur to, std::vector<TxtDecoration>& decorations) const
+{
+    find(_root, 0, from, to, decorations);
+}
+
+void TxtDecorations::insert(txtcur position, txtsz size)
+{
+    if (_root < 0 || size <= 0) return;
+
+    int left, right;
+    split(_root, position, left, right);
+    grow(left, position, size);
+    tag(right, size);
+    _root = merge(left, right);
+    _nodes[_root].parent = -1;
+}
+
+void TxtDecorations::erase(txtcur position, txtsz size)
+{
+    if (_root < 0 || size <= 0) return;
+
+    int left, middle, right;
+    split(_root, position, left, right);
+    split(right, position + size, middle, right);
+    cut(left, position, size);
+    collapse(middle, position, size);
+    tag(right, -size);
+    _root = merge(merge(left, middle), right);
+    _nodes[_root].parent = -1;
+}
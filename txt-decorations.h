@@ -0,0 +1,82 @@
+#ifndef TXT_DECORATIONS_H
+#define TXT_DECORATIONS_H
+
+#include "txt-storage.h"
+
+/*
+ * --- Decorations ---
+ * A decoration gives the text from start up to end a style, which is
+ * only an id to whoever paints it: a syntax colour, a search hit, an
+ * error squiggle. Like anchors the spans move with the edits. Text
+ * inserted inside a span grows it, text inserted at its start or end
+ * does not; erasing text shrinks the spans it overlaps, down to empty
+ * spans that stay until they are removed.
+ *
+ * The spans are kept in a treap ordered by start, every node caches the
+ * largest end below it, which makes it an interval tree: a query only
+ * goes into the subtrees that can hold a span of the range, so painting
+ * the visible lines costs O(log n + k) for k spans, whatever the size of
+ * the text. An edit tags the subtree of the spans behind it with their
+ * shift, which is pushed down to the children only when a later
+ * operation passes through; the spans the edit overlaps are changed one
+ * by one. A removed decoration's handle is reused.
+ */
+
+struct TxtDecoration
+{
+    txtcur start;
+    txtcur end;
+    int style;
+};
+
+class TxtDecorations
+{
+    struct Node
+    {
+        int left;
+        int right;
+        int parent;
+        unsigned priority;
+        txtcur start;       // still to be shifted by the ancestors, like end and maxEnd
+        txtcur end;
+        txtcur maxEnd;      // the largest end in this subtree
+        txtsz shift;        // pending for the children
+        int style;
+    };
+
+    std::vector<Node> _nodes;
+    std::vector<int> _free;
+    int _root;
+    unsigned _seed;
+    size_t _count;
+
+    void tag(int node, txtsz shift);
+    void push(int node);
+    void update(int node);
+    void setLeft(int node, int left);
+    void setRight(int node, int right);
+    int merge(int left, int right);
+    void split(int node, txtcur position, int& left, int& right);
+    void grow(int node, txtcur position, txtsz size);
+    void cut(int node, txtcur position, txtsz size);
+    void collapse(int node, txtcur position, txtsz size);
+    void find(int node, txtsz shift, txtcur from, txtcur to, std::vector<TxtDecoration>& decorations) const;
+public:
+    TxtDecorations();
+
+    void clear();
+
+    int add(txtcur start, txtcur end, int style);
+    void remove(int decoration);
+    TxtDecoration get(int decoration) const;
+    size_t count() const;
+
+    // Appends the spans that overlap from up to to, ordered by start
+    void find(txtcur from, txtcur to, std::vector<TxtDecoration>& decorations) const;
+
+    // The edits of the text
+    void insert(txtcur position, txtsz size);
+    void erase(txtcur position, txtsz size);
+};
+
+#endif // TXT_DECORATIONS_H
@@ -0,0 +1,1069 @@
+#include "txt-file.h"
+#include "txt-kernels.h"
+#include <limits>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#if !defined(_WIN32) && defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define TXT_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+static const txtchr emptyText[1] = { '\0' };
+
+bool txtFileSize(long long fileSize, txtsz& size)
+{
+    if (fileSize < 0 || (unsigned long long)fileSize > (unsigned long long)std::numeric_limits<txtsz>::max())
+    {
+#ifdef _WIN32
+        SetLastError(ERROR_FILE_TOO_LARGE);
+#else
+        errno = EFBIG;
+#endif
+        return false;
+    }
+
+    size = txtsz(fileSize);
+    return true;
+}
+
+TxtFileMapping::TxtFileMapping()
+    : _data(emptyText), _size(0), _mappedSize(0), _terminated(true)
+{ }
+
+TxtFileMapping::TxtFileMapping(TxtFileMapping&& other)
+    : _data(other._data), _size(other._size), _mappedSize(other._mappedSize), _terminated(other._terminated)
+{
+    other._data = emptyText;
+    other._size = 0;
+    other._mappedSize = 0;
+    other._terminated = true;
+}
+
+TxtFileMapping::~TxtFileMapping()
+{
+    close();
+}
+
+TxtFileMapping& TxtFileMapping::operator=(TxtFileMapping&& other)
+{
+    if (this != &other)
+    {
+        close();
+
+        _data = other._data;
+        _size = other._size;
+        _mappedSize = other._mappedSize;
+        _terminated = other._terminated;
+
+        other._data = emptyText;
+        other._size = 0;
+        other._mappedSize = 0;
+        other._terminated = true;
+    }
+
+    return *this;
+}
+
+#ifdef _WIN32
+
+bool TxtFileMapping::open(const char* path)
+{
+    close();
+
+    auto file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) return false;
+
+    LARGE_INTEGER fileSize;
+    txtsz size;
+    if (!GetFileSizeEx(file, &fileSize) || !txtFileSize(fileSize.QuadPart, size))
+    {
+        CloseHandle(file);
+        return false;
+    }
+
+    // an empty file can not be mapped, it is just an empty text
+    if (size == 0)
+    {
+        CloseHandle(file);
+        return true;
+    }
+
+    auto mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    CloseHandle(file);
+    if (mapping == nullptr) return false;
+
+    auto view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if (view == nullptr) return false;
+
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+
+    _data = (const txtchr*)view;
+    _size = size;
+    _mappedSize = _size;
+    _terminated = _size % info.dwPageSize != 0;
+
+    return true;
+}
+
+void TxtFileMapping::close()
+{
+    if (_mappedSize > 0) UnmapViewOfFile(_data);
+
+    _data = emptyText;
+    _size = 0;
+    _mappedSize = 0;
+    _terminated = true;
+}
+
+void TxtFileMapping::advise(TxtAccessPatterns pattern) const
+{
+    // Windows has no access hints for views of a mapping, the cache
+    // manager picks up sequential reads by itself
+}
+
+#else
+
+bool TxtFileMapping::open(const char* path)
+{
+    close();
+
+    int file = ::open(path, O_RDONLY);
+    if (file < 0) return false;
+
+    struct stat info;
+    txtsz size;
+    if (fstat(file, &info) != 0 || !txtFileSize(info.st_size, size))
+    {
+        ::close(file);
+        return false;
+    }
+
+    auto page = txtsz(sysconf(_SC_PAGESIZE));
+    auto mappedSize = (size / page + 1) * page;
+
+    // Reserve the file plus at least one page of zeroes and map the file
+    // over the start of it
+    auto base = mmap(nullptr, mappedSize, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+    {
+        ::close(file);
+        return false;
+    }
+
+    if (size > 0 && mmap(base, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, file, 0) == MAP_FAILED)
+    {
+        munmap(base, mappedSize);
+        ::close(file);
+        return false;
+    }
+
+    ::close(file);
+
+    _data = (const txtchr*)base;
+    _size = size;
+    _mappedSize = mappedSize;
+    _terminated = true;
+
+    return true;
+}
+
+void TxtFileMapping::close()
+{
+    if (_mappedSize > 0) munmap((void*)_data, _mappedSize);
+
+    _data = emptyText;
+    _size = 0;
+    _mappedSize = 0;
+    _terminated = true;
+}
+
+void TxtFileMapping::advise(TxtAccessPatterns pattern) const
+{
+    if (_size == 0) return;
+
+    int advice = MADV_NORMAL;
+    switch (pattern)
+    {
+    case TxtAccessPatterns::Sequential: advice = MADV_SEQUENTIAL; break;
+    case TxtAccessPatterns::Random: advice = MADV_RANDOM; break;
+    case TxtAccessPatterns::WillNeed: advice = MADV_WILLNEED; break;
+    default: break;
+    }
+
+    madvise((void*)_data, _size, advice);
+}
+
+#endif
+
+const txtchr* TxtFileMapping::data() const
+{
+    return _data;
+}
+
+txtsz TxtFileMapping::size() const
+{
+    return _size;
+}
+
+bool TxtFileMapping::terminated() const
+{
+    return _terminated;
+}
+
+TxtPagedFile::TxtPagedFile()
+    : _file(-1), _size(0), _pageSize(TXT_PAGE_SIZE), _budget(TXT_PAGE_CACHE_BUDGET)
+{ }
+
+TxtPagedFile::TxtPagedFile(TxtPagedFile&& other)
+    : _file(other._file), _size(other._size), _pageSize(other._pageSize), _budget(other._budget),
+      _pages(std::move(other._pages)), _lookup(std::move(other._lookup))
+{
+    other._file = -1;
+    other._size = 0;
+    other._pages.clear();
+    other._lookup.clear();
+}
+
+TxtPagedFile::~TxtPagedFile()
+{
+    close();
+}
+
+TxtPagedFile& TxtPagedFile::operator=(TxtPagedFile&& other)
+{
+    if (this != &other)
+    {
+        close();
+
+        _file = other._file;
+        _size = other._size;
+        _pageSize = other._pageSize;
+        _budget = other._budget;
+        _pages = std::move(other._pages);
+        _lookup = std::move(other._lookup);
+
+        other._file = -1;
+        other._size = 0;
+        other._pages.clear();
+        other._lookup.clear();
+    }
+
+    return *this;
+}
+
+#ifdef _WIN32
+
+bool TxtPagedFile::open(const char* path, txtsz budget, txtsz pageSize)
+{
+    close();
+
+    // The pages not read yet come from this handle after a save replaced
+    // the file, which needs delete to be shared
+    auto file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) return false;
+
+    LARGE_INTEGER fileSize;
+    txtsz size;
+    if (!GetFileSizeEx(file, &fileSize) || !txtFileSize(fileSize.QuadPart, size))
+    {
+        CloseHandle(file);
+        return false;
+    }
+
+    _file = intptr_t(file);
+    _size = size;
+    _pageSize = pageSize;
+    _budget = budget;
+
+    return true;
+}
+
+bool TxtPagedFile::open(const TxtPagedFile& other, txtsz budget)
+{
+    close();
+
+    HANDLE file;
+    if (other._file == -1 || !DuplicateHandle(GetCurrentProcess(), HANDLE(other._file), GetCurrentProcess(), &file, 0, FALSE, DUPLICATE_SAME_ACCESS)) return false;
+
+    _file = intptr_t(file);
+    _size = other._size;
+    _pageSize = other._pageSize;
+    _budget = budget;
+
+    return true;
+}
+
+void TxtPagedFile::close()
+{
+    if (_file != -1) CloseHandle(HANDLE(_file));
+
+    _file = -1;
+    _size = 0;
+    _pages.clear();
+    _lookup.clear();
+}
+
+void TxtPagedFile::read(txtchr* destination, txtcur position, txtsz size) const
+{
+    while (size > 0)
+    {
+        OVERLAPPED overlapped = {};
+        overlapped.Offset = DWORD(position);
+        overlapped.OffsetHigh = DWORD(position >> 32);
+
+        DWORD count = 0;
+        if (!ReadFile(HANDLE(_file), destination, DWORD(size), &count, &overlapped) || count == 0) break;
+
+        destination += count;
+        position += count;
+        size -= count;
+    }
+
+    for (txtsz i = 0; i < size; i++) destination[i] = '\0';
+}
+
+#else
+
+bool TxtPagedFile::open(const char* path, txtsz budget, txtsz pageSize)
+{
+    close();
+
+    int file = ::open(path, O_RDONLY);
+    if (file < 0) return false;
+
+    struct stat info;
+    txtsz size;
+    if (fstat(file, &info) != 0 || !txtFileSize(info.st_size, size))
+    {
+        ::close(file);
+        return false;
+    }
+
+    _file = file;
+    _size = size;
+    _pageSize = pageSize;
+    _budget = budget;
+
+    return true;
+}
+
+bool TxtPagedFile::open(const TxtPagedFile& other, txtsz budget)
+{
+    close();
+
+    // pread does not move the file offset, the handles can share it
+    int file = other._file == -1 ? -1 : dup(int(other._file));
+    if (file < 0) return false;
+
+    _file = file;
+    _size = other._size;
+    _pageSize = other._pageSize;
+    _budget = budget;
+
+    return true;
+}
+
+void TxtPagedFile::close()
+{
+    if (_file != -1) ::close(int(_file));
+
+    _file = -1;
+    _size = 0;
+    _pages.clear();
+    _lookup.clear();
+}
+
+void TxtPagedFile::read(txtchr* destination, txtcur position, txtsz size) const
+{
+    while (size > 0)
+    {
+        auto count = pread(int(_file), destination, size_t(size), off_t(position));
+        if (count <= 0) break;
+
+        destination += count;
+        position += count;
+        size -= count;
+    }
+
+    for (txtsz i = 0; i < size; i++) destination[i] = '\0';
+}
+
+#endif
+
+const txtchr* TxtPagedFile::page(txtsz index) const
+{
+    auto found = _lookup.find(index);
+    if (found != _lookup.end())
+    {
+        _pages.splice(_pages.begin(), _pages, found->second);
+        return _pages.front().text.data();
+    }
+
+    // Make room first, then reuse the memory of the dropped page
+    std::vector<txtchr> text;
+    while (!_pages.empty() && txtsz(_pages.size() + 1) * _pageSize > _budget)
+    {
+        _lookup.erase(_pages.back().index);
+        text.swap(_pages.back().text);
+        _pages.pop_back();
+    }
+
+    auto start = index * _pageSize;
+    auto size = _size - start < _pageSize ? _size - start : _pageSize;
+
+    text.resize(size);
+    read(text.data(), start, size);
+
+    _pages.push_front({ index, std::move(text) });
+    _lookup[index] = _pages.begin();
+
+    return _pages.front().text.data();
+}
+
+void TxtPagedFile::copy(txtchr* destination, txtcur position, txtsz size) const
+{
+    while (size > 0)
+    {
+        auto index = position / _pageSize;
+        auto offset = position - index * _pageSize;
+        auto count = _pageSize - offset < size ? _pageSize - offset : size;
+
+        txtCopy(destination, page(index) + offset, count);
+
+        destination += count;
+        position += count;
+        size -= count;
+    }
+}
+
+txtchr TxtPagedFile::at(txtcur position) const
+{
+    auto index = position / _pageSize;
+
+    // walking the text stays on the most recent page most of the time
+    if (!_pages.empty() && _pages.front().index == index)
+    {
+        return _pages.front().text[position - index * _pageSize];
+    }
+
+    return page(index)[position - index * _pageSize];
+}
+
+const txtchr* TxtPagedFile::span(txtcur position, txtsz& size) const
+{
+    auto index = position / _pageSize;
+    auto offset = position - index * _pageSize;
+    if (_pageSize - offset < size) size = _pageSize - offset;
+
+    return page(index) + offset;
+}
+
+txtsz TxtPagedFile::size() const
+{
+    return _size;
+}
+
+txtsz TxtPagedFile::budget() const
+{
+    return _budget;
+}
+
+void TxtPagedFile::setBudget(txtsz budget)
+{
+    _budget = budget;
+
+    while (_pages.size() > 1 && txtsz(_pages.size()) * _pageSize > _budget)
+    {
+        _lookup.erase(_pages.back().index);
+        _pages.pop_back();
+    }
+}
+
+txtsz TxtPagedFile::cachedSize() const
+{
+    return txtsz(_pages.size()) * _pageSize;
+}
+
+#ifdef TXT_IO_URING
+
+/*
+ * A minimal io_uring, set up with the raw system calls. Only the writer
+ * thread touches it: it fills the submission queue, enters the kernel
+ * and reaps the completions itself.
+ */
+
+#define TXT_RING_ENTRIES 32
+
+struct TxtRing
+{
+    int file;
+    void* submissionMap;
+    size_t submissionMapSize;
+    void* completionMap;
+    size_t completionMapSize;
+    io_uring_sqe* entries;
+    size_t entriesSize;
+
+    unsigned* submissionTail;
+    unsigned* submissionMask;
+    unsigned* submissionArray;
+    unsigned* completionHead;
+    unsigned* completionTail;
+    unsigned* completionMask;
+    io_uring_cqe* completions;
+
+    TxtRing();
+    ~TxtRing();
+
+    bool setup();
+    void queue(unsigned long slot, int file, const txtchr* text, txtsz size, txtsz offset);
+    bool enter(unsigned submit, unsigned wait);
+    bool completion(unsigned long& slot, int& result);
+};
+
+TxtRing::TxtRing()
+    : file(-1),
+      submissionMap(MAP_FAILED), submissionMapSize(0),
+      completionMap(MAP_FAILED), completionMapSize(0),
+      entries((io_uring_sqe*)MAP_FAILED), entriesSize(0)
+{ }
+
+TxtRing::~TxtRing()
+{
+    if (entries != MAP_FAILED) munmap(entries, entriesSize);
+    if (completionMap != MAP_FAILED) munmap(completionMap, completionMapSize);
+    if (submissionMap != MAP_FAILED) munmap(submissionMap, submissionMapSize);
+    if (file >= 0) ::close(file);
+}
+
+bool TxtRing::setup()
+{
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    // fails on kernels without io_uring, or where it is switched off
+    file = int(syscall(__NR_io_uring_setup, TXT_RING_ENTRIES, &params));
+    if (file < 0) return false;
+
+    submissionMapSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    completionMapSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    entriesSize = params.sq_entries * sizeof(io_uring_sqe);
+
+    submissionMap = mmap(nullptr, submissionMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, file, IORING_OFF_SQ_RING);
+    completionMap = mmap(nullptr, completionMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, file, IORING_OFF_CQ_RING);
+    entries = (io_uring_sqe*)mmap(nullptr, entriesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, file, IORING_OFF_SQES);
+    if (submissionMap == MAP_FAILED || completionMap == MAP_FAILED || entries == MAP_FAILED) return false;
+
+    auto submission = (char*)submissionMap;
+    submissionTail = (unsigned*)(submission + params.sq_off.tail);
+    submissionMask = (unsigned*)(submission + params.sq_off.ring_mask);
+    submissionArray = (unsigned*)(submission + params.sq_off.array);
+
+    auto completion = (char*)completionMap;
+    completionHead = (unsigned*)(completion + params.cq_off.head);
+    completionTail = (unsigned*)(completion + params.cq_off.tail);
+    completionMask = (unsigned*)(completion + params.cq_off.ring_mask);
+    completions = (io_uring_cqe*)(completion + params.cq_off.cqes);
+
+    return true;
+}
+
+void TxtRing::queue(unsigned long slot, int target, const txtchr* text, txtsz size, txtsz offset)
+{
+    auto tail = *submissionTail;
+    auto index = tail & *submissionMask;
+
+    auto entry = &entries[index];
+    memset(entry, 0, sizeof(*entry));
+    entry->opcode = IORING_OP_WRITE;
+    entry->fd = target;
+    entry->addr = uint64_t(uintptr_t(text));
+    entry->len = unsigned(size);
+    entry->off = uint64_t(offset);
+    entry->user_data = slot;
+
+    submissionArray[index] = index;
+    __atomic_store_n(submissionTail, tail + 1, __ATOMIC_RELEASE);
+}
+
+bool TxtRing::enter(unsigned submit, unsigned wait)
+{
+    while (true)
+    {
+        auto result = syscall(__NR_io_uring_enter, file, submit, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+        if (result < 0)
+        {
+            if (errno == EINTR) continue;
+            return false;
+        }
+
+        // an interrupted wait returns early, the caller enters again
+        if (unsigned(result) >= submit) return true;
+        submit -= unsigned(result);
+    }
+}
+
+bool TxtRing::completion(unsigned long& slot, int& result)
+{
+    auto head = *completionHead;
+    if (head == __atomic_load_n(completionTail, __ATOMIC_ACQUIRE)) return false;
+
+    auto& entry = completions[head & *completionMask];
+    slot = (unsigned long)entry.user_data;
+    result = entry.res;
+
+    __atomic_store_n(completionHead, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+#else
+
+struct TxtRing
+{ };
+
+#endif
+
+TxtFileWriter::TxtFileWriter()
+    : _file(-1), _failed(false), _offset(0), _written(0)
+{ }
+
+TxtFileWriter::~TxtFileWriter()
+{
+    abort();
+}
+
+bool TxtFileWriter::write(const TxtSegment* segments, int count)
+{
+    if (_file == -1 || _failed) return false;
+
+    return _ring ? writeQueued(segments, count) : writeBlocking(segments, count);
+}
+
+txtsz TxtFileWriter::written() const
+{
+    return _written.load(std::memory_order_relaxed);
+}
+
+#ifdef _WIN32
+
+bool TxtFileWriter::open(const char* path)
+{
+    abort();
+
+    _path = path;
+    _temporaryPath = _path + ".save";
+    _failed = false;
+    _offset = 0;
+    _written = 0;
+
+    auto file = CreateFileA(_temporaryPath.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) return false;
+
+    _file = intptr_t(file);
+    return true;
+}
+
+bool TxtFileWriter::writeBlocking(const TxtSegment* segments, int count)
+{
+    // WriteFileGather only takes whole pages of unbuffered memory, so
+    // the segments are written one after the other
+    for (int i = 0; i < count; i++)
+    {
+        auto text = segments[i].text;
+        auto size = segments[i].size;
+        while (size > 0)
+        {
+            DWORD written = 0;
+            auto chunk = size < (1L << 30) ? DWORD(size) : DWORD(1L << 30);
+            if (!WriteFile(HANDLE(_file), text, chunk, &written, nullptr) || written == 0)
+            {
+                _failed = true;
+                return false;
+            }
+
+            text += written;
+            size -= written;
+            _offset += written;
+            _written += written;
+        }
+    }
+
+    return true;
+}
+
+bool TxtFileWriter::writeQueued(const TxtSegment* segments, int count)
+{
+    return writeBlocking(segments, count);
+}
+
+bool TxtFileWriter::commit()
+{
+    if (_file == -1 || _failed)
+    {
+        abort();
+        return false;
+    }
+
+    bool flushed = FlushFileBuffers(HANDLE(_file)) != 0;
+    CloseHandle(HANDLE(_file));
+    _file = -1;
+
+    if (!flushed || !MoveFileExA(_temporaryPath.c_str(), _path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+    {
+        DeleteFileA(_temporaryPath.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+void TxtFileWriter::abort()
+{
+    if (_file == -1) return;
+
+    CloseHandle(HANDLE(_file));
+    DeleteFileA(_temporaryPath.c_str());
+    _file = -1;
+}
+
+#else
+
+bool TxtFileWriter::open(const char* path)
+{
+    abort();
+
+    _path = path;
+    _temporaryPath = _path + ".XXXXXX";
+    _failed = false;
+    _offset = 0;
+    _written = 0;
+
+    int file = mkstemp(&_temporaryPath[0]);
+    if (file < 0) return false;
+
+    // keep the permissions of the file that gets replaced
+    struct stat info;
+    fchmod(file, ::stat(path, &info) == 0 ? info.st_mode & 07777 : 0644);
+
+#ifdef TXT_IO_URING
+    if (!_ring)
+    {
+        std::unique_ptr<TxtRing> ring(new TxtRing());
+        if (ring->setup()) _ring = std::move(ring);
+    }
+#endif
+
+    _file = file;
+    return true;
+}
+
+bool TxtFileWriter::writeBlocking(const TxtSegment* segments, int count)
+{
+    iovec vectors[TXT_SEGMENT_BATCH];
+
+    while (count > 0)
+    {
+        int batch = count < TXT_SEGMENT_BATCH ? count : TXT_SEGMENT_BATCH;
+        for (int i = 0; i < batch; i++)
+        {
+            vectors[i].iov_base = (void*)segments[i].text;
+            vectors[i].iov_len = size_t(segments[i].size);
+        }
+
+        // pwritev may stop early, the vectors that went out are skipped
+        // and the one it stopped in is cut
+        auto vector = vectors;
+        while (batch > 0)
+        {
+            auto written = pwritev(int(_file), vector, batch < IOV_MAX ? batch : IOV_MAX, off_t(_offset));
+            if (written < 0)
+            {
+                if (errno == EINTR) continue;
+
+                _failed = true;
+                return false;
+            }
+
+            _offset += written;
+            _written += written;
+
+            while (batch > 0 && size_t(written) >= vector->iov_len)
+            {
+                written -= vector->iov_len;
+                vector++;
+                batch--;
+            }
+            if (batch > 0)
+            {
+                vector->iov_base = (char*)vector->iov_base + written;
+                vector->iov_len -= written;
+            }
+        }
+
+        segments += TXT_SEGMENT_BATCH;
+        count -= TXT_SEGMENT_BATCH;
+    }
+
+    return true;
+}
+
+#ifdef TXT_IO_URING
+
+bool TxtFileWriter::writeQueued(const TxtSegment* segments, int count)
+{
+    struct Request
+    {
+        const txtchr* text;
+        txtsz size;
+        txtsz offset;
+    };
+
+    // Every request in flight has a slot, its index travels through the
+    // ring as user data. Short writes and interrupted requests go back
+    // on the retry list with what is left of them.
+    Request slots[TXT_RING_ENTRIES];
+    unsigned long freeSlots[TXT_RING_ENTRIES];
+    int freeCount = TXT_RING_ENTRIES;
+    for (int i = 0; i < TXT_RING_ENTRIES; i++) freeSlots[i] = i;
+
+    std::vector<Request> retries;
+    int segment = 0;
+    txtsz queuedSize = 0;       // of segments[segment]
+    bool failed = false;
+    bool unsupported = false;
+
+    while (true)
+    {
+        unsigned queued = 0;
+        while (freeCount > 0 && !failed && !unsupported)
+        {
+            Request request;
+            if (!retries.empty())
+            {
+                request = retries.back();
+                retries.pop_back();
+            }
+            else
+            {
+                while (segment < count && queuedSize == segments[segment].size)
+                {
+                    segment++;
+                    queuedSize = 0;
+                }
+                if (segment == count) break;
+
+                auto size = segments[segment].size - queuedSize;
+                request = { segments[segment].text + queuedSize, size < TXT_WRITE_CHUNK ? size : TXT_WRITE_CHUNK, _offset };
+                queuedSize += request.size;
+                _offset += request.size;
+            }
+
+            auto slot = freeSlots[--freeCount];
+            slots[slot] = request;
+            _ring->queue(slot, int(_file), request.text, request.size, request.offset);
+            queued++;
+        }
+
+        if (freeCount == TXT_RING_ENTRIES && queued == 0) break;
+
+        if (!_ring->enter(queued, 1))
+        {
+            // the queued requests may or may not be in flight now, the
+            // ring can not be trusted with the text any more
+            _ring.reset();
+            _failed = true;
+            return false;
+        }
+
+        unsigned long slot;
+        int result;
+        while (_ring->completion(slot, result))
+        {
+            auto request = slots[slot];
+            freeSlots[freeCount++] = slot;
+
+            if (result == -EINTR || result == -EAGAIN)
+            {
+                retries.push_back(request);
+            }
+            else if (result == -EINVAL || result == -EOPNOTSUPP)
+            {
+                // a kernel that has io_uring, but can not write through it
+                unsupported = true;
+                retries.push_back(request);
+            }
+            else if (result <= 0)
+            {
+                failed = true;
+            }
+            else
+            {
+                _written += result;
+                if (result < request.size) retries.push_back({ request.text + result, request.size - result, request.offset + result });
+            }
+        }
+    }
+
+    if (failed)
+    {
+        _failed = true;
+        return false;
+    }
+
+    if (unsupported)
+    {
+        _ring.reset();
+
+        // what the ring did not write goes out with pwrite, at the offsets
+        // it was meant for, the rest of the segments follow with pwritev
+        for (auto& request : retries)
+        {
+            while (request.size > 0)
+            {
+                auto written = pwrite(int(_file), request.text, size_t(request.size), off_t(request.offset));
+                if (written < 0 && errno == EINTR) continue;
+                if (written <= 0)
+                {
+                    _failed = true;
+                    return false;
+                }
+
+                request.text += written;
+                request.size -= written;
+                request.offset += written;
+                _written += written;
+            }
+        }
+
+        if (segment < count)
+        {
+            TxtSegment rest = { segments[segment].text + queuedSize, segments[segment].size - queuedSize };
+            if (!writeBlocking(&rest, 1)) return false;
+            return writeBlocking(segments + segment + 1, count - segment - 1);
+        }
+    }
+
+    return true;
+}
+
+#else
+
+bool TxtFileWriter::writeQueued(const TxtSegment* segments, int count)
+{
+    return writeBlocking(segments, count);
+}
+
+#endif
+
+bool TxtFileWriter::commit()
+{
+    if (_file == -1 || _failed)
+    {
+        abort();
+        return false;
+    }
+
+    bool synced = fsync(int(_file)) == 0;
+    bool closed = ::close(int(_file)) == 0;
+    _file = -1;
+
+    if (!synced || !closed || rename(_temporaryPath.c_str(), _path.c_str()) != 0)
+    {
+        unlink(_temporaryPath.c_str());
+        return false;
+    }
+
+    // the rename itself is only durable once the directory is synced
+    auto slash = _path.rfind('/');
+    auto directory = slash == std::string::npos ? std::string(".") : _path.substr(0, slash + 1);
+    int handle = ::open(directory.c_str(), O_RDONLY);
+    if (handle >= 0)
+    {
+        fsync(handle);
+        ::close(handle);
+    }
+
+    return true;
+}
+
+void TxtFileWriter::abort()
+{
+    if (_file == -1) return;
+
+    ::close(int(_file));
+    unlink(_temporaryPath.c_str());
+    _file = -1;
+}
+
+#endif
+
+TxtBackgroundSave::TxtBackgroundSave(std::shared_ptr<const TxtSnapshot> snapshot, unsigned long version, const char* path)
+    : _snapshot(std::move(snapshot)), _version(version), _done(false), _succeeded(false),
+      _thread(&TxtBackgroundSave::run, this, std::string(path))
+{ }
+
+TxtBackgroundSave::~TxtBackgroundSave()
+{
+    wait();
+}
+
+void TxtBackgroundSave::run(std::string path)
+{
+    _succeeded = _writer.open(path.c_str()) &&
+        _snapshot->segments([this](const TxtSegment* segments, int count)
+        {
+            return _writer.write(segments, count);
+        }) &&
+        _writer.commit();
+
+    _done.store(true, std::memory_order_release);
+}
+
+bool TxtBackgroundSave::wait()
+{
+    if (_thread.joinable()) _thread.join();
+
+    return _succeeded;
+}
+
+bool TxtBackgroundSave::done() const
+{
+    return _done.load(std::memory_order_acquire);
+}
+
+bool TxtBackgroundSave::succeeded() const
+{
+    return done() && _succeeded;
+}
+
+txtsz TxtBackgroundSave::written() const
+{
+    return _writer.written();
+}
+
+txtsz TxtBackgroundSave::size() const
+{
+    return _snapshot->size();
+}
+
+unsigned long TxtBackgroundSave::version() const
+{
+    return _version;
+}
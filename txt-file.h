@@ -0,0 +1,225 @@
+#ifndef TXT_FILE_H
+#define TXT_FILE_H
+
+#include "txt-storage.h"
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#define TXT_PAGE_SIZE (64L << 10)
+#define TXT_PAGE_CACHE_BUDGET (64L << 20)
+
+/*
+ * --- File mapping ---
+ * Maps a file read-only into memory, so a text can be opened without
+ * reading it: pages are only loaded from disk when something looks at
+ * them, and the kernel can drop them again when memory gets tight.
+ *
+ * On POSIX systems the mapping is followed by an anonymous page, so the
+ * text is always NUL terminated and data() can be handed out as it is.
+ * On Windows that only holds when the file does not end on a page
+ * boundary, terminated() tells. The file must not be truncated while it
+ * is mapped. Windows does not let a mapped file be replaced either, so a
+ * save over it fails and leaves it as it was; a paged file can be.
+ *
+ * txtsz has 64 bits on every platform, so only a negative size, which a
+ * broken file system may report, can not be counted: txtFileSize turns a
+ * file size into a txtsz or fails, with EFBIG in errno or
+ * ERROR_FILE_TOO_LARGE on Windows. Mappings and paged files both use it.
+ */
+
+bool txtFileSize(long long fileSize, txtsz& size);
+
+enum class TxtAccessPatterns
+{
+    Normal,
+    Sequential,     // read ahead aggressively, drop pages behind the reader
+    Random,         // do not read ahead
+    WillNeed,       // start loading the whole file now
+};
+
+class TxtFileMapping
+{
+    const txtchr* _data;
+    txtsz _size;
+    txtsz _mappedSize;
+    bool _terminated;
+public:
+    TxtFileMapping();
+    TxtFileMapping(TxtFileMapping&& other);
+    TxtFileMapping(const TxtFileMapping&) = delete;
+    ~TxtFileMapping();
+
+    TxtFileMapping& operator=(TxtFileMapping&& other);
+
+    bool open(const char* path);
+    void close();
+    void advise(TxtAccessPatterns pattern) const;
+
+    const txtchr* data() const;
+    txtsz size() const;
+    bool terminated() const;
+};
+
+/*
+ * --- Paged file ---
+ * Reads a file in fixed size pages, only when a byte in a page is asked
+ * for. The pages are kept in a cache that drops the least recently used
+ * page once it holds more than the budget, so a file far larger than
+ * the memory can be read while only the touched part of it is resident.
+ * The cache is filled from const readers and is not thread safe. Bytes
+ * that can not be read, because the file shrank, read as NULs.
+ */
+
+class TxtPagedFile
+{
+    struct Page
+    {
+        txtsz index;
+        std::vector<txtchr> text;
+    };
+
+    intptr_t _file;
+    txtsz _size;
+    txtsz _pageSize;
+    txtsz _budget;
+
+    mutable std::list<Page> _pages;     // most recently used first
+    mutable std::unordered_map<txtsz, std::list<Page>::iterator> _lookup;
+
+    const txtchr* page(txtsz index) const;
+    void read(txtchr* destination, txtcur position, txtsz size) const;
+public:
+    TxtPagedFile();
+    TxtPagedFile(TxtPagedFile&& other);
+    TxtPagedFile(const TxtPagedFile&) = delete;
+    ~TxtPagedFile();
+
+    TxtPagedFile& operator=(TxtPagedFile&& other);
+
+    bool open(const char* path, txtsz budget = TXT_PAGE_CACHE_BUDGET, txtsz pageSize = TXT_PAGE_SIZE);
+    // Reads the file other reads, through a handle and a cache of its
+    // own, so the two can be used on different threads
+    bool open(const TxtPagedFile& other, txtsz budget = TXT_PAGE_CACHE_BUDGET);
+    void close();
+
+    void copy(txtchr* destination, txtcur position, txtsz size) const;
+    txtchr at(txtcur position) const;
+
+    // Returns the cached bytes from position up to the end of its page or
+    // size, whatever comes first, and sets size to their count. They stay
+    // valid until another page is read.
+    const txtchr* span(txtcur position, txtsz& size) const;
+
+    txtsz size() const;
+    txtsz budget() const;
+    void setBudget(txtsz budget);
+    txtsz cachedSize() const;
+};
+
+/*
+ * --- Atomic file writer ---
+ * Writes a new file next to the target and only puts it in place, with
+ * a rename, once all of it is on the disk. Readers of the path see the
+ * old file or the complete new one, never a partial write, and a failed
+ * save leaves the old file untouched. Segments are written straight from
+ * where the storage engine keeps them: on Linux they are queued on an
+ * io_uring in chunks of at most TXT_WRITE_CHUNK, each at its own offset,
+ * and elsewhere, or when the kernel has no io_uring, with pwritev.
+ * write() returns once its segments are written, written() can be read
+ * from another thread while it runs. A writer that is destroyed without
+ * commit() removes its temporary file.
+ */
+
+#define TXT_WRITE_CHUNK (1L << 20)
+
+struct TxtRing;
+
+class TxtFileWriter
+{
+    intptr_t _file;
+    std::string _path;
+    std::string _temporaryPath;
+    bool _failed;
+    txtsz _offset;
+    std::atomic<txtsz> _written;
+    std::unique_ptr<TxtRing> _ring;
+
+    void abort();
+    bool writeBlocking(const TxtSegment* segments, int count);
+    bool writeQueued(const TxtSegment* segments, int count);
+public:
+    TxtFileWriter();
+    TxtFileWriter(const TxtFileWriter&) = delete;
+    ~TxtFileWriter();
+
+    bool open(const char* path);
+    bool write(const TxtSegment* segments, int count);
+    bool commit();
+
+    txtsz written() const;
+};
+
+/*
+ * --- Background save ---
+ * Writes a snapshot to a file on a thread of its own, through a
+ * TxtFileWriter, so the caller can go on editing the buffer the
+ * snapshot was taken from. Progress can be polled with written() and
+ * done(), the destructor waits for the save to finish.
+ */
+
+class TxtBackgroundSave
+{
+    std::shared_ptr<const TxtSnapshot> _snapshot;
+    unsigned long _version;
+    TxtFileWriter _writer;
+    std::atomic<bool> _done;
+    bool _succeeded;
+    std::thread _thread;
+
+    void run(std::string path);
+public:
+    TxtBackgroundSave(std::shared_ptr<const TxtSnapshot> snapshot, unsigned long version, const char* path);
+    TxtBackgroundSave(const TxtBackgroundSave&) = delete;
+    ~TxtBackgroundSave();
+
+    // Blocks until the file is written and returns succeeded()
+    bool wait();
+    bool done() const;
+    bool succeeded() const;
+
+    txtsz written() const;
+    txtsz size() const;
+    unsigned long version() const;
+};
+
+// Engines that implement load(TxtFileMapping&&) keep the mapping and
+// read from it, all others get a copy of the text
+template <class Storage, class = void>
+struct canLoadMapping : std::false_type
+{ };
+
+template <class Storage>
+struct canLoadMapping<Storage, decltype(
+        std::declval<Storage&>().load(std::declval<TxtFileMapping&&>()),
+        void())>
+    : std::true_type
+{ };
+
+template <class Storage, class = void>
+struct canLoadPaged : std::false_type
+{ };
+
+template <class Storage>
+struct canLoadPaged<Storage, decltype(
+        std::declval<Storage&>().load(std::declval<TxtPagedFile&&>()),
+        void())>
+    : std::integral_constant<bool,
+        std::is_same<decltype(std::declval<const Storage&>().paged()), bool>::value>
+{ };
+
+#endif // TXT_FILE_H
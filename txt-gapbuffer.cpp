@@ -0,0 +1,232 @@
+#include "txt-gapbuffer.h"
+#include "txt-kernels.h"
+
+template <class Growth>
+TxtBasicGapStorage<Growth>::TxtBasicGapStorage()
+    : _buffer(nullptr), _gapStart(0), _gapEnd(0), _bufferAllocSize(0), _reservedSize(0)
+{
+    _bufferAllocSize = Growth::grow(0, 1);
+    _buffer = txtAllocate(_bufferAllocSize);
+    _gapEnd = _bufferAllocSize;
+}
+
+template <class Growth>
+TxtBasicGapStorage<Growth>::~TxtBasicGapStorage()
+{
+    if (!_lent) txtFree(_buffer, _bufferAllocSize);
+}
+
+template <class Growth>
+void TxtBasicGapStorage<Growth>::unshare() const
+{
+    if (!_lent) return;
+
+    // the snapshots keep the old allocation, the gap stays where it is
+    auto buffer = txtAllocate(_bufferAllocSize);
+    txtCopy(buffer, _buffer, _gapStart);
+    txtCopy(buffer + _gapEnd, _buffer + _gapEnd, _bufferAllocSize - _gapEnd);
+    _buffer = buffer;
+    _lent.reset();
+}
+
+template <class Growth>
+void TxtBasicGapStorage<Growth>::moveGap(txtcur position) const
+{
+    if (position != _gapStart) unshare();
+
+    if (position < _gapStart)
+    {
+        auto count = _gapStart - position;
+        txtMove(_buffer + _gapEnd - count, _buffer + position, count);
+        _gapStart -= count;
+        _gapEnd -= count;
+    }
+    else if (position > _gapStart)
+    {
+        auto count = position - _gapStart;
+        txtMove(_buffer + _gapStart, _buffer + _gapEnd, count);
+        _gapStart += count;
+        _gapEnd += count;
+    }
+}
+
+template <class Growth>
+void TxtBasicGapStorage<Growth>::resize(txtsz newAllocSize)
+{
+    // Only the text after the gap has to move, it stays at the end of the allocation
+    auto tailSize = _bufferAllocSize - _gapEnd;
+
+    if (newAllocSize > _bufferAllocSize)
+    {
+        _buffer = txtReallocate(_buffer, _bufferAllocSize, newAllocSize);
+        txtMove(_buffer + newAllocSize - tailSize, _buffer + _gapEnd, tailSize);
+    }
+    else
+    {
+        txtMove(_buffer + newAllocSize - tailSize, _buffer + _gapEnd, tailSize);
+        _buffer = txtReallocate(_buffer, _bufferAllocSize, newAllocSize);
+    }
+
+    _gapEnd = newAllocSize - tailSize;
+    _bufferAllocSize = newAllocSize;
+}
+
+template <class Growth>
+void TxtBasicGapStorage<Growth>::checkGap(txtsz size)
+{
+    // One byte of the gap is always kept free for the NUL that data() writes
+    if (_gapEnd - _gapStart > size) return;
+
+    resize(Growth::grow(_bufferAllocSize, this->size() + size + 1));
+}
+
+template <class Growth>
+void TxtBasicGapStorage<Growth>::checkShrink()
+{
+    auto newAllocSize = Growth::shrink(_bufferAllocSize, size() + 1);
+    if (newAllocSize < _reservedSize) newAllocSize = _reservedSize;
+
+    if (newAllocSize < _bufferAllocSize)
+    {
+        resize(newAllocSize);
+    }
+}
+
+template <class Growth>
+void TxtBasicGapStorage<Growth>::insert(txtcur position, const txtchr* text, txtsz size)
+{
+    unshare();
+    checkGap(size);
+    moveGap(position);
+
+    txtCopy(_buffer + _gapStart, text, size);
+    _gapStart += size;
+}
+
+template <class Growth>
+void TxtBasicGapStorage<Growth>::erase(txtcur position, txtsz size)
+{
+    unshare();
+    moveGap(position);
+
+    _gapEnd += size;
+
+    checkShrink();
+}
+
+template <class Growth>
+void TxtBasicGapStorage<Growth>::apply(const TxtEdit* edits, size_t count)
+{
+    if (count == 0) return;
+
+    txtsz added = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        added += edits[i].textSize;
+    }
+
+    unshare();
+    checkGap(added);
+
+    // the text between two edits crosses the gap once
+    txtsz shift = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        auto& edit = edits[i];
+        moveGap(edit.position + shift);
+
+        _gapEnd += edit.size;
+        if (edit.textSize > 0) txtCopy(_buffer + _gapStart, edit.text, edit.textSize);
+        _gapStart += edit.textSize;
+
+        shift += edit.textSize - edit.size;
+    }
+
+    checkShrink();
+}
+
+template <class Growth>
+void TxtBasicGapStorage<Growth>::copy(txtchr* destination, txtcur position, txtsz size) const
+{
+    if (position < _gapStart)
+    {
+        auto front = position + size <= _gapStart ? size : _gapStart - position;
+        txtCopy(destination, _buffer + position, front);
+        destination += front;
+        position += front;
+        size -= front;
+    }
+
+    if (size > 0)
+    {
+        txtCopy(destination, _buffer + position + (_gapEnd - _gapStart), size);
+    }
+}
+
+template <class Growth>
+txtchr TxtBasicGapStorage<Growth>::at(txtcur position) const
+{
+    if (position < _gapStart) return _buffer[position];
+    if (position >= size()) return '\0';
+
+    return _buffer[position + (_gapEnd - _gapStart)];
+}
+
+template <class Growth>
+void TxtBasicGapStorage<Growth>::reserve(txtsz size)
+{
+    _reservedSize = size + 1;
+
+    unshare();
+    checkGap(size - this->size());
+}
+
+template <class Growth>
+bool TxtBasicGapStorage<Growth>::segments(const TxtSegmentVisitor& visit) const
+{
+    // the text in front of and behind the gap, the gap stays where it is
+    TxtSegment segments[2];
+    int count = 0;
+
+    if (_gapStart > 0) segments[count++] = { _buffer, _gapStart };
+    if (_gapEnd < _bufferAllocSize) segments[count++] = { _buffer + _gapEnd, _bufferAllocSize - _gapEnd };
+
+    return count == 0 || visit(segments, count);
+}
+
+template <class Growth>
+std::shared_ptr<const TxtSnapshot> TxtBasicGapStorage<Growth>::snapshot() const
+{
+    if (!_lent) _lent = txtShare(_buffer, _bufferAllocSize);
+
+    TxtSegment segments[2] = {
+        { _buffer, _gapStart },
+        { _buffer + _gapEnd, _bufferAllocSize - _gapEnd },
+    };
+    return std::make_shared<TxtSharedSnapshot>(_lent, segments, 2);
+}
+
+template <class Growth>
+const txtchr* TxtBasicGapStorage<Growth>::data() const
+{
+    moveGap(size());
+
+    _buffer[_gapStart] = '\0';
+
+    return _buffer;
+}
+
+template <class Growth>
+txtsz TxtBasicGapStorage<Growth>::size() const
+{
+    return _bufferAllocSize - (_gapEnd - _gapStart);
+}
+
+template <class Growth>
+txtsz TxtBasicGapStorage<Growth>::capacity() const
+{
+    return _bufferAllocSize;
+}
+
+template class TxtBasicGapStorage<TxtGeometricGrowth>;
+template class TxtBasicGapStorage<TxtBlockGrowth>;
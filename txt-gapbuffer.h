@@ -0,0 +1,55 @@
+#ifndef TXT_GAPBUFFER_H
+#define TXT_GAPBUFFER_H
+
+#include "txt-storage.h"
+
+/*
+ * --- Gap buffer ---
+ * The text is kept in one allocation with a hole (the gap) in it. The
+ * gap is moved to wherever the last edit happened, so typing or
+ * deleting near the previous edit only costs the distance between the
+ * two edits instead of the full text after the cursor. data() moves the
+ * gap to the end to hand out a contiguous view, that is the only
+ * operation that pays for the full tail of the text. The allocation
+ * grows and shrinks as the Growth policy decides. A snapshot shares the
+ * allocation until the gap is moved or written to. A batch of edits
+ * sweeps the gap from the first edit to the last one.
+ */
+
+template <class Growth>
+class TxtBasicGapStorage : public TxtStorageBase<TxtBasicGapStorage<Growth> >
+{
+    mutable txtchr* _buffer;
+    mutable txtsz _gapStart;
+    mutable txtsz _gapEnd;
+    txtsz _bufferAllocSize;
+    txtsz _reservedSize;
+    mutable std::shared_ptr<const txtchr> _lent;   // set while snapshots share _buffer
+
+    void unshare() const;
+    void moveGap(txtcur position) const;
+    void resize(txtsz newAllocSize);
+    void checkGap(txtsz size);
+    void checkShrink();
+public:
+    TxtBasicGapStorage();
+    TxtBasicGapStorage(const TxtBasicGapStorage&) = delete;
+    ~TxtBasicGapStorage();
+
+    void insert(txtcur position, const txtchr* text, txtsz size);
+    void erase(txtcur position, txtsz size);
+    void copy(txtchr* destination, txtcur position, txtsz size) const;
+    txtchr at(txtcur position) const;
+    void reserve(txtsz size);
+    void apply(const TxtEdit* edits, size_t count);
+    bool segments(const TxtSegmentVisitor& visit) const;
+    std::shared_ptr<const TxtSnapshot> snapshot() const;
+
+    const txtchr* data() const;
+    txtsz size() const;
+    txtsz capacity() const;
+};
+
+typedef TxtBasicGapStorage<TxtGeometricGrowth> TxtGapStorage;
+
+#endif // TXT_GAPBUFFER_H
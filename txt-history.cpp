@@ -0,0 +1,350 @@
+#include "txt-history.h"
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+
+static bool continues(const TxtPiece& left, const TxtPiece& right)
+{
+    return left.source == right.source && left.start + left.length == right.start;
+}
+
+TxtHistory::TxtHistory()
+    : _current(0), _group(SIZE_MAX)
+{
+    clear(0);
+}
+
+void TxtHistory::clear(unsigned long version)
+{
+    _events.clear();
+    _text.clear();
+    _pieces.clear();
+    _snapshots.clear();
+
+    _events.push_back({ EditEventTypes::Insertion, 0, 0, version, 0, 0, 0, 0 });
+    _current = 0;
+    _group = SIZE_MAX;
+    dropMaps(1);
+}
+
+void TxtHistory::truncate()
+{
+    // The logs end where the first event that could be redone began
+    if (_current + 1 < _events.size())
+    {
+        dropMaps(_current + 1);
+        _text.resize(_events[_current + 1].text);
+        _pieces.resize(_events[_current + 1].pieces);
+        _events.resize(_current + 1);
+    }
+    if (_snapshots.size() > _current + 1) _snapshots.resize(_current + 1);
+}
+
+EditEvent& TxtHistory::add(EditEventTypes type, txtcur position, txtsz size, unsigned long version)
+{
+    truncate();
+
+    auto step = _events[_current].step;
+    if (_group == SIZE_MAX || _current == _group) step++;
+
+    _events.push_back({ type, position, size, version, step, _text.size(), _pieces.size(), 0 });
+    _current++;
+
+    return _events.back();
+}
+
+txtchr* TxtHistory::addText(txtsz size)
+{
+    auto start = _text.size();
+    _text.resize(start + size_t(size));
+
+    return _text.data() + start;
+}
+
+std::vector<TxtPiece>& TxtHistory::pieceLog()
+{
+    return _pieces;
+}
+
+EditEvent& TxtHistory::extend(txtsz size, bool front, unsigned long version)
+{
+    dropMaps(_current);
+
+    auto& event = _events[_current];
+    event.size += size;
+    if (front) event.position -= size;
+    event.version = version;
+
+    if (_snapshots.size() > _current) _snapshots[_current].reset();
+
+    return event;
+}
+
+txtchr* TxtHistory::extendText(txtsz size, bool front)
+{
+    if (!front) return addText(size);
+
+    auto start = _events[_current].text;
+    _text.insert(_text.begin() + start, size_t(size), '\0');
+
+    return _text.data() + start;
+}
+
+void TxtHistory::extendPieces(const TxtPiece* pieces, size_t count, bool front)
+{
+    auto& event = _events[_current];
+    if (count == 0) return;
+
+    if (front)
+    {
+        auto first = _pieces.begin() + event.pieces;
+        if (event.pieceCount > 0 && continues(pieces[count - 1], *first))
+        {
+            first->start = pieces[count - 1].start;
+            first->length += pieces[count - 1].length;
+            count--;
+        }
+        _pieces.insert(first, pieces, pieces + count);
+    }
+    else
+    {
+        size_t next = 0;
+        if (event.pieceCount > 0 && continues(_pieces.back(), pieces[0]))
+        {
+            _pieces.back().length += pieces[0].length;
+            next = 1;
+        }
+        _pieces.insert(_pieces.end(), pieces + next, pieces + count);
+    }
+
+    event.pieceCount = _pieces.size() - event.pieces;
+}
+
+void TxtHistory::beginGroup()
+{
+    _group = _current;
+}
+
+void TxtHistory::endGroup()
+{
+    _group = SIZE_MAX;
+}
+
+void TxtHistory::setSnapshot(std::shared_ptr<const TxtSnapshot> snapshot)
+{
+    if (_snapshots.size() <= _current) _snapshots.resize(_current + 1);
+
+    _snapshots[_current] = std::move(snapshot);
+
+    // nothing goes back to the middle of a group
+    if (_current > 0 && _events[_current - 1].step == _events[_current].step) _snapshots[_current - 1].reset();
+}
+
+const std::shared_ptr<const TxtSnapshot>& TxtHistory::snapshot() const
+{
+    return _snapshots[_current];
+}
+
+const EditEvent* TxtHistory::undo(size_t& count)
+{
+    if (_current == 0) return nullptr;
+
+    // event 0 is a step of its own
+    auto last = _current;
+    while (_events[_current - 1].step == _events[last].step) _current--;
+
+    count = last - _current + 1;
+    return &_events[_current--];
+}
+
+const EditEvent* TxtHistory::redo(size_t& count)
+{
+    if (_current + 1 >= _events.size()) return nullptr;
+
+    auto first = ++_current;
+    while (_current + 1 < _events.size() && _events[_current + 1].step == _events[first].step) _current++;
+
+    count = _current - first + 1;
+    return &_events[first];
+}
+
+const EditEvent& TxtHistory::current() const
+{
+    return _events[_current];
+}
+
+const txtchr* TxtHistory::text(const EditEvent& event) const
+{
+    return _text.data() + event.text;
+}
+
+const TxtPiece* TxtHistory::pieces(const EditEvent& event) const
+{
+    return _pieces.data() + event.pieces;
+}
+
+int TxtHistory::undoCount() const
+{
+    return int(_events[_current].step);
+}
+
+int TxtHistory::redoCount() const
+{
+    return int(_events.back().step - _events[_current].step);
+}
+
+txtcur TxtHistory::move(const EditEvent& event, bool forward, txtcur position)
+{
+    // Text inserted at a position goes behind it, erased text pulls the
+    // positions in it to its start
+    if (position <= event.position) return position;
+
+    if ((event.type == EditEventTypes::Insertion) == forward) return position + event.size;
+    return position < event.position + event.size ? event.position : position - event.size;
+}
+
+void TxtHistory::eventMap(const EditEvent& event, bool forward, PositionMap& map)
+{
+    map.clear();
+    map.push_back({ 0, 0, true });
+    if ((event.type == EditEventTypes::Insertion) == forward)
+    {
+        map.push_back({ event.position + 1, event.position + 1 + event.size, true });
+    }
+    else
+    {
+        if (event.size > 1) map.push_back({ event.position + 1, event.position, false });
+        map.push_back({ event.position + event.size, event.position, true });
+    }
+}
+
+void TxtHistory::addPiece(PositionMap& map, const MapPiece& piece)
+{
+    // a piece that only continues the last one is left out
+    if (!map.empty())
+    {
+        auto& last = map.back();
+        if (last.shifts == piece.shifts && last.to + (piece.shifts ? piece.from - last.from : 0) == piece.to) return;
+    }
+    map.push_back(piece);
+}
+
+void TxtHistory::compose(const PositionMap& first, const PositionMap& second, PositionMap& map)
+{
+    map.clear();
+    for (size_t i = 0; i < first.size(); i++)
+    {
+        auto& piece = first[i];
+        auto y = piece.to;
+
+        auto next = std::upper_bound(second.begin(), second.end(), y,
+                                     [](txtcur position, const MapPiece& p) { return position < p.from; });
+        auto& at = next[-1];
+        addPiece(map, { piece.from, at.shifts ? at.to + (y - at.from) : at.to, piece.shifts && at.shifts });
+
+        if (!piece.shifts) continue;
+
+        // the pieces of second that begin in the image of this one
+        auto end = i + 1 < first.size() ? y + (first[i + 1].from - piece.from) : std::numeric_limits<txtcur>::max();
+        for (; next != second.end() && next->from < end; ++next)
+        {
+            addPiece(map, { piece.from + (next->from - y), next->to, next->shifts });
+        }
+    }
+}
+
+txtcur TxtHistory::apply(const PositionMap& map, txtcur position)
+{
+    auto next = std::upper_bound(map.begin(), map.end(), position,
+                                 [](txtcur position, const MapPiece& p) { return position < p.from; });
+    auto& at = next[-1];
+    return at.shifts ? at.to + (position - at.from) : at.to;
+}
+
+const TxtHistory::PositionMap& TxtHistory::blockMap(size_t level, size_t block, bool forward) const
+{
+    auto& levels = forward ? _forward : _backward;
+    if (levels.size() < level) levels.resize(level);
+    if (levels[level - 1].size() <= block) levels[level - 1].resize(block + 1);
+
+    auto& map = levels[level - 1][block];
+    if (!map.empty()) return map;
+
+    // the halves of the block, the one at the start of the way first
+    PositionMap firstEvent, secondEvent;
+    const PositionMap* halves[2];
+    if (level == 1)
+    {
+        eventMap(_events[2 * block + 1], forward, firstEvent);
+        eventMap(_events[2 * block + 2], forward, secondEvent);
+        halves[0] = &firstEvent;
+        halves[1] = &secondEvent;
+    }
+    else
+    {
+        // the second half first, the first one does not grow the level
+        // any more and leaves it where it is
+        halves[1] = &blockMap(level - 1, 2 * block + 1, forward);
+        halves[0] = &blockMap(level - 1, 2 * block, forward);
+    }
+
+    PositionMap composed;
+    if (forward) compose(*halves[0], *halves[1], composed);
+    else compose(*halves[1], *halves[0], composed);
+
+    // the recursion may have moved the vectors of this level
+    auto& result = levels[level - 1][block];
+    result = std::move(composed);
+    return result;
+}
+
+void TxtHistory::dropMaps(size_t event)
+{
+    // the blocks that end in front of event stay
+    for (size_t level = 1; level <= _forward.size() || level <= _backward.size(); level++)
+    {
+        auto keep = (event - 1) >> level;
+        if (level <= _forward.size() && _forward[level - 1].size() > keep) _forward[level - 1].resize(keep);
+        if (level <= _backward.size() && _backward[level - 1].size() > keep) _backward[level - 1].resize(keep);
+    }
+}
+
+size_t TxtHistory::find(unsigned long version) const
+{
+    // the versions grow along the events
+    auto event = std::lower_bound(_events.begin(), _events.end(), version,
+                                  [](const EditEvent& e, unsigned long version) { return e.version < version; });
+    if (event == _events.end() || event->version != version) return SIZE_MAX;
+
+    return size_t(event - _events.begin());
+}
+
+txtcur TxtHistory::map(txtcur position, unsigned long from, unsigned long to) const
+{
+    auto event = find(from);
+    auto last = find(to);
+    if (event == SIZE_MAX || last == SIZE_MAX) return -1;
+
+    // The largest aligned block that does not go past the last event,
+    // they grow from event and shrink again towards last
+    while (event < last)
+    {
+        size_t level = 0;
+        while ((event & ((size_t(2) << level) - 1)) == 0 && event + (size_t(2) << level) <= last) level++;
+
+        if (level == 0) position = move(_events[event + 1], true, position);
+        else position = apply(blockMap(level, event >> level, true), position);
+        event += size_t(1) << level;
+    }
+    while (event > last)
+    {
+        size_t level = 0;
+        while ((event & ((size_t(2) << level) - 1)) == 0 && event >= last + (size_t(2) << level)) level++;
+
+        if (level == 0) position = move(_events[event], false, position);
+        else position = apply(blockMap(level, (event >> level) - 1, false), position);
+        event -= size_t(1) << level;
+    }
+
+    return position;
+}
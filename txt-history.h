@@ -0,0 +1,136 @@
+#ifndef TXT_HISTORY_H
+#define TXT_HISTORY_H
+
+#include "txt-storage.h"
+
+/*
+ * --- Edit history ---
+ * Every change is recorded as an event, which can only be an insertion
+ * or a deletion of size bytes at a position. The text of the event is
+ * kept with it, so undo and redo can replay it; saving the version of
+ * the text after the event makes it cheap to tell where the text is.
+ *
+ * The events are fixed size headers in one array, event 0 stands for
+ * the loaded text. Their text is appended to one byte log or, when the
+ * storage hands out pieces, to one piece log, and an event refers to it
+ * by offset. Recording an edit so allocates nothing but the amortized
+ * growth of the arrays, and an edit after an undo drops the events
+ * that could be redone by cutting the arrays back to where they began.
+ *
+ * The last event can be extended, which is how TxtBuffer merges a run
+ * of keystrokes into one event: its text sits at the end of the logs.
+ *
+ * Undo and redo move by steps. An event usually is a step of its own,
+ * the events added between beginGroup and endGroup make one step
+ * together, a composite record that is taken back and replayed at once.
+ *
+ * A position in the text of one version can be mapped to the text of
+ * another by moving it through the events between them, the way anchors
+ * move. Going through every event would cost O(edits), so the maps of
+ * aligned blocks of 2, 4, 8... events are composed on demand and kept,
+ * like the express lanes of a skip list: a mapping goes through O(log
+ * edits) blocks, each a binary search. A map is a sorted list of pieces
+ * that either shift positions or collapse them onto one, which is all
+ * edits can make of them. Changing or dropping events drops the blocks
+ * over them.
+ */
+
+enum class EditEventTypes
+{
+    Deletion,
+    Insertion,
+};
+
+struct EditEvent
+{
+    EditEventTypes type;
+    txtcur position;                // the position in the main buffer to add or delete
+    txtsz size;                     // the number of added or removed characters
+    unsigned long version;          // the version of the text after this event, never reused
+    size_t step;                    // the undo step, shared by the events of a group
+    size_t text;                    // offset of the added or removed text in the byte log
+    size_t pieces;                  // or of the references to it in the piece log
+    size_t pieceCount;              // 0 when the text is in the byte log
+};
+
+class TxtHistory
+{
+    struct MapPiece
+    {
+        txtcur from;                // the first position of the piece
+        txtcur to;                  // where from goes
+        bool shifts;                // the positions behind from keep their distance, or go to to as well
+    };
+    typedef std::vector<MapPiece> PositionMap;
+
+    std::vector<EditEvent> _events;
+    std::vector<txtchr> _text;
+    std::vector<TxtPiece> _pieces;
+    std::vector<std::shared_ptr<const TxtSnapshot> > _snapshots;    // only used by storages that restore versions
+    size_t _current;
+    size_t _group;                  // the current event when the open group began
+
+    // [level - 1][k] maps from event k << level to event (k + 1) << level,
+    // or back; empty until it is needed
+    mutable std::vector<std::vector<PositionMap> > _forward;
+    mutable std::vector<std::vector<PositionMap> > _backward;
+
+    static txtcur move(const EditEvent& event, bool forward, txtcur position);
+    static void eventMap(const EditEvent& event, bool forward, PositionMap& map);
+    static void addPiece(PositionMap& map, const MapPiece& piece);
+    static void compose(const PositionMap& first, const PositionMap& second, PositionMap& map);
+    static txtcur apply(const PositionMap& map, txtcur position);
+    const PositionMap& blockMap(size_t level, size_t block, bool forward) const;
+    void dropMaps(size_t event);
+    size_t find(unsigned long version) const;
+public:
+    TxtHistory();
+
+    // Forgets all events, event 0 gets version
+    void clear(unsigned long version);
+
+    // Drops the events that could be redone
+    void truncate();
+
+    // Drops the events that could be redone and adds one after the
+    // current event, which becomes the current event. Its text goes to
+    // addText, or the storage appends its pieces to pieceLog().
+    EditEvent& add(EditEventTypes type, txtcur position, txtsz size, unsigned long version);
+    txtchr* addText(txtsz size);
+    std::vector<TxtPiece>& pieceLog();
+
+    // Grows the current event, which must be the last, by size bytes at
+    // its end or, with front, at its start. The bytes go to the room
+    // extendText returns, or the pieces for them to extendPieces, which
+    // joins pieces that continue each other.
+    EditEvent& extend(txtsz size, bool front, unsigned long version);
+    txtchr* extendText(txtsz size, bool front);
+    void extendPieces(const TxtPiece* pieces, size_t count, bool front);
+
+    void beginGroup();
+    void endGroup();
+
+    // The snapshot of the text after the current event, a group keeps
+    // only the one after its last event
+    void setSnapshot(std::shared_ptr<const TxtSnapshot> snapshot);
+    const std::shared_ptr<const TxtSnapshot>& snapshot() const;
+
+    // undo returns the count events of the step to revert before moving
+    // to the event in front of them, redo the events of the step to
+    // replay after moving to its last one, or nullptr
+    const EditEvent* undo(size_t& count);
+    const EditEvent* redo(size_t& count);
+
+    const EditEvent& current() const;
+    const txtchr* text(const EditEvent& event) const;
+    const TxtPiece* pieces(const EditEvent& event) const;
+
+    int undoCount() const;
+    int redoCount() const;
+
+    // Where position in the text of version from is in the text of
+    // version to, or -1 when either version is no longer in the history
+    txtcur map(txtcur position, unsigned long from, unsigned long to) const;
+};
+
+#endif // TXT_HISTORY_H
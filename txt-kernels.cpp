@@ -0,0 +1,314 @@
+#include "txt-kernels.h"
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define TXT_KERNELS_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define TXT_TARGET(isa) __attribute__((target(isa)))
+#define TXT_NO_SANITIZE __attribute__((no_sanitize_address))
+#else
+#define TXT_TARGET(isa)
+#define TXT_NO_SANITIZE
+#endif
+
+static txtsz scalarLength(const txtchr* text)
+{
+    const txtchr* end = text;
+    while (*end != '\0') end++;
+    return end - text;
+}
+
+static txtsz scalarCountNewlines(const txtchr* text, txtsz size)
+{
+    txtsz count = 0;
+    for (txtsz i = 0; i < size; i++)
+    {
+        if (text[i] == '\n') count++;
+    }
+    return count;
+}
+
+static txtsz scalarFindNewlines(const txtchr* text, txtsz size, txtcur* positions)
+{
+    txtsz count = 0;
+    for (txtsz i = 0; i < size; i++)
+    {
+        if (text[i] == '\n') positions[count++] = i;
+    }
+    return count;
+}
+
+#ifdef TXT_KERNELS_X86
+
+static inline int lowestBit(unsigned mask)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return int(index);
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+/*
+ * The length kernels only do aligned loads, so they never touch a page
+ * the string does not reach into. The bytes in front of the string in
+ * the first block are masked away. The sanitizer does not know that
+ * reading within an aligned block is safe, so it is kept out.
+ */
+
+TXT_TARGET("sse2") TXT_NO_SANITIZE static txtsz sse2Length(const txtchr* text)
+{
+    auto zero = _mm_setzero_si128();
+    auto offset = uintptr_t(text) & 15;
+    auto block = text - offset;
+
+    unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128((const __m128i*)block), zero)) >> offset;
+    if (mask != 0) return lowestBit(mask);
+
+    for (block += 16; ; block += 16)
+    {
+        mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128((const __m128i*)block), zero));
+        if (mask != 0) return block + lowestBit(mask) - text;
+    }
+}
+
+TXT_TARGET("avx2") TXT_NO_SANITIZE static txtsz avx2Length(const txtchr* text)
+{
+    auto zero = _mm256_setzero_si256();
+    auto offset = uintptr_t(text) & 31;
+    auto block = text - offset;
+
+    unsigned mask = unsigned(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_load_si256((const __m256i*)block), zero))) >> offset;
+    if (mask != 0) return lowestBit(mask);
+
+    for (block += 32; ; block += 32)
+    {
+        mask = unsigned(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_load_si256((const __m256i*)block), zero)));
+        if (mask != 0) return block + lowestBit(mask) - text;
+    }
+}
+
+/*
+ * The newline counters subtract the compare results (0 or -1) from
+ * byte counters and sum those up with psadbw before they can overflow,
+ * which keeps the inner loop at one load, compare and subtract per
+ * block. The finders take the movemask of every block and walk its set
+ * bits, blocks without a newline cost one test.
+ */
+
+TXT_TARGET("sse2") static txtsz sse2CountNewlines(const txtchr* text, txtsz size)
+{
+    auto newline = _mm_set1_epi8('\n');
+    auto zero = _mm_setzero_si128();
+    txtsz count = 0;
+    txtsz i = 0;
+
+    while (i + 16 <= size)
+    {
+        auto end = i + 255 * 16 <= size ? i + 255 * 16 : size - (size - i) % 16;
+        auto counters = _mm_setzero_si128();
+        for (; i < end; i += 16)
+        {
+            counters = _mm_sub_epi8(counters, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(text + i)), newline));
+        }
+
+        alignas(16) unsigned long long sums[2];
+        _mm_store_si128((__m128i*)sums, _mm_sad_epu8(counters, zero));
+        count += txtsz(sums[0] + sums[1]);
+    }
+
+    return count + scalarCountNewlines(text + i, size - i);
+}
+
+TXT_TARGET("sse2") static txtsz sse2FindNewlines(const txtchr* text, txtsz size, txtcur* positions)
+{
+    auto newline = _mm_set1_epi8('\n');
+    txtsz count = 0;
+    txtsz i = 0;
+
+    for (; i + 16 <= size; i += 16)
+    {
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(text + i)), newline));
+        for (; mask != 0; mask &= mask - 1)
+        {
+            positions[count++] = i + lowestBit(mask);
+        }
+    }
+
+    for (; i < size; i++)
+    {
+        if (text[i] == '\n') positions[count++] = i;
+    }
+    return count;
+}
+
+TXT_TARGET("avx2") static txtsz avx2CountNewlines(const txtchr* text, txtsz size)
+{
+    auto newline = _mm256_set1_epi8('\n');
+    auto zero = _mm256_setzero_si256();
+    txtsz count = 0;
+    txtsz i = 0;
+
+    while (i + 32 <= size)
+    {
+        auto end = i + 255 * 32 <= size ? i + 255 * 32 : size - (size - i) % 32;
+        auto counters = _mm256_setzero_si256();
+        auto counters2 = _mm256_setzero_si256();
+        for (; i + 64 <= end; i += 64)
+        {
+            counters = _mm256_sub_epi8(counters, _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(text + i)), newline));
+            counters2 = _mm256_sub_epi8(counters2, _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(text + i + 32)), newline));
+        }
+        for (; i < end; i += 32)
+        {
+            counters = _mm256_sub_epi8(counters, _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(text + i)), newline));
+        }
+
+        alignas(32) unsigned long long sums[4];
+        _mm256_store_si256((__m256i*)sums, _mm256_add_epi64(_mm256_sad_epu8(counters, zero), _mm256_sad_epu8(counters2, zero)));
+        count += txtsz(sums[0] + sums[1] + sums[2] + sums[3]);
+    }
+
+    return count + scalarCountNewlines(text + i, size - i);
+}
+
+TXT_TARGET("avx2") static txtsz avx2FindNewlines(const txtchr* text, txtsz size, txtcur* positions)
+{
+    auto newline = _mm256_set1_epi8('\n');
+    txtsz count = 0;
+    txtsz i = 0;
+
+    for (; i + 32 <= size; i += 32)
+    {
+        unsigned mask = unsigned(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(text + i)), newline)));
+        for (; mask != 0; mask &= mask - 1)
+        {
+            positions[count++] = i + lowestBit(mask);
+        }
+    }
+
+    for (; i < size; i++)
+    {
+        if (text[i] == '\n') positions[count++] = i;
+    }
+    return count;
+}
+
+static bool cpuSupports(TxtKernelTypes type)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    __builtin_cpu_init();
+    switch (type)
+    {
+    case TxtKernelTypes::SSE2: return __builtin_cpu_supports("sse2");
+    case TxtKernelTypes::AVX2: return __builtin_cpu_supports("avx2");
+    default: return true;
+    }
+#elif defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    auto maxLeaf = info[0];
+
+    __cpuid(info, 1);
+    bool sse2 = (info[3] & (1 << 26)) != 0;
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    unsigned long long xcr0 = osxsave ? _xgetbv(0) : 0;
+
+    int extended[4] = { 0, 0, 0, 0 };
+    if (maxLeaf >= 7) __cpuidex(extended, 7, 0);
+
+    switch (type)
+    {
+    case TxtKernelTypes::SSE2: return sse2;
+    case TxtKernelTypes::AVX2: return (xcr0 & 0x6) == 0x6 && (extended[1] & (1 << 5)) != 0;
+    default: return true;
+    }
+#else
+    return type == TxtKernelTypes::Scalar;
+#endif
+}
+
+#endif // TXT_KERNELS_X86
+
+static const TxtKernels scalarKernels = { "scalar", scalarLength, scalarCountNewlines, scalarFindNewlines };
+#ifdef TXT_KERNELS_X86
+static const TxtKernels sse2Kernels = { "sse2", sse2Length, sse2CountNewlines, sse2FindNewlines };
+static const TxtKernels avx2Kernels = { "avx2", avx2Length, avx2CountNewlines, avx2FindNewlines };
+#endif
+
+const TxtKernels* txtKernels(TxtKernelTypes type)
+{
+#ifdef TXT_KERNELS_X86
+    if (!cpuSupports(type)) return nullptr;
+
+    switch (type)
+    {
+    case TxtKernelTypes::SSE2: return &sse2Kernels;
+    case TxtKernelTypes::AVX2: return &avx2Kernels;
+    default: break;
+    }
+#endif
+
+    if (type == TxtKernelTypes::Scalar) return &scalarKernels;
+
+    return nullptr;
+}
+
+static const TxtKernels* pickBestKernels()
+{
+    for (auto type : { TxtKernelTypes::AVX2, TxtKernelTypes::SSE2 })
+    {
+        auto kernels = txtKernels(type);
+        if (kernels != nullptr) return kernels;
+    }
+    return &scalarKernels;
+}
+
+const TxtKernels& txtBestKernels()
+{
+    // initialized once even when threads ask at the same time
+    static const TxtKernels* best = pickBestKernels();
+    return *best;
+}
+
+// The entry points start out pointing at these, for the calls made while
+// the program is still initializing. They never write the entry points,
+// a thread may be calling through them: that is left to the initializer
+// below, which runs before main and so before any thread is started.
+static txtsz resolveLength(const txtchr* text)
+{
+    return txtBestKernels().length(text);
+}
+
+static txtsz resolveCountNewlines(const txtchr* text, txtsz size)
+{
+    return txtBestKernels().countNewlines(text, size);
+}
+
+static txtsz resolveFindNewlines(const txtchr* text, txtsz size, txtcur* positions)
+{
+    return txtBestKernels().findNewlines(text, size, positions);
+}
+
+txtsz (*txtLength)(const txtchr* text) = resolveLength;
+txtsz (*txtCountNewlines)(const txtchr* text, txtsz size) = resolveCountNewlines;
+txtsz (*txtFindNewlines)(const txtchr* text, txtsz size, txtcur* positions) = resolveFindNewlines;
+
+static bool resolveKernels()
+{
+    auto& best = txtBestKernels();
+    txtLength = best.length;
+    txtCountNewlines = best.countNewlines;
+    txtFindNewlines = best.findNewlines;
+    return true;
+}
+
+static const bool kernelsResolved = resolveKernels();
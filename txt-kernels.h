@@ -0,0 +1,61 @@
+#ifndef TXT_KERNELS_H
+#define TXT_KERNELS_H
+
+#include "txt-storage.h"
+#include <cstring>
+
+/*
+ * --- Byte kernels ---
+ * All bulk byte movement in the storage engines goes through these
+ * functions. They take explicit lengths and never look at the bytes,
+ * so embedded NULs are moved like any other character.
+ *
+ * txtMove allows the source and destination to overlap, txtCopy does
+ * not. They are memmove and memcpy: hand-written vector loops measured
+ * slower than the C library at every size, which already switches to
+ * non-temporal stores for large blocks. txtLength means what strlen
+ * does but runs through the vector kernels, and is only meant for the
+ * places where a C string enters the text API; everything past that
+ * carries its length.
+ * txtCountNewlines counts the '\n' bytes in a range, txtFindNewlines
+ * writes the offset of each of them to positions, which must have room
+ * for all of them, and returns the count.
+ * They are pointed at the widest implementation the CPU supports
+ * (AVX2, SSE2 or a plain byte loop) before main, so calling
+ * them from several threads needs no synchronization.
+ */
+
+enum class TxtKernelTypes
+{
+    Scalar,
+    SSE2,
+    AVX2,
+};
+
+struct TxtKernels
+{
+    const char* name;
+    txtsz (*length)(const txtchr* text);
+    txtsz (*countNewlines)(const txtchr* text, txtsz size);
+    txtsz (*findNewlines)(const txtchr* text, txtsz size, txtcur* positions);
+};
+
+// Returns nullptr when the CPU or the compiler does not support the type
+const TxtKernels* txtKernels(TxtKernelTypes type);
+const TxtKernels& txtBestKernels();
+
+inline void txtMove(txtchr* destination, const txtchr* source, txtsz size)
+{
+    if (size > 0) std::memmove(destination, source, size_t(size));
+}
+
+inline void txtCopy(txtchr* destination, const txtchr* source, txtsz size)
+{
+    if (size > 0) std::memcpy(destination, source, size_t(size));
+}
+
+extern txtsz (*txtLength)(const txtchr* text);
+extern txtsz (*txtCountNewlines)(const txtchr* text, txtsz size);
+extern txtsz (*txtFindNewlines)(const txtchr* text, txtsz size, txtcur* positions);
+
+#endif // TXT_KERNELS_H
@@ -0,0 +1,506 @@
+#include "txt-lineindex.h"
+#include "txt-kernels.h"
+#include <atomic>
+#include <functional>
+#include <thread>
+
+#define TXT_LINE_SCAN_BLOCK_SIZE 65536
+#define TXT_LINE_PARALLEL_SIZE (16L << 20)
+
+// The text is scanned in blocks that stay in the cache between counting
+// and finding
+txtcur TxtLineIndex::scan(const txtchr* text, txtsz size, std::vector<txtsz>& lengths)
+{
+    txtcur start = 0;
+    for (txtcur block = 0; block < size; block += TXT_LINE_SCAN_BLOCK_SIZE)
+    {
+        auto count = size - block < TXT_LINE_SCAN_BLOCK_SIZE ? size - block : TXT_LINE_SCAN_BLOCK_SIZE;
+        auto first = lengths.size();
+
+        lengths.resize(first + txtCountNewlines(text + block, count));
+        txtFindNewlines(text + block, count, lengths.data() + first);
+
+        for (auto i = first; i < lengths.size(); i++)
+        {
+            auto end = block + lengths[i] + 1;
+            lengths[i] = end - start;
+            start = end;
+        }
+    }
+    return start;
+}
+
+TxtLineIndex::TxtLineIndex()
+    : _root(-1), _seed(2463534242u)
+{
+    _root = newNode(0);
+}
+
+int TxtLineIndex::newNode(txtsz length)
+{
+    // xorshift, the priorities only have to be spread well
+    _seed ^= _seed << 13;
+    _seed ^= _seed >> 17;
+    _seed ^= _seed << 5;
+
+    Node node = { -1, -1, _seed, 1, length, length };
+
+    if (!_free.empty())
+    {
+        auto index = _free.back();
+        _free.pop_back();
+        _nodes[index] = node;
+        return index;
+    }
+
+    _nodes.push_back(node);
+    return int(_nodes.size() - 1);
+}
+
+void TxtLineIndex::freeTree(int node)
+{
+    if (node < 0) return;
+
+    freeTree(_nodes[node].left);
+    freeTree(_nodes[node].right);
+    _free.push_back(node);
+}
+
+txtsz TxtLineIndex::count(int node) const
+{
+    return node < 0 ? 0 : _nodes[node].count;
+}
+
+txtsz TxtLineIndex::sum(int node) const
+{
+    return node < 0 ? 0 : _nodes[node].sum;
+}
+
+void TxtLineIndex::update(int node)
+{
+    auto& n = _nodes[node];
+    n.count = 1 + count(n.left) + count(n.right);
+    n.sum = n.length + sum(n.left) + sum(n.right);
+}
+
+int TxtLineIndex::merge(int left, int right)
+{
+    if (left < 0) return right;
+    if (right < 0) return left;
+
+    if (_nodes[left].priority > _nodes[right].priority)
+    {
+        auto merged = merge(_nodes[left].right, right);
+        _nodes[left].right = merged;
+        update(left);
+        return left;
+    }
+
+    auto merged = merge(left, _nodes[right].left);
+    _nodes[right].left = merged;
+    update(right);
+    return right;
+}
+
+// Puts the first count lines of node in left and the rest in right
+void TxtLineIndex::split(int node, txtsz count, int& left, int& right)
+{
+    if (node < 0)
+    {
+        left = right = -1;
+        return;
+    }
+
+    if (this->count(_nodes[node].left) < count)
+    {
+        int rightLeft, rightRight;
+        split(_nodes[node].right, count - this->count(_nodes[node].left) - 1, rightLeft, rightRight);
+        _nodes[node].right = rightLeft;
+        update(node);
+        left = node;
+        right = rightRight;
+    }
+    else
+    {
+        int leftLeft, leftRight;
+        split(_nodes[node].left, count, leftLeft, leftRight);
+        _nodes[node].left = leftRight;
+        update(node);
+        left = leftLeft;
+        right = node;
+    }
+}
+
+// Builds a perfectly balanced tree and then restores the heap order of
+// the priorities by swapping them downwards, O(count)
+int TxtLineIndex::build(const txtsz* lengths, txtsz count)
+{
+    if (count <= 0) return -1;
+
+    auto middle = count / 2;
+    auto node = newNode(lengths[middle]);
+
+    auto left = build(lengths, middle);
+    auto right = build(lengths + middle + 1, count - middle - 1);
+    _nodes[node].left = left;
+    _nodes[node].right = right;
+
+    update(node);
+    heapify(node);
+
+    return node;
+}
+
+void TxtLineIndex::heapify(int node)
+{
+    while (node >= 0)
+    {
+        auto largest = node;
+        auto left = _nodes[node].left;
+        auto right = _nodes[node].right;
+
+        if (left >= 0 && _nodes[left].priority > _nodes[largest].priority) largest = left;
+        if (right >= 0 && _nodes[right].priority > _nodes[largest].priority) largest = right;
+        if (largest == node) return;
+
+        auto priority = _nodes[node].priority;
+        _nodes[node].priority = _nodes[largest].priority;
+        _nodes[largest].priority = priority;
+        node = largest;
+    }
+}
+
+void TxtLineIndex::addLength(txtsz line, txtsz size)
+{
+    auto node = _root;
+    while (node >= 0)
+    {
+        auto& n = _nodes[node];
+        n.sum += size;
+
+        auto leftCount = count(n.left);
+        if (line < leftCount)
+        {
+            node = n.left;
+        }
+        else if (line == leftCount)
+        {
+            n.length += size;
+            return;
+        }
+        else
+        {
+            line -= leftCount + 1;
+            node = n.right;
+        }
+    }
+}
+
+// Replaces the lines first up to and including last with new lines
+void TxtLineIndex::replaceLines(txtsz first, txtsz last, const std::vector<txtsz>& lengths)
+{
+    int before, rest, replaced, after;
+    split(_root, first, before, rest);
+    split(rest, last - first + 1, replaced, after);
+
+    freeTree(replaced);
+
+    auto inserted = build(lengths.data(), txtsz(lengths.size()));
+    _root = merge(before, merge(inserted, after));
+}
+
+// Runs task(0) up to task(tasks - 1) on up to threads threads
+static void runParallel(int tasks, int threads, const std::function<void(int)>& task)
+{
+    std::atomic<int> next(0);
+    auto worker = [&]()
+    {
+        for (int i = next++; i < tasks; i = next++) task(i);
+    };
+
+    std::vector<std::thread> pool;
+    for (int i = 1; i < threads && i < tasks; i++)
+    {
+        pool.emplace_back(worker);
+    }
+    worker();
+
+    for (auto& thread : pool)
+    {
+        thread.join();
+    }
+}
+
+// The priorities of loaded nodes are a hash of their line, so that the
+// threads do not have to share the generator
+static unsigned linePriority(txtsz line, unsigned seed)
+{
+    auto x = unsigned(line) * 0x9e3779b9u ^ seed;
+    x ^= x >> 16;
+    x *= 0x85ebca6bu;
+    x ^= x >> 13;
+    x *= 0xc2b2ae35u;
+    return x ^ (x >> 16);
+}
+
+// Links the loaded nodes first up to first + count into a balanced tree.
+// The root of a range is always its middle node, so the ranges below
+// depth are left to be linked by someone else.
+int TxtLineIndex::link(txtsz first, txtsz count, int depth)
+{
+    if (count <= 0) return -1;
+
+    auto node = int(first + count / 2);
+    if (depth == 0) return node;
+
+    _nodes[node].left = link(first, count / 2, depth - 1);
+    _nodes[node].right = link(node + 1, count - count / 2 - 1, depth - 1);
+
+    update(node);
+    heapify(node);
+
+    return node;
+}
+
+void TxtLineIndex::load(const txtchr* text, txtsz size, int threads)
+{
+    if (threads <= 0)
+    {
+        threads = size < TXT_LINE_PARALLEL_SIZE ? 1 : int(std::thread::hardware_concurrency());
+        if (threads <= 0) threads = 1;
+    }
+
+    // more chunks than threads, so a thread that finishes early takes
+    // over work from the others
+    int chunks = threads == 1 ? 1 : threads * 4;
+    if (size / chunks < TXT_LINE_SCAN_BLOCK_SIZE) chunks = int(size / TXT_LINE_SCAN_BLOCK_SIZE) + 1;
+
+    auto chunkStart = [&](int chunk) { return size * chunk / chunks; };
+
+    std::vector<txtsz> lines(chunks + 1, 0);
+    runParallel(chunks, threads, [&](int chunk)
+    {
+        lines[chunk + 1] = txtCountNewlines(text + chunkStart(chunk), chunkStart(chunk + 1) - chunkStart(chunk));
+    });
+
+    // lines[chunk] becomes the first line that ends in the chunk, the
+    // last line does not end in a newline and belongs to the last chunk
+    for (int chunk = 0; chunk < chunks; chunk++)
+    {
+        lines[chunk + 1] += lines[chunk];
+    }
+    auto count = lines[chunks] + 1;
+    lines[chunks] = count;
+
+    _nodes.clear();
+    _nodes.resize(count);
+    _free.clear();
+
+    // First every line gets the offset of its end, then, once all of
+    // those are known, the offset of its start is subtracted
+    runParallel(chunks, threads, [&](int chunk)
+    {
+        std::vector<txtcur> positions;
+        auto line = lines[chunk];
+        for (auto block = chunkStart(chunk); block < chunkStart(chunk + 1); block += TXT_LINE_SCAN_BLOCK_SIZE)
+        {
+            auto end = chunkStart(chunk + 1) - block < TXT_LINE_SCAN_BLOCK_SIZE ? chunkStart(chunk + 1) : block + TXT_LINE_SCAN_BLOCK_SIZE;
+
+            positions.resize(end - block);
+            auto found = txtFindNewlines(text + block, end - block, positions.data());
+            for (txtsz i = 0; i < found; i++)
+            {
+                _nodes[line++].length = block + positions[i] + 1;
+            }
+        }
+    });
+    _nodes[count - 1].length = size;
+
+    std::vector<txtcur> previousEnds(chunks);
+    for (int chunk = 0; chunk < chunks; chunk++)
+    {
+        previousEnds[chunk] = lines[chunk] > 0 ? _nodes[lines[chunk] - 1].length : 0;
+    }
+
+    runParallel(chunks, threads, [&](int chunk)
+    {
+        for (auto line = lines[chunk + 1] - 1; line >= lines[chunk]; line--)
+        {
+            auto& node = _nodes[line];
+            node.length -= line > lines[chunk] ? _nodes[line - 1].length : previousEnds[chunk];
+            node.left = node.right = -1;
+            node.priority = linePriority(line, _seed);
+            node.count = 1;
+            node.sum = node.length;
+        }
+    });
+
+    // Every thread links the subtrees below the top levels of the tree,
+    // the top levels are linked once they are done
+    int depth = 0;
+    while ((1 << depth) < threads * 4) depth++;
+    if (threads == 1) depth = 0;
+
+    std::vector<std::pair<txtsz, txtsz> > ranges(1, std::make_pair(txtsz(0), count));
+    for (int level = 0; level < depth; level++)
+    {
+        std::vector<std::pair<txtsz, txtsz> > next;
+        for (auto& range : ranges)
+        {
+            next.push_back(std::make_pair(range.first, range.second / 2));
+            next.push_back(std::make_pair(range.first + range.second / 2 + 1, range.second - range.second / 2 - 1));
+        }
+        ranges.swap(next);
+    }
+
+    runParallel(int(ranges.size()), threads, [&](int range)
+    {
+        link(ranges[range].first, ranges[range].second, -1);
+    });
+
+    _root = depth == 0 ? link(0, count, -1) : link(0, count, depth);
+}
+
+void TxtLineIndex::load(const std::vector<txtsz>& lengths)
+{
+    _nodes.clear();
+    _nodes.reserve(lengths.size());
+    _free.clear();
+
+    _root = build(lengths.data(), txtsz(lengths.size()));
+    if (_root < 0) _root = newNode(0);
+}
+
+void TxtLineIndex::insert(txtcur position, const txtchr* text, txtsz size)
+{
+    if (size <= 0) return;
+
+    auto line = lineOf(position);
+
+    std::vector<txtsz> lengths;
+    auto start = scan(text, size, lengths);
+
+    if (lengths.empty())
+    {
+        addLength(line, size);
+        return;
+    }
+
+    // The line the text goes into is cut in two, its head ends with the
+    // first inserted line and its tail follows the last inserted line
+    auto head = position - lineStart(line);
+    auto tail = lineLength(line) - head;
+
+    lengths.front() += head;
+    lengths.push_back(size - start + tail);
+
+    replaceLines(line, line, lengths);
+}
+
+void TxtLineIndex::erase(txtcur position, txtsz size)
+{
+    if (size <= 0) return;
+
+    auto first = lineOf(position);
+    auto last = lineOf(position + size);
+
+    if (first == last)
+    {
+        addLength(first, -size);
+        return;
+    }
+
+    // What is left of the first and the last line becomes one line
+    auto end = lineStart(last) + lineLength(last);
+    std::vector<txtsz> lengths(1, end - lineStart(first) - size);
+
+    replaceLines(first, last, lengths);
+}
+
+txtsz TxtLineIndex::lineCount() const
+{
+    return count(_root);
+}
+
+txtcur TxtLineIndex::lineStart(txtsz line) const
+{
+    if (line <= 0) return 0;
+    if (line >= lineCount()) return -1;
+
+    txtcur start = 0;
+    auto node = _root;
+    while (node >= 0)
+    {
+        auto& n = _nodes[node];
+        auto leftCount = count(n.left);
+        if (line < leftCount)
+        {
+            node = n.left;
+        }
+        else if (line == leftCount)
+        {
+            return start + sum(n.left);
+        }
+        else
+        {
+            line -= leftCount + 1;
+            start += sum(n.left) + n.length;
+            node = n.right;
+        }
+    }
+
+    return -1;
+}
+
+txtsz TxtLineIndex::lineLength(txtsz line) const
+{
+    auto node = _root;
+    while (node >= 0)
+    {
+        auto& n = _nodes[node];
+        auto leftCount = count(n.left);
+        if (line < leftCount)
+        {
+            node = n.left;
+        }
+        else if (line == leftCount)
+        {
+            return n.length;
+        }
+        else
+        {
+            line -= leftCount + 1;
+            node = n.right;
+        }
+    }
+
+    return 0;
+}
+
+txtsz TxtLineIndex::lineOf(txtcur position) const
+{
+    txtsz line = 0;
+    auto node = _root;
+    while (node >= 0)
+    {
+        auto& n = _nodes[node];
+        auto leftSum = sum(n.left);
+        if (position < leftSum)
+        {
+            node = n.left;
+        }
+        else if (position < leftSum + n.length)
+        {
+            return line + count(n.left);
+        }
+        else
+        {
+            position -= leftSum + n.length;
+            line += count(n.left) + 1;
+            node = n.right;
+        }
+    }
+
+    // only the end of the text gets here, which is on the last line
+    return lineCount() - 1;
+}
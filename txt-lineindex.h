@@ -0,0 +1,75 @@
+#ifndef TXT_LINEINDEX_H
+#define TXT_LINEINDEX_H
+
+#include "txt-storage.h"
+
+/*
+ * --- Line index ---
+ * Keeps the length of every line, including its newline, in an
+ * implicit treap: the lines are ordered by their position in the tree
+ * and every node caches the number of lines and bytes below it. That
+ * gives the start of a line, and the line of an offset, in O(log n).
+ * Edits are passed in as they happen, so the index never has to scan
+ * more than the inserted text. The last line never ends in a newline,
+ * an empty text has one empty line.
+ *
+ * The nodes live in one vector and refer to each other by index, freed
+ * nodes are reused. A node takes 40 bytes and the indices are ints, so
+ * the index costs O(lines) memory, also for a paged text, and holds at
+ * most 2^31 lines.
+ *
+ * Loading a large text scans it on several threads: every thread counts
+ * the newlines in its chunks, a prefix sum over the counts tells each
+ * chunk where its lines go, and the threads then write the line lengths
+ * and link them into subtrees in place. threads = 0 picks one thread
+ * for small texts and one per core otherwise.
+ */
+
+class TxtLineIndex
+{
+    struct Node
+    {
+        int left;
+        int right;
+        unsigned priority;
+        txtsz count;        // lines in this subtree
+        txtsz length;       // length of this line
+        txtsz sum;          // length of all lines in this subtree
+    };
+
+    std::vector<Node> _nodes;
+    std::vector<int> _free;
+    int _root;
+    unsigned _seed;
+
+    int newNode(txtsz length);
+    void freeTree(int node);
+    void update(int node);
+    txtsz count(int node) const;
+    txtsz sum(int node) const;
+    int merge(int left, int right);
+    void split(int node, txtsz count, int& left, int& right);
+    int build(const txtsz* lengths, txtsz count);
+    int link(txtsz first, txtsz count, int depth);
+    void heapify(int node);
+    void addLength(txtsz line, txtsz size);
+    void replaceLines(txtsz first, txtsz last, const std::vector<txtsz>& lengths);
+public:
+    TxtLineIndex();
+
+    // Appends the length of every line that ends in text to lengths and
+    // returns the offset just past the last newline
+    static txtcur scan(const txtchr* text, txtsz size, std::vector<txtsz>& lengths);
+
+    void load(const txtchr* text, txtsz size, int threads = 0);
+    void load(const std::vector<txtsz>& lengths);
+    void insert(txtcur position, const txtchr* text, txtsz size);
+    void erase(txtcur position, txtsz size);
+
+    txtsz lineCount() const;
+    txtcur lineStart(txtsz line) const;
+    txtsz lineLength(txtsz line) const;
+    txtsz lineOf(txtcur position) const;
+};
+
+#endif // TXT_LINEINDEX_H
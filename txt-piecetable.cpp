@@ -0,0 +1,494 @@
+#include "txt-piecetable.h"
+#include "txt-kernels.h"
+#include <algorithm>
+#include <mutex>
+
+// A snapshot only reads the pages of a paged original once, in order
+#define TXT_SNAPSHOT_PAGE_BUDGET (4 * TXT_PAGE_SIZE)
+
+TxtPieceStorage::TxtPieceStorage()
+    : _originalText(nullptr), _originalSize(0), _originalTerminated(false),
+      _added(std::make_shared<std::vector<txtchr> >()), _pieces(std::make_shared<std::vector<TxtPiece> >()), _piecesLent(false),
+      _size(0), _lastPiece(0), _lastPieceStart(0), _dataValid(false)
+{ }
+
+TxtPieceStorage::~TxtPieceStorage()
+{ }
+
+const txtchr* TxtPieceStorage::source(const TxtPiece& piece) const
+{
+    if (piece.source == TxtPieceSources::Original) return _originalText;
+
+    return _added->data();
+}
+
+void TxtPieceStorage::ownPieces()
+{
+    if (!_piecesLent) return;
+
+    _pieces = std::make_shared<std::vector<TxtPiece> >(*_pieces);
+    _piecesLent = false;
+}
+
+// Hands the text of the pieces to visit, a page of a paged original at a
+// time and everything else in batches
+static bool visitPieces(const std::vector<TxtPiece>& pieces, const txtchr* originalText, const txtchr* addedText,
+                        const TxtPagedFile& paged, const TxtSegmentVisitor& visit)
+{
+    TxtSegment batch[TXT_SEGMENT_BATCH];
+    int count = 0;
+
+    for (auto& piece : pieces)
+    {
+        if (piece.source == TxtPieceSources::Original && originalText == nullptr)
+        {
+            // A page may be dropped as soon as the next one is read, so
+            // every page goes out on its own
+            if (count > 0 && !visit(batch, count)) return false;
+            count = 0;
+
+            for (txtsz done = 0; done < piece.length; )
+            {
+                TxtSegment segment;
+                segment.size = piece.length - done;
+                segment.text = paged.span(piece.start + done, segment.size);
+                if (!visit(&segment, 1)) return false;
+
+                done += segment.size;
+            }
+            continue;
+        }
+
+        auto text = piece.source == TxtPieceSources::Original ? originalText : addedText;
+        batch[count++] = { text + piece.start, piece.length };
+        if (count == TXT_SEGMENT_BATCH)
+        {
+            if (!visit(batch, count)) return false;
+            count = 0;
+        }
+    }
+
+    return count == 0 || visit(batch, count);
+}
+
+size_t TxtPieceStorage::findPiece(txtcur position, txtcur& pieceStart) const
+{
+    auto index = _lastPiece;
+    auto start = _lastPieceStart;
+
+    if (index > _pieces->size())
+    {
+        index = 0;
+        start = 0;
+    }
+
+    while (index > 0 && position < start)
+    {
+        index--;
+        start -= (*_pieces)[index].length;
+    }
+
+    while (index < _pieces->size() && position >= start + (*_pieces)[index].length)
+    {
+        start += (*_pieces)[index].length;
+        index++;
+    }
+
+    _lastPiece = index;
+    _lastPieceStart = start;
+
+    pieceStart = start;
+    return index;
+}
+
+size_t TxtPieceStorage::splitPiece(txtcur position)
+{
+    ownPieces();
+
+    txtcur start;
+    auto index = findPiece(position, start);
+
+    if (index < _pieces->size() && start != position)
+    {
+        auto offset = position - start;
+
+        TxtPiece right = (*_pieces)[index];
+        right.start += offset;
+        right.length -= offset;
+        (*_pieces)[index].length = offset;
+
+        index++;
+        _pieces->insert(_pieces->begin() + index, right);
+    }
+
+    _lastPiece = index;
+    _lastPieceStart = position;
+
+    return index;
+}
+
+void TxtPieceStorage::insertPiece(txtcur position, const TxtPiece& piece)
+{
+    auto index = splitPiece(position);
+
+    auto previous = index > 0 ? &(*_pieces)[index - 1] : nullptr;
+    if (previous != nullptr && previous->source == piece.source && previous->start + previous->length == piece.start)
+    {
+        // Typing appends to the added source right after the previous piece, so that piece just grows
+        previous->length += piece.length;
+        _lastPiece = index - 1;
+        _lastPieceStart = position + piece.length - previous->length;
+    }
+    else
+    {
+        _pieces->insert(_pieces->begin() + index, piece);
+    }
+
+    _size += piece.length;
+    _dataValid = false;
+}
+
+void TxtPieceStorage::load(const txtchr* text, txtsz size)
+{
+    _mapping.reset();
+    _paged.close();
+
+    auto original = std::make_shared<std::vector<txtchr> >(text, text + size);
+    original->push_back('\0');
+    _original = original;
+
+    _originalText = _original->data();
+    _originalSize = size;
+    _originalTerminated = true;
+
+    reset();
+}
+
+void TxtPieceStorage::load(TxtFileMapping&& mapping)
+{
+    _original.reset();
+    _paged.close();
+    _mapping = std::make_shared<const TxtFileMapping>(std::move(mapping));
+
+    _originalText = _mapping->data();
+    _originalSize = _mapping->size();
+    _originalTerminated = _mapping->terminated();
+
+    reset();
+}
+
+void TxtPieceStorage::load(TxtPagedFile&& paged)
+{
+    _original.reset();
+    _mapping.reset();
+    _paged = std::move(paged);
+
+    _originalText = nullptr;
+    _originalSize = _paged.size();
+    _originalTerminated = false;
+
+    reset();
+}
+
+void TxtPieceStorage::reset()
+{
+    // snapshots may still hold the old sources
+    _added = std::make_shared<std::vector<txtchr> >();
+    _pieces = std::make_shared<std::vector<TxtPiece> >();
+    _piecesLent = false;
+
+    if (_originalSize > 0)
+    {
+        _pieces->push_back({ TxtPieceSources::Original, 0, _originalSize });
+    }
+
+    _size = _originalSize;
+    _lastPiece = 0;
+    _lastPieceStart = 0;
+    _data = std::vector<txtchr>();
+    _dataValid = false;
+}
+
+void TxtPieceStorage::reserveAdded(txtsz size)
+{
+    // Snapshots may read the added source, it is never moved while they
+    // do: a full one is replaced by a larger copy instead of growing
+    if (_added->size() + size > _added->capacity())
+    {
+        auto added = std::make_shared<std::vector<txtchr> >();
+        added->reserve(std::max(_added->capacity() * 2, _added->size() + size_t(size)));
+        added->assign(_added->begin(), _added->end());
+        _added = added;
+    }
+}
+
+void TxtPieceStorage::insert(txtcur position, const txtchr* text, txtsz size)
+{
+    if (size <= 0) return;
+
+    reserveAdded(size);
+
+    TxtPiece piece = { TxtPieceSources::Added, txtsz(_added->size()), size };
+    _added->insert(_added->end(), text, text + size);
+
+    insertPiece(position, piece);
+}
+
+void TxtPieceStorage::erase(txtcur position, txtsz size)
+{
+    if (size <= 0) return;
+
+    auto first = splitPiece(position);
+    auto last = splitPiece(position + size);
+
+    _pieces->erase(_pieces->begin() + first, _pieces->begin() + last);
+
+    _lastPiece = first;
+    _lastPieceStart = position;
+
+    _size -= size;
+    _dataValid = false;
+}
+
+void TxtPieceStorage::apply(const TxtEdit* edits, size_t count)
+{
+    if (count == 0) return;
+
+    txtsz added = 0, removed = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        added += edits[i].textSize;
+        removed += edits[i].size;
+    }
+    reserveAdded(added);
+
+    // The old list is read once, from the front, while the new one is
+    // built; the snapshots keep the old one
+    auto pieces = std::make_shared<std::vector<TxtPiece> >();
+    pieces->reserve(_pieces->size() + 2 * count);
+
+    auto append = [&pieces](const TxtPiece& piece)
+    {
+        auto back = pieces->empty() ? nullptr : &pieces->back();
+        if (back != nullptr && back->source == piece.source && back->start + back->length == piece.start) back->length += piece.length;
+        else pieces->push_back(piece);
+    };
+
+    size_t index = 0;
+    txtsz offset = 0;
+    txtcur position = 0;
+    auto walk = [&](txtcur to, bool keep)
+    {
+        while (position < to)
+        {
+            auto& piece = (*_pieces)[index];
+            auto length = std::min(piece.length - offset, to - position);
+            if (keep) append({ piece.source, piece.start + offset, length });
+
+            offset += length;
+            position += length;
+            if (offset == piece.length)
+            {
+                index++;
+                offset = 0;
+            }
+        }
+    };
+
+    for (size_t i = 0; i < count; i++)
+    {
+        auto& edit = edits[i];
+        walk(edit.position, true);
+        walk(edit.position + edit.size, false);
+
+        if (edit.textSize > 0)
+        {
+            append({ TxtPieceSources::Added, txtsz(_added->size()), edit.textSize });
+            _added->insert(_added->end(), edit.text, edit.text + edit.textSize);
+        }
+    }
+    walk(_size, true);
+
+    _size += added - removed;
+
+    _pieces = pieces;
+    _piecesLent = false;
+    _lastPiece = 0;
+    _lastPieceStart = 0;
+    _dataValid = false;
+}
+
+void TxtPieceStorage::copy(txtchr* destination, txtcur position, txtsz size) const
+{
+    txtcur start;
+    auto index = findPiece(position, start);
+
+    while (size > 0 && index < _pieces->size())
+    {
+        auto& piece = (*_pieces)[index];
+        auto offset = position - start;
+        auto count = piece.length - offset < size ? piece.length - offset : size;
+
+        if (piece.source == TxtPieceSources::Original && _originalText == nullptr)
+        {
+            _paged.copy(destination, piece.start + offset, count);
+        }
+        else
+        {
+            txtCopy(destination, source(piece) + piece.start + offset, count);
+        }
+
+        destination += count;
+        position += count;
+        size -= count;
+        start += piece.length;
+        index++;
+    }
+}
+
+txtchr TxtPieceStorage::at(txtcur position) const
+{
+    txtcur start;
+    auto index = findPiece(position, start);
+
+    if (index >= _pieces->size()) return '\0';
+
+    auto& piece = (*_pieces)[index];
+    if (piece.source == TxtPieceSources::Original && _originalText == nullptr)
+    {
+        return _paged.at(piece.start + position - start);
+    }
+
+    return source(piece)[piece.start + position - start];
+}
+
+const txtchr* TxtPieceStorage::data() const
+{
+    if (_pieces->size() == 1 && (*_pieces)[0].source == TxtPieceSources::Original && _originalText != nullptr &&
+        (*_pieces)[0].start + (*_pieces)[0].length == _originalSize && _originalTerminated)
+    {
+        return _originalText + (*_pieces)[0].start;
+    }
+
+    if (!_dataValid)
+    {
+        _data.resize(_size + 1);
+        copy(_data.data(), 0, _size);
+        _data[_size] = '\0';
+        _dataValid = true;
+    }
+
+    return _data.data();
+}
+
+txtsz TxtPieceStorage::size() const
+{
+    return _size;
+}
+
+bool TxtPieceStorage::pieces(txtcur position, txtsz size, std::vector<TxtPiece>& pieces) const
+{
+    txtcur start;
+    auto index = findPiece(position, start);
+
+    while (size > 0 && index < _pieces->size())
+    {
+        auto piece = (*_pieces)[index];
+        auto offset = position - start;
+
+        piece.start += offset;
+        piece.length -= offset;
+        if (piece.length > size) piece.length = size;
+        pieces.push_back(piece);
+
+        position += piece.length;
+        size -= piece.length;
+        start += (*_pieces)[index].length;
+        index++;
+    }
+
+    return true;
+}
+
+void TxtPieceStorage::insertPieces(txtcur position, const TxtPiece* pieces, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        insertPiece(position, pieces[i]);
+        position += pieces[i].length;
+    }
+}
+
+bool TxtPieceStorage::segments(const TxtSegmentVisitor& visit) const
+{
+    return visitPieces(*_pieces, _originalText, _added->data(), _paged, visit);
+}
+
+class TxtPieceSnapshot : public TxtSnapshot
+{
+    std::shared_ptr<const std::vector<TxtPiece> > _pieces;
+    std::shared_ptr<const std::vector<txtchr> > _original;
+    std::shared_ptr<const TxtFileMapping> _mapping;
+    std::shared_ptr<const std::vector<txtchr> > _added;
+    const txtchr* _originalText;
+    const txtchr* _addedText;
+    txtsz _size;
+
+    // the pages of a paged original are read by one reader at a time
+    mutable std::mutex _pagedLock;
+    TxtPagedFile _paged;
+public:
+    TxtPieceSnapshot(std::shared_ptr<const std::vector<TxtPiece> > pieces,
+                     std::shared_ptr<const std::vector<txtchr> > original,
+                     std::shared_ptr<const TxtFileMapping> mapping,
+                     std::shared_ptr<const std::vector<txtchr> > added,
+                     const txtchr* originalText, txtsz size)
+        : _pieces(std::move(pieces)), _original(std::move(original)), _mapping(std::move(mapping)), _added(std::move(added)),
+          _originalText(originalText), _addedText(_added->data()), _size(size)
+    { }
+
+    bool openPaged(const TxtPagedFile& paged)
+    {
+        return _paged.open(paged, TXT_SNAPSHOT_PAGE_BUDGET);
+    }
+
+    txtsz size() const override
+    {
+        return _size;
+    }
+
+    bool segments(const TxtSegmentVisitor& visit) const override
+    {
+        std::unique_lock<std::mutex> lock(_pagedLock, std::defer_lock);
+        if (_originalText == nullptr) lock.lock();
+
+        return visitPieces(*_pieces, _originalText, _addedText, _paged, visit);
+    }
+};
+
+std::shared_ptr<const TxtSnapshot> TxtPieceStorage::snapshot() const
+{
+    auto snapshot = std::make_shared<TxtPieceSnapshot>(_pieces, _original, _mapping, _added, _originalText, _size);
+    _piecesLent = true;
+
+    // without a handle of its own on the paged file the snapshot would
+    // have to share the cache of the storage, it gets a copy instead
+    if (paged() && !snapshot->openPaged(_paged)) return TxtStorageBase::snapshot();
+
+    return snapshot;
+}
+
+size_t TxtPieceStorage::pieceCount() const
+{
+    return _pieces->size();
+}
+
+void TxtPieceStorage::advise(TxtAccessPatterns pattern) const
+{
+    if (_mapping) _mapping->advise(pattern);
+}
+
+bool TxtPieceStorage::paged() const
+{
+    return _originalText == nullptr && _originalSize > 0;
+}
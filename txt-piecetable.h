@@ -0,0 +1,83 @@
+#ifndef TXT_PIECETABLE_H
+#define TXT_PIECETABLE_H
+
+#include "txt-file.h"
+#include "txt-storage.h"
+
+/*
+ * --- Piece table ---
+ * The loaded text is kept untouched as the original source and all
+ * typed text is appended to the added source, which is never modified
+ * or shrunk. The document is described by an ordered list of pieces
+ * pointing into those two sources, so an edit only splits or trims
+ * pieces and never moves document bytes around.
+ *
+ * The original can also be a file mapping, which makes opening a file
+ * free. As long as the text is one piece that runs to the end of the
+ * original, data() returns the original itself instead of a copy. Or it
+ * can be a paged file, which only reads the pages that at() and copy()
+ * touch; data() then has to read the whole file.
+ *
+ * A snapshot shares the sources and the list of pieces: the original
+ * never changes, the added source is only appended to and is replaced
+ * by a larger copy when it is full, and the piece list is copied by the
+ * first edit after the snapshot. A batch of edits builds a new list of
+ * pieces in one walk over the old one.
+ */
+
+class TxtPieceStorage : public TxtStorageBase<TxtPieceStorage>
+{
+    std::shared_ptr<const std::vector<txtchr> > _original;     // a copy of the loaded text, with a NUL after it
+    std::shared_ptr<const TxtFileMapping> _mapping;             // or the opened file
+    TxtPagedFile _paged;                                        // or the pages of it, when _originalText is nullptr
+    const txtchr* _originalText;
+    txtsz _originalSize;
+    bool _originalTerminated;
+    std::shared_ptr<std::vector<txtchr> > _added;
+    std::shared_ptr<std::vector<TxtPiece> > _pieces;
+    mutable bool _piecesLent;       // a snapshot shares _pieces, the next edit copies them
+    txtsz _size;
+
+    // cache of the piece that was found last, makes walking the text cheap
+    mutable size_t _lastPiece;
+    mutable txtcur _lastPieceStart;
+
+    // contiguous copy of the text, only built when data() is called
+    mutable std::vector<txtchr> _data;
+    mutable bool _dataValid;
+
+    const txtchr* source(const TxtPiece& piece) const;
+    void ownPieces();
+    size_t findPiece(txtcur position, txtcur& pieceStart) const;
+    size_t splitPiece(txtcur position);
+    void insertPiece(txtcur position, const TxtPiece& piece);
+    void reserveAdded(txtsz size);
+    void reset();
+public:
+    TxtPieceStorage();
+    TxtPieceStorage(const TxtPieceStorage&) = delete;
+    ~TxtPieceStorage();
+
+    void load(const txtchr* text, txtsz size);
+    void load(TxtFileMapping&& mapping);
+    void load(TxtPagedFile&& paged);
+    void insert(txtcur position, const txtchr* text, txtsz size);
+    void erase(txtcur position, txtsz size);
+    void copy(txtchr* destination, txtcur position, txtsz size) const;
+    txtchr at(txtcur position) const;
+
+    const txtchr* data() const;
+    txtsz size() const;
+
+    bool pieces(txtcur position, txtsz size, std::vector<TxtPiece>& pieces) const;
+    void insertPieces(txtcur position, const TxtPiece* pieces, size_t count);
+    void apply(const TxtEdit* edits, size_t count);
+    bool segments(const TxtSegmentVisitor& visit) const;
+    std::shared_ptr<const TxtSnapshot> snapshot() const;
+
+    size_t pieceCount() const;
+    void advise(TxtAccessPatterns pattern) const;
+    bool paged() const;
+};
+
+#endif // TXT_PIECETABLE_H
@@ -0,0 +1,609 @@
+#include "txt-rope.h"
+#include "txt-kernels.h"
+#include <atomic>
+
+#define TXT_ROPE_CHUNK_SIZE 4096
+#define TXT_ROPE_FANOUT 16
+
+/*
+ * Nodes are reference counted, a snapshot shares the root of the rope.
+ * Before an edit changes a node that is shared it copies the node,
+ * which shares the children of the original, and puts the copy in its
+ * place in the parent. An edit so only copies the path it walks down.
+ */
+
+struct TxtRopeStorage::Node
+{
+    std::atomic<int> references;    // parents, the rope and snapshots that refer to this node
+    bool leaf;
+    txtsz size;                     // bytes in this subtree
+    txtsz newlines;                 // newlines in this subtree
+    std::vector<Node*> children;    // only used by interior nodes
+    std::vector<txtchr> text;       // only used by leaves
+};
+
+typedef TxtRopeStorage::Node RopeNode;
+
+static RopeNode* newLeaf(const txtchr* text, txtsz size)
+{
+    auto node = new RopeNode();
+    node->references = 1;
+    node->leaf = true;
+    node->text.reserve(TXT_ROPE_CHUNK_SIZE);
+    node->text.assign(text, text + size);
+    node->size = size;
+    node->newlines = txtCountNewlines(text, size);
+    return node;
+}
+
+static RopeNode* newInterior()
+{
+    auto node = new RopeNode();
+    node->references = 1;
+    node->leaf = false;
+    node->size = 0;
+    node->newlines = 0;
+    return node;
+}
+
+static RopeNode* acquireNode(RopeNode* node)
+{
+    node->references.fetch_add(1, std::memory_order_relaxed);
+    return node;
+}
+
+static void releaseNode(RopeNode* node)
+{
+    if (node->references.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+
+    for (auto child : node->children)
+    {
+        releaseNode(child);
+    }
+    delete node;
+}
+
+// Returns the node in slot, after replacing it with a copy when anyone
+// else refers to it
+static RopeNode* ownNode(RopeNode*& slot)
+{
+    auto node = slot;
+    if (node->references.load(std::memory_order_acquire) == 1) return node;
+
+    auto copy = node->leaf ? newLeaf(node->text.data(), node->size) : newInterior();
+    copy->size = node->size;
+    copy->newlines = node->newlines;
+    for (auto child : node->children)
+    {
+        copy->children.push_back(acquireNode(child));
+    }
+
+    releaseNode(node);
+    slot = copy;
+    return copy;
+}
+
+static void updateNode(RopeNode* node)
+{
+    node->size = 0;
+    node->newlines = 0;
+    for (auto child : node->children)
+    {
+        node->size += child->size;
+        node->newlines += child->newlines;
+    }
+}
+
+// Cuts text into evenly filled leaves, appending them to leaves
+static void buildLeaves(const txtchr* text, txtsz size, std::vector<RopeNode*>& leaves)
+{
+    auto count = (size + TXT_ROPE_CHUNK_SIZE - 1) / TXT_ROPE_CHUNK_SIZE;
+    for (txtsz i = 0; i < count; i++)
+    {
+        auto begin = size * i / count;
+        auto end = size * (i + 1) / count;
+        leaves.push_back(newLeaf(text + begin, end - begin));
+    }
+}
+
+// Keeps the first group of the children in node and moves the rest into
+// new nodes when node has more than TXT_ROPE_FANOUT children
+static void splitNode(RopeNode* node, std::vector<RopeNode*>& siblings)
+{
+    auto total = node->children.size();
+    if (total <= TXT_ROPE_FANOUT) return;
+
+    auto groups = (total + TXT_ROPE_FANOUT - 1) / TXT_ROPE_FANOUT;
+    for (size_t i = 1; i < groups; i++)
+    {
+        auto sibling = newInterior();
+        sibling->children.assign(node->children.begin() + total * i / groups,
+                                 node->children.begin() + total * (i + 1) / groups);
+        updateNode(sibling);
+        siblings.push_back(sibling);
+    }
+
+    node->children.resize(total / groups);
+    updateNode(node);
+}
+
+static void insertNode(RopeNode*& slot, txtcur position, const txtchr* text, txtsz size, std::vector<RopeNode*>& siblings)
+{
+    auto node = ownNode(slot);
+
+    if (node->leaf)
+    {
+        if (node->size + size <= TXT_ROPE_CHUNK_SIZE)
+        {
+            node->text.insert(node->text.begin() + position, text, text + size);
+            node->size += size;
+            node->newlines += txtCountNewlines(text, size);
+            return;
+        }
+
+        std::vector<txtchr> all;
+        all.reserve(node->size + size);
+        all.insert(all.end(), node->text.begin(), node->text.begin() + position);
+        all.insert(all.end(), text, text + size);
+        all.insert(all.end(), node->text.begin() + position, node->text.end());
+
+        std::vector<RopeNode*> leaves;
+        buildLeaves(all.data(), txtsz(all.size()), leaves);
+
+        node->text.swap(leaves[0]->text);
+        node->size = leaves[0]->size;
+        node->newlines = leaves[0]->newlines;
+        delete leaves[0];
+
+        siblings.insert(siblings.end(), leaves.begin() + 1, leaves.end());
+        return;
+    }
+
+    size_t index = 0;
+    txtcur start = 0;
+    while (index + 1 < node->children.size() && position > start + node->children[index]->size)
+    {
+        start += node->children[index]->size;
+        index++;
+    }
+
+    std::vector<RopeNode*> extra;
+    insertNode(node->children[index], position - start, text, size, extra);
+    node->children.insert(node->children.begin() + index + 1, extra.begin(), extra.end());
+
+    updateNode(node);
+    splitNode(node, siblings);
+}
+
+// Merges the neighbours of the children that were touched by an erase
+// when they fit together in one node
+static void mergeChildren(RopeNode* node)
+{
+    size_t index = 0;
+    while (index + 1 < node->children.size())
+    {
+        auto left = node->children[index];
+        auto right = node->children[index + 1];
+
+        bool fits = left->leaf
+                ? left->size + right->size <= TXT_ROPE_CHUNK_SIZE
+                : left->children.size() + right->children.size() <= TXT_ROPE_FANOUT;
+
+        if (fits)
+        {
+            left = ownNode(node->children[index]);
+            left->text.insert(left->text.end(), right->text.begin(), right->text.end());
+            for (auto child : right->children)
+            {
+                left->children.push_back(acquireNode(child));
+            }
+            left->size += right->size;
+            left->newlines += right->newlines;
+
+            releaseNode(right);
+            node->children.erase(node->children.begin() + index + 1);
+
+            // the children that now meet in the middle may fit together as well
+            if (!left->leaf) mergeChildren(left);
+        }
+        else
+        {
+            index++;
+        }
+    }
+}
+
+static void eraseNode(RopeNode*& slot, txtcur position, txtsz size)
+{
+    auto node = ownNode(slot);
+
+    if (node->leaf)
+    {
+        node->newlines -= txtCountNewlines(node->text.data() + position, size);
+        node->text.erase(node->text.begin() + position, node->text.begin() + position + size);
+        node->size -= size;
+        return;
+    }
+
+    size_t index = 0;
+    txtcur start = 0;
+    while (index < node->children.size() && size > 0)
+    {
+        auto child = node->children[index];
+        auto end = start + child->size;
+
+        if (end <= position)
+        {
+            start = end;
+            index++;
+            continue;
+        }
+
+        auto from = position - start;
+        auto count = end - position < size ? end - position : size;
+
+        if (from == 0 && count == child->size)
+        {
+            releaseNode(child);
+            node->children.erase(node->children.begin() + index);
+        }
+        else
+        {
+            eraseNode(node->children[index], from, count);
+            index++;
+        }
+
+        start = end;
+        position += count;
+        size -= count;
+    }
+
+    mergeChildren(node);
+    updateNode(node);
+}
+
+static void copyNode(const RopeNode* node, txtchr* destination, txtcur position, txtsz size)
+{
+    if (node->leaf)
+    {
+        txtCopy(destination, node->text.data() + position, size);
+        return;
+    }
+
+    txtcur start = 0;
+    for (auto child : node->children)
+    {
+        if (size <= 0) break;
+
+        auto end = start + child->size;
+        if (end > position)
+        {
+            auto from = position - start;
+            auto count = end - position < size ? end - position : size;
+
+            copyNode(child, destination, from, count);
+
+            destination += count;
+            position += count;
+            size -= count;
+        }
+        start = end;
+    }
+}
+
+// Adds the leaves below node to batch, handing it to visit when it is full
+static bool visitLeaves(const RopeNode* node, TxtSegment* batch, int& count, const TxtSegmentVisitor& visit)
+{
+    if (node->leaf)
+    {
+        if (node->size == 0) return true;
+
+        batch[count++] = { node->text.data(), node->size };
+        if (count < TXT_SEGMENT_BATCH) return true;
+
+        count = 0;
+        return visit(batch, TXT_SEGMENT_BATCH);
+    }
+
+    for (auto child : node->children)
+    {
+        if (!visitLeaves(child, batch, count, visit)) return false;
+    }
+    return true;
+}
+
+TxtRopeStorage::TxtRopeStorage()
+    : _root(nullptr), _lastLeaf(nullptr), _lastLeafStart(0), _dataValid(false)
+{
+    _root = newLeaf(nullptr, 0);
+}
+
+TxtRopeStorage::~TxtRopeStorage()
+{
+    releaseNode(_root);
+}
+
+void TxtRopeStorage::edited()
+{
+    _lastLeaf = nullptr;
+    _dataValid = false;
+}
+
+const RopeNode* TxtRopeStorage::findLeaf(txtcur position, txtcur& leafStart) const
+{
+    if (_lastLeaf != nullptr && position >= _lastLeafStart && position < _lastLeafStart + _lastLeaf->size)
+    {
+        leafStart = _lastLeafStart;
+        return _lastLeaf;
+    }
+
+    const RopeNode* node = _root;
+    txtcur start = 0;
+    while (!node->leaf)
+    {
+        size_t index = 0;
+        while (index + 1 < node->children.size() && position >= start + node->children[index]->size)
+        {
+            start += node->children[index]->size;
+            index++;
+        }
+        node = node->children[index];
+    }
+
+    _lastLeaf = node;
+    _lastLeafStart = start;
+
+    leafStart = start;
+    return node;
+}
+
+void TxtRopeStorage::load(const txtchr* text, txtsz size)
+{
+    releaseNode(_root);
+
+    std::vector<RopeNode*> level;
+    buildLeaves(text, size, level);
+
+    while (level.size() > 1)
+    {
+        std::vector<RopeNode*> parents;
+        auto groups = (level.size() + TXT_ROPE_FANOUT - 1) / TXT_ROPE_FANOUT;
+        for (size_t i = 0; i < groups; i++)
+        {
+            auto parent = newInterior();
+            parent->children.assign(level.begin() + level.size() * i / groups,
+                                    level.begin() + level.size() * (i + 1) / groups);
+            updateNode(parent);
+            parents.push_back(parent);
+        }
+        level.swap(parents);
+    }
+
+    _root = level.empty() ? newLeaf(nullptr, 0) : level[0];
+
+    edited();
+}
+
+void TxtRopeStorage::insert(txtcur position, const txtchr* text, txtsz size)
+{
+    if (size <= 0) return;
+
+    std::vector<RopeNode*> siblings;
+    insertNode(_root, position, text, size, siblings);
+
+    while (!siblings.empty())
+    {
+        auto root = newInterior();
+        root->children.push_back(_root);
+        root->children.insert(root->children.end(), siblings.begin(), siblings.end());
+        updateNode(root);
+
+        siblings.clear();
+        splitNode(root, siblings);
+        _root = root;
+    }
+
+    edited();
+}
+
+void TxtRopeStorage::erase(txtcur position, txtsz size)
+{
+    if (size <= 0) return;
+
+    eraseNode(_root, position, size);
+
+    while (!_root->leaf && _root->children.size() <= 1)
+    {
+        auto root = _root->children.empty() ? newLeaf(nullptr, 0) : acquireNode(_root->children[0]);
+        releaseNode(_root);
+        _root = root;
+    }
+
+    edited();
+}
+
+void TxtRopeStorage::copy(txtchr* destination, txtcur position, txtsz size) const
+{
+    copyNode(_root, destination, position, size);
+}
+
+txtchr TxtRopeStorage::at(txtcur position) const
+{
+    // the end of the text reads as the terminator, like the other engines
+    if (position >= _root->size) return '\0';
+
+    txtcur start;
+    auto leaf = findLeaf(position, start);
+
+    return leaf->text[position - start];
+}
+
+const txtchr* TxtRopeStorage::data() const
+{
+    if (!_dataValid)
+    {
+        _data.resize(_root->size + 1);
+        copy(_data.data(), 0, _root->size);
+        _data[_root->size] = '\0';
+        _dataValid = true;
+    }
+
+    return _data.data();
+}
+
+txtsz TxtRopeStorage::size() const
+{
+    return _root->size;
+}
+
+bool TxtRopeStorage::segments(const TxtSegmentVisitor& visit) const
+{
+    TxtSegment batch[TXT_SEGMENT_BATCH];
+    int count = 0;
+
+    if (!visitLeaves(_root, batch, count, visit)) return false;
+
+    return count == 0 || visit(batch, count);
+}
+
+class TxtRopeSnapshot : public TxtSnapshot
+{
+    RopeNode* _root;
+public:
+    TxtRopeSnapshot(RopeNode* root)
+        : _root(acquireNode(root))
+    { }
+
+    ~TxtRopeSnapshot()
+    {
+        releaseNode(_root);
+    }
+
+    txtsz size() const override
+    {
+        return _root->size;
+    }
+
+    bool segments(const TxtSegmentVisitor& visit) const override
+    {
+        TxtSegment batch[TXT_SEGMENT_BATCH];
+        int count = 0;
+
+        if (!visitLeaves(_root, batch, count, visit)) return false;
+
+        return count == 0 || visit(batch, count);
+    }
+
+    void copy(txtchr* destination, txtcur position, txtsz size) const override
+    {
+        copyNode(_root, destination, position, size);
+    }
+
+    RopeNode* root() const
+    {
+        return _root;
+    }
+};
+
+std::shared_ptr<const TxtSnapshot> TxtRopeStorage::snapshot() const
+{
+    return std::make_shared<TxtRopeSnapshot>(_root);
+}
+
+void TxtRopeStorage::restore(const TxtSnapshot& snapshot)
+{
+    auto version = dynamic_cast<const TxtRopeSnapshot*>(&snapshot);
+    if (version != nullptr)
+    {
+        auto root = acquireNode(version->root());
+        releaseNode(_root);
+        _root = root;
+
+        edited();
+        return;
+    }
+
+    // the snapshot of another engine is loaded as text
+    std::vector<txtchr> text(snapshot.size());
+    snapshot.copy(text.data(), 0, txtsz(text.size()));
+    load(text.data(), txtsz(text.size()));
+}
+
+txtcur TxtRopeStorage::findLineStart(txtcur from) const
+{
+    if (from < 0 || from > size()) return -1;
+
+    return lineStart(lineOf(from));
+}
+
+txtcur TxtRopeStorage::findNextLineStart(txtcur from) const
+{
+    if (from < 0 || from >= size()) return -1;
+
+    auto line = lineOf(from) + 1;
+    if (line >= lineCount()) return size();
+
+    return lineStart(line);
+}
+
+txtsz TxtRopeStorage::lineCount() const
+{
+    return _root->newlines + 1;
+}
+
+txtcur TxtRopeStorage::lineStart(txtsz line) const
+{
+    if (line <= 0) return 0;
+    if (line > _root->newlines) return -1;
+
+    const RopeNode* node = _root;
+    txtcur start = 0;
+    while (!node->leaf)
+    {
+        size_t index = 0;
+        while (node->children[index]->newlines < line)
+        {
+            line -= node->children[index]->newlines;
+            start += node->children[index]->size;
+            index++;
+        }
+        node = node->children[index];
+    }
+
+    for (txtsz i = 0; i < node->size; i++)
+    {
+        if (node->text[i] == '\n' && --line == 0) return start + i + 1;
+    }
+
+    return -1;
+}
+
+txtsz TxtRopeStorage::lineOf(txtcur position) const
+{
+    const RopeNode* node = _root;
+    txtsz line = 0;
+    txtcur start = 0;
+    while (!node->leaf)
+    {
+        size_t index = 0;
+        while (index + 1 < node->children.size() && position >= start + node->children[index]->size)
+        {
+            line += node->children[index]->newlines;
+            start += node->children[index]->size;
+            index++;
+        }
+        node = node->children[index];
+    }
+
+    return line + txtCountNewlines(node->text.data(), position - start);
+}
+
+int TxtRopeStorage::depth() const
+{
+    int depth = 1;
+    for (const RopeNode* node = _root; !node->leaf; node = node->children[0])
+    {
+        depth++;
+    }
+    return depth;
+}
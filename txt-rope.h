@@ -0,0 +1,60 @@
+#ifndef TXT_ROPE_H
+#define TXT_ROPE_H
+
+#include "txt-storage.h"
+
+/*
+ * --- Rope ---
+ * The text is cut into chunks of at most TXT_ROPE_CHUNK_SIZE bytes which
+ * are the leaves of a B-tree. Every node caches the number of bytes and
+ * newlines below it, so finding an offset or a line only needs one walk
+ * from the root to a leaf and an edit only touches the nodes on that
+ * path. All leaves are kept at the same depth. Snapshots share the
+ * nodes, an edit copies the shared nodes on its path, so every snapshot
+ * is a persistent version of the text that restore() switches back to.
+ */
+
+class TxtRopeStorage : public TxtStorageBase<TxtRopeStorage>
+{
+public:
+    struct Node;
+private:
+    Node* _root;
+
+    // leaf that was found last, makes walking the text cheap
+    mutable const Node* _lastLeaf;
+    mutable txtcur _lastLeafStart;
+
+    // contiguous copy of the text, only built when data() is called
+    mutable std::vector<txtchr> _data;
+    mutable bool _dataValid;
+
+    const Node* findLeaf(txtcur position, txtcur& leafStart) const;
+    void edited();
+public:
+    TxtRopeStorage();
+    TxtRopeStorage(const TxtRopeStorage&) = delete;
+    ~TxtRopeStorage();
+
+    void load(const txtchr* text, txtsz size);
+    void insert(txtcur position, const txtchr* text, txtsz size);
+    void erase(txtcur position, txtsz size);
+    void copy(txtchr* destination, txtcur position, txtsz size) const;
+    txtchr at(txtcur position) const;
+
+    const txtchr* data() const;
+    txtsz size() const;
+    bool segments(const TxtSegmentVisitor& visit) const;
+    std::shared_ptr<const TxtSnapshot> snapshot() const;
+    void restore(const TxtSnapshot& snapshot);
+
+    txtcur findLineStart(txtcur from) const;
+    txtcur findNextLineStart(txtcur from) const;
+
+    txtsz lineCount() const;
+    txtcur lineStart(txtsz line) const;
+    txtsz lineOf(txtcur position) const;
+    int depth() const;
+};
+
+#endif // TXT_ROPE_H
@@ -0,0 +1,409 @@
+#include "txt-storage.h"
+#include "txt-kernels.h"
+#include <cstdlib>
+#include <new>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#define TXT_USE_MREMAP
+#endif
+
+#define TXT_BLOCK_SIZE 16
+#define TXT_MIN_ALLOC_SIZE 64
+#define TXT_MAP_THRESHOLD (1 << 20)
+
+txtsz TxtGeometricGrowth::grow(txtsz capacity, txtsz required)
+{
+    if (capacity < TXT_MIN_ALLOC_SIZE) capacity = TXT_MIN_ALLOC_SIZE;
+
+    while (capacity < required)
+    {
+        capacity *= 2;
+    }
+
+    return capacity;
+}
+
+txtsz TxtGeometricGrowth::shrink(txtsz capacity, txtsz size)
+{
+    if (capacity <= TXT_MIN_ALLOC_SIZE || size >= capacity / 4) return capacity;
+
+    return grow(TXT_MIN_ALLOC_SIZE, size * 2);
+}
+
+txtsz TxtBlockGrowth::grow(txtsz capacity, txtsz required)
+{
+    if (capacity < required)
+    {
+        capacity += ((required - capacity + TXT_BLOCK_SIZE - 1) / TXT_BLOCK_SIZE) * TXT_BLOCK_SIZE;
+    }
+
+    return capacity;
+}
+
+txtsz TxtBlockGrowth::shrink(txtsz capacity, txtsz)
+{
+    return capacity;
+}
+
+#ifdef TXT_USE_MREMAP
+static bool isMapped(txtsz size)
+{
+    return size >= TXT_MAP_THRESHOLD;
+}
+
+static txtchr* mapPages(txtsz size)
+{
+    auto pages = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (pages == MAP_FAILED) throw std::bad_alloc();
+
+    return (txtchr*)pages;
+}
+#endif
+
+TxtSnapshot::~TxtSnapshot()
+{ }
+
+TxtCopySnapshot::TxtCopySnapshot(txtsz size)
+{
+    _text.reserve(size);
+}
+
+void TxtCopySnapshot::append(const TxtSegment* segments, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        auto size = _text.size();
+        _text.resize(size + segments[i].size);
+        txtCopy(_text.data() + size, segments[i].text, segments[i].size);
+    }
+}
+
+txtsz TxtCopySnapshot::size() const
+{
+    return txtsz(_text.size());
+}
+
+bool TxtCopySnapshot::segments(const TxtSegmentVisitor& visit) const
+{
+    TxtSegment segment = { _text.data(), txtsz(_text.size()) };
+    return segment.size == 0 || visit(&segment, 1);
+}
+
+void TxtSnapshot::copy(txtchr* destination, txtcur position, txtsz size) const
+{
+    txtcur start = 0;
+    segments([&](const TxtSegment* segments, int count)
+    {
+        for (int i = 0; i < count && size > 0; i++)
+        {
+            auto end = start + segments[i].size;
+            if (end > position)
+            {
+                auto from = position - start;
+                auto length = end - position < size ? end - position : size;
+                txtCopy(destination, segments[i].text + from, length);
+
+                destination += length;
+                position += length;
+                size -= length;
+            }
+            start = end;
+        }
+        return size > 0;
+    });
+}
+
+std::shared_ptr<const txtchr> txtShare(txtchr* buffer, txtsz size)
+{
+    return std::shared_ptr<const txtchr>(buffer, [size](const txtchr* buffer)
+    {
+        txtFree(const_cast<txtchr*>(buffer), size);
+    });
+}
+
+TxtSharedSnapshot::TxtSharedSnapshot(std::shared_ptr<const txtchr> allocation, const TxtSegment* segments, int count)
+    : _allocation(std::move(allocation)), _count(0), _size(0)
+{
+    for (int i = 0; i < count && i < 2; i++)
+    {
+        if (segments[i].size == 0) continue;
+
+        _segments[_count++] = segments[i];
+        _size += segments[i].size;
+    }
+}
+
+txtsz TxtSharedSnapshot::size() const
+{
+    return _size;
+}
+
+bool TxtSharedSnapshot::segments(const TxtSegmentVisitor& visit) const
+{
+    return _count == 0 || visit(_segments, _count);
+}
+
+txtchr* txtAllocate(txtsz size)
+{
+#ifdef TXT_USE_MREMAP
+    if (isMapped(size)) return mapPages(size);
+#endif
+
+    auto buffer = (txtchr*)std::malloc(size);
+    if (buffer == nullptr) throw std::bad_alloc();
+
+    return buffer;
+}
+
+txtchr* txtReallocate(txtchr* buffer, txtsz size, txtsz newSize)
+{
+#ifdef TXT_USE_MREMAP
+    // Big blocks are mapped by us, so they can be resized by moving page
+    // table entries instead of copying the bytes
+    if (isMapped(size) && isMapped(newSize))
+    {
+        auto pages = mremap(buffer, size, newSize, MREMAP_MAYMOVE);
+        if (pages == MAP_FAILED) throw std::bad_alloc();
+
+        return (txtchr*)pages;
+    }
+
+    if (isMapped(size) || isMapped(newSize))
+    {
+        auto newBuffer = txtAllocate(newSize);
+        txtCopy(newBuffer, buffer, size < newSize ? size : newSize);
+        txtFree(buffer, size);
+
+        return newBuffer;
+    }
+#endif
+
+    auto newBuffer = (txtchr*)std::realloc(buffer, newSize);
+    if (newBuffer == nullptr) throw std::bad_alloc();
+
+    return newBuffer;
+}
+
+void txtFree(txtchr* buffer, txtsz size)
+{
+#ifdef TXT_USE_MREMAP
+    if (isMapped(size))
+    {
+        munmap(buffer, size);
+        return;
+    }
+#endif
+
+    std::free(buffer);
+}
+
+template <class Growth>
+TxtBasicArrayStorage<Growth>::TxtBasicArrayStorage()
+    : _buffer(nullptr), _bufferSize(0), _bufferAllocSize(0), _reservedSize(0)
+{
+    _bufferAllocSize = Growth::grow(0, 1);
+    _buffer = txtAllocate(_bufferAllocSize);
+    _buffer[0] = '\0';
+}
+
+template <class Growth>
+TxtBasicArrayStorage<Growth>::~TxtBasicArrayStorage()
+{
+    if (!_lent) txtFree(_buffer, _bufferAllocSize);
+}
+
+template <class Growth>
+void TxtBasicArrayStorage<Growth>::unshare()
+{
+    if (!_lent) return;
+
+    // the snapshots keep the old allocation
+    auto buffer = txtAllocate(_bufferAllocSize);
+    txtCopy(buffer, _buffer, _bufferSize + 1);
+    _buffer = buffer;
+    _lent.reset();
+}
+
+template <class Growth>
+void TxtBasicArrayStorage<Growth>::checkResize(txtsz size)
+{
+    // one extra byte for the NUL that data() hands out
+    if (_bufferAllocSize < size + 1)
+    {
+        auto newAllocSize = Growth::grow(_bufferAllocSize, size + 1);
+        _buffer = txtReallocate(_buffer, _bufferAllocSize, newAllocSize);
+        _bufferAllocSize = newAllocSize;
+    }
+}
+
+template <class Growth>
+void TxtBasicArrayStorage<Growth>::checkShrink()
+{
+    auto newAllocSize = Growth::shrink(_bufferAllocSize, _bufferSize + 1);
+    if (newAllocSize < _reservedSize) newAllocSize = _reservedSize;
+
+    if (newAllocSize < _bufferAllocSize)
+    {
+        _buffer = txtReallocate(_buffer, _bufferAllocSize, newAllocSize);
+        _bufferAllocSize = newAllocSize;
+    }
+}
+
+template <class Growth>
+void TxtBasicArrayStorage<Growth>::insert(txtcur position, const txtchr* text, txtsz size)
+{
+    unshare();
+    checkResize(_bufferSize + size);
+
+    // the terminating NUL moves along with the text after position
+    txtMove(_buffer + position + size, _buffer + position, _bufferSize - position + 1);
+
+    txtCopy(_buffer + position, text, size);
+
+    _bufferSize += size;
+}
+
+template <class Growth>
+void TxtBasicArrayStorage<Growth>::erase(txtcur position, txtsz size)
+{
+    unshare();
+    txtMove(_buffer + position, _buffer + position + size, _bufferSize - position - size);
+
+    _bufferSize -= size;
+
+    _buffer[_bufferSize] = '\0';
+
+    checkShrink();
+}
+
+template <class Growth>
+void TxtBasicArrayStorage<Growth>::apply(const TxtEdit* edits, size_t count)
+{
+    if (count == 0) return;
+
+    unshare();
+
+    // The text between two edits moves by the change in size of all the
+    // edits in front of it. While that change keeps its sign, the text
+    // moves in place, to the front from the left or to the back from the
+    // right, otherwise it is copied to a new allocation once.
+    txtsz delta = 0;
+    bool down = true, up = true;
+    for (size_t i = 0; i < count; i++)
+    {
+        delta += edits[i].textSize - edits[i].size;
+        down = down && delta <= 0;
+        up = up && delta >= 0;
+    }
+
+    auto newSize = _bufferSize + delta;
+    auto end = [&](size_t i) { return i + 1 < count ? edits[i + 1].position : _bufferSize; };
+
+    if (down)
+    {
+        txtsz shift = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            auto& edit = edits[i];
+            if (edit.textSize > 0) txtCopy(_buffer + edit.position + shift, edit.text, edit.textSize);
+            shift += edit.textSize - edit.size;
+
+            auto from = edit.position + edit.size;
+            txtMove(_buffer + from + shift, _buffer + from, end(i) - from);
+        }
+    }
+    else if (up)
+    {
+        checkResize(newSize);
+
+        auto shift = delta;
+        for (size_t i = count; i-- > 0; )
+        {
+            auto& edit = edits[i];
+            auto from = edit.position + edit.size;
+            txtMove(_buffer + from + shift, _buffer + from, end(i) - from);
+
+            shift -= edit.textSize - edit.size;
+            if (edit.textSize > 0) txtCopy(_buffer + edit.position + shift, edit.text, edit.textSize);
+        }
+    }
+    else
+    {
+        auto allocSize = _bufferAllocSize < newSize + 1 ? Growth::grow(_bufferAllocSize, newSize + 1) : _bufferAllocSize;
+        auto buffer = txtAllocate(allocSize);
+
+        txtcur from = 0;
+        txtsz to = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            auto& edit = edits[i];
+            txtCopy(buffer + to, _buffer + from, edit.position - from);
+            to += edit.position - from;
+            if (edit.textSize > 0) txtCopy(buffer + to, edit.text, edit.textSize);
+            to += edit.textSize;
+            from = edit.position + edit.size;
+        }
+        txtCopy(buffer + to, _buffer + from, _bufferSize - from);
+
+        txtFree(_buffer, _bufferAllocSize);
+        _buffer = buffer;
+        _bufferAllocSize = allocSize;
+    }
+
+    _bufferSize = newSize;
+    _buffer[_bufferSize] = '\0';
+
+    checkShrink();
+}
+
+template <class Growth>
+void TxtBasicArrayStorage<Growth>::copy(txtchr* destination, txtcur position, txtsz size) const
+{
+    txtCopy(destination, _buffer + position, size);
+}
+
+template <class Growth>
+txtchr TxtBasicArrayStorage<Growth>::at(txtcur position) const
+{
+    return _buffer[position];
+}
+
+template <class Growth>
+void TxtBasicArrayStorage<Growth>::reserve(txtsz size)
+{
+    _reservedSize = size + 1;
+
+    unshare();
+    checkResize(size);
+}
+
+template <class Growth>
+std::shared_ptr<const TxtSnapshot> TxtBasicArrayStorage<Growth>::snapshot() const
+{
+    if (!_lent) _lent = txtShare(_buffer, _bufferAllocSize);
+
+    TxtSegment segment = { _buffer, _bufferSize };
+    return std::make_shared<TxtSharedSnapshot>(_lent, &segment, 1);
+}
+
+template <class Growth>
+const txtchr* TxtBasicArrayStorage<Growth>::data() const
+{
+    return _buffer;
+}
+
+template <class Growth>
+txtsz TxtBasicArrayStorage<Growth>::size() const
+{
+    return _bufferSize;
+}
+
+template <class Growth>
+txtsz TxtBasicArrayStorage<Growth>::capacity() const
+{
+    return _bufferAllocSize;
+}
+
+template class TxtBasicArrayStorage<TxtGeometricGrowth>;
+template class TxtBasicArrayStorage<TxtBlockGrowth>;
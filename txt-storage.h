@@ -0,0 +1,368 @@
+#ifndef TXT_STORAGE_H
+#define TXT_STORAGE_H
+
+typedef long long txtsz;    // size type, used for text buffer sizes, 64 bits everywhere
+typedef long long txtcur;   // cursor type, used for positions within text buffers
+typedef char txtchr;        // char type, used as type of the text buffers
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/*
+ * --- Storage engines ---
+ * A TxtBuffer does not own the text bytes itself, it hands them to a
+ * storage engine. The engine only knows how to insert and erase bytes
+ * at a position; the undo history and the cursors live in TxtBuffer.
+ * data() must always be able to produce a contiguous, NUL terminated
+ * view of the text, even if the engine has to do work for that.
+ *
+ * The engine is picked at compile time: TxtBuffer is a template over
+ * it, so calls into the engine are resolved statically. An engine
+ * derives from TxtStorageBase<Engine>, implements the required members
+ * and hides any of the default implementations it can do better.
+ * isTxtStorage<Engine> checks the complete interface.
+ */
+
+/*
+ * A piece refers to a range in one of the immutable sources of a
+ * storage engine. Engines that support pieces can hand them out instead
+ * of copying bytes, which lets the undo history store references to
+ * removed text rather than the text itself. pieces() appends them to
+ * the vector it is given.
+ */
+
+enum class TxtPieceSources
+{
+    Original,
+    Added,
+};
+
+struct TxtPiece
+{
+    TxtPieceSources source;
+    txtsz start;
+    txtsz length;
+};
+
+/*
+ * segments() hands the text to a visitor as the runs of bytes the engine
+ * keeps it in, in batches of at most TXT_SEGMENT_BATCH, without making
+ * it contiguous. The bytes stay valid until the visitor returns. When
+ * the visitor returns false the walk stops and segments() returns false.
+ */
+
+#define TXT_SEGMENT_BATCH 64
+
+struct TxtSegment
+{
+    const txtchr* text;
+    txtsz size;
+};
+
+typedef std::function<bool(const TxtSegment* segments, int count)> TxtSegmentVisitor;
+
+/*
+ * apply() makes a batch of edits at once, each replaces size bytes at
+ * position with textSize bytes of text. The edits are sorted and do not
+ * overlap, all positions refer to the text in front of the batch. The
+ * default makes them one by one from the back; engines that would move
+ * the text behind every edit instead rebuild it in one pass.
+ */
+
+struct TxtEdit
+{
+    txtcur position;
+    txtsz size;
+    const txtchr* text;
+    txtsz textSize;
+};
+
+/*
+ * A snapshot is an immutable view of the text at one moment, which can
+ * be handed to other threads while the storage keeps being edited. It
+ * is taken in O(1): the engines share their text with the snapshot and
+ * copy what they change afterwards (copy on write). Readers need no
+ * locks, a snapshot is never written to. The default snapshot of an
+ * engine is a copy of its text.
+ */
+
+class TxtSnapshot
+{
+public:
+    virtual ~TxtSnapshot();
+
+    virtual txtsz size() const = 0;
+    virtual bool segments(const TxtSegmentVisitor& visit) const = 0;
+    virtual void copy(txtchr* destination, txtcur position, txtsz size) const;
+};
+
+class TxtCopySnapshot : public TxtSnapshot
+{
+    std::vector<txtchr> _text;
+public:
+    TxtCopySnapshot(txtsz size);
+
+    void append(const TxtSegment* segments, int count);
+
+    txtsz size() const override;
+    bool segments(const TxtSegmentVisitor& visit) const override;
+};
+
+/*
+ * Engines that keep their text in one allocation lend it to their
+ * snapshots as it is. txtShare takes over an allocation from
+ * txtAllocate, whoever lets go of it last frees it. The engine has to
+ * move to a copy of the allocation before it writes to it again.
+ */
+
+std::shared_ptr<const txtchr> txtShare(txtchr* buffer, txtsz size);
+
+class TxtSharedSnapshot : public TxtSnapshot
+{
+    std::shared_ptr<const txtchr> _allocation;
+    TxtSegment _segments[2];
+    int _count;
+    txtsz _size;
+public:
+    TxtSharedSnapshot(std::shared_ptr<const txtchr> allocation, const TxtSegment* segments, int count);
+
+    txtsz size() const override;
+    bool segments(const TxtSegmentVisitor& visit) const override;
+};
+
+template <class Storage>
+class TxtStorageBase
+{
+    const Storage& self() const { return *static_cast<const Storage*>(this); }
+    Storage& self() { return *static_cast<Storage*>(this); }
+public:
+    void load(const txtchr* text, txtsz size);
+
+    txtcur findLineStart(txtcur from) const;
+    txtcur findNextLineStart(txtcur from) const;
+
+    bool pieces(txtcur position, txtsz size, std::vector<TxtPiece>& pieces) const;
+    void insertPieces(txtcur position, const TxtPiece* pieces, size_t count);
+
+    void reserve(txtsz size);
+    void apply(const TxtEdit* edits, size_t count);
+
+    bool segments(const TxtSegmentVisitor& visit) const;
+    std::shared_ptr<const TxtSnapshot> snapshot() const;
+};
+
+template <class Storage>
+void TxtStorageBase<Storage>::load(const txtchr* text, txtsz size)
+{
+    if (self().size() > 0) self().erase(0, self().size());
+    if (size > 0) self().insert(0, text, size);
+}
+
+template <class Storage>
+txtcur TxtStorageBase<Storage>::findLineStart(txtcur from) const
+{
+    if (from < 0 || from > self().size()) return -1;
+
+    while (from > 0)
+    {
+        if (self().at(from - 1) == '\n') break;
+
+        from--;
+    }
+
+    return from;
+}
+
+template <class Storage>
+txtcur TxtStorageBase<Storage>::findNextLineStart(txtcur from) const
+{
+    auto size = self().size();
+
+    if (from < 0 || from >= size) return -1;
+
+    while (from < size)
+    {
+        if (self().at(from) == '\n') return from + 1;
+
+        from++;
+    }
+
+    return size;
+}
+
+template <class Storage>
+bool TxtStorageBase<Storage>::pieces(txtcur, txtsz, std::vector<TxtPiece>&) const
+{
+    return false;
+}
+
+template <class Storage>
+void TxtStorageBase<Storage>::insertPieces(txtcur, const TxtPiece*, size_t)
+{ }
+
+template <class Storage>
+void TxtStorageBase<Storage>::reserve(txtsz)
+{ }
+
+template <class Storage>
+void TxtStorageBase<Storage>::apply(const TxtEdit* edits, size_t count)
+{
+    // from the back, the positions in front stay where they are
+    for (auto edit = edits + count; edit != edits; )
+    {
+        --edit;
+        if (edit->size > 0) self().erase(edit->position, edit->size);
+        if (edit->textSize > 0) self().insert(edit->position, edit->text, edit->textSize);
+    }
+}
+
+template <class Storage>
+bool TxtStorageBase<Storage>::segments(const TxtSegmentVisitor& visit) const
+{
+    TxtSegment segment = { self().data(), self().size() };
+    return segment.size == 0 || visit(&segment, 1);
+}
+
+template <class Storage>
+std::shared_ptr<const TxtSnapshot> TxtStorageBase<Storage>::snapshot() const
+{
+    auto snapshot = std::make_shared<TxtCopySnapshot>(self().size());
+    self().segments([&snapshot](const TxtSegment* segments, int count)
+    {
+        snapshot->append(segments, count);
+        return true;
+    });
+    return snapshot;
+}
+
+template <class Storage, class = void>
+struct isTxtStorage : std::false_type
+{ };
+
+template <class Storage>
+struct isTxtStorage<Storage, decltype(
+        std::declval<Storage&>().load((const txtchr*)nullptr, txtsz()),
+        std::declval<Storage&>().insert(txtcur(), (const txtchr*)nullptr, txtsz()),
+        std::declval<Storage&>().erase(txtcur(), txtsz()),
+        std::declval<const Storage&>().copy((txtchr*)nullptr, txtcur(), txtsz()),
+        std::declval<Storage&>().insertPieces(txtcur(), (const TxtPiece*)nullptr, size_t()),
+        std::declval<Storage&>().reserve(txtsz()),
+        std::declval<Storage&>().apply((const TxtEdit*)nullptr, size_t()),
+        void())>
+    : std::integral_constant<bool,
+        std::is_base_of<TxtStorageBase<Storage>, Storage>::value &&
+        std::is_default_constructible<Storage>::value &&
+        std::is_same<decltype(std::declval<const Storage&>().at(txtcur())), txtchr>::value &&
+        std::is_same<decltype(std::declval<const Storage&>().data()), const txtchr*>::value &&
+        std::is_same<decltype(std::declval<const Storage&>().size()), txtsz>::value &&
+        std::is_same<decltype(std::declval<const Storage&>().findLineStart(txtcur())), txtcur>::value &&
+        std::is_same<decltype(std::declval<const Storage&>().findNextLineStart(txtcur())), txtcur>::value &&
+        std::is_same<decltype(std::declval<const Storage&>().pieces(txtcur(), txtsz(), std::declval<std::vector<TxtPiece>&>())), bool>::value &&
+        std::is_same<decltype(std::declval<const Storage&>().segments(std::declval<const TxtSegmentVisitor&>())), bool>::value &&
+        std::is_convertible<decltype(std::declval<const Storage&>().snapshot()), std::shared_ptr<const TxtSnapshot> >::value>
+{ };
+
+/*
+ * Engines that keep their own count of lines (the rope) implement
+ * lineCount, lineStart and lineOf themselves, TxtBuffer keeps a
+ * TxtLineIndex next to every other engine.
+ */
+
+template <class Storage, class = void>
+struct hasLineIndex : std::false_type
+{ };
+
+template <class Storage>
+struct hasLineIndex<Storage, decltype(
+        std::declval<const Storage&>().lineCount(),
+        std::declval<const Storage&>().lineStart(txtsz()),
+        std::declval<const Storage&>().lineOf(txtcur()),
+        void())>
+    : std::true_type
+{ };
+
+/*
+ * Engines whose snapshots share structure with the text (the rope) can
+ * switch back to one with restore(). TxtBuffer then keeps a snapshot of
+ * the text after every edit in the history, and undo and redo restore
+ * it instead of replaying the edit, in O(1) whatever the edit changed.
+ */
+
+template <class Storage, class = void>
+struct canRestore : std::false_type
+{ };
+
+template <class Storage>
+struct canRestore<Storage, decltype(
+        std::declval<Storage&>().restore(std::declval<const TxtSnapshot&>()),
+        void())>
+    : std::true_type
+{ };
+
+/*
+ * --- Growth policies ---
+ * Engines that keep their text in one allocation ask a growth policy
+ * for the capacity to use. grow() returns a capacity of at least the
+ * required size, shrink() returns the capacity to fall back to after
+ * text was removed, or the current capacity to keep it. The allocation
+ * itself goes through txtReallocate, which grows and shrinks in place
+ * when it can and never clears the new memory.
+ */
+
+struct TxtGeometricGrowth
+{
+    // Doubles the capacity, and halves it again only when less than a
+    // quarter is in use, so alternating inserts and deletes around a
+    // boundary never reallocate every time
+    static txtsz grow(txtsz capacity, txtsz required);
+    static txtsz shrink(txtsz capacity, txtsz size);
+};
+
+struct TxtBlockGrowth
+{
+    // The original policy, grows in steps of 16 bytes and never shrinks
+    static txtsz grow(txtsz capacity, txtsz required);
+    static txtsz shrink(txtsz capacity, txtsz size);
+};
+
+txtchr* txtAllocate(txtsz size);
+txtchr* txtReallocate(txtchr* buffer, txtsz size, txtsz newSize);
+void txtFree(txtchr* buffer, txtsz size);
+
+template <class Growth>
+class TxtBasicArrayStorage : public TxtStorageBase<TxtBasicArrayStorage<Growth> >
+{
+    txtchr* _buffer;
+    txtsz _bufferSize;
+    txtsz _bufferAllocSize;
+    txtsz _reservedSize;
+    mutable std::shared_ptr<const txtchr> _lent;   // set while snapshots share _buffer
+
+    void unshare();
+    void checkResize(txtsz size);
+    void checkShrink();
+public:
+    TxtBasicArrayStorage();
+    TxtBasicArrayStorage(const TxtBasicArrayStorage&) = delete;
+    ~TxtBasicArrayStorage();
+
+    void insert(txtcur position, const txtchr* text, txtsz size);
+    void erase(txtcur position, txtsz size);
+    void copy(txtchr* destination, txtcur position, txtsz size) const;
+    txtchr at(txtcur position) const;
+    void reserve(txtsz size);
+    void apply(const TxtEdit* edits, size_t count);
+    std::shared_ptr<const TxtSnapshot> snapshot() const;
+
+    const txtchr* data() const;
+    txtsz size() const;
+    txtsz capacity() const;
+};
+
+typedef TxtBasicArrayStorage<TxtGeometricGrowth> TxtArrayStorage;
+
+#endif // TXT_STORAGE_H
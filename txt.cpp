@@ -1,7 +1,11 @@
 #include "txt.h"
+#include "txt-gapbuffer.h"
+#include "txt-kernels.h"
+#include "txt-piecetable.h"
+#include "txt-rope.h"
+#include <algorithm>
 #include <iostream>
-
-#define TXT_BLOCK_SIZE 16
+#include <limits>
 
 void printString(const txtchr* txt, txtsz size)
 {
@@ -16,53 +20,13 @@ void printString(const txtchr* txt, txtsz size)
     std::cout << "|\n";
 }
 
-void copyString(txtchr* destination, const txtchr* source, txtsz size)
-{
-    size--;
-    while (size >= 0)
-    {
-        destination[size] = source[size];
-        size--;
-    }
-}
-
-txtsz textSize(const txtchr* text)
-{
-    const txtchr* tmp = text;
-    while (tmp[0] != '\0') tmp++;
-    return tmp - text;
-}
-
-void moveTextUp(txtchr* buffer, txtsz bufferSize, txtcur position, txtsz size)
-{
-    bufferSize--;
-    while (position <= bufferSize - size)
-    {
-        buffer[bufferSize] = buffer[bufferSize - size];
-        bufferSize--;
-    }
-}
-
-void moveTextDown(txtchr* buffer, txtsz size)
-{
-    do
-    {
-        buffer[0] = buffer[size];
-        buffer++;
-    }
-    while (buffer[size] != '\0');
-}
-
-EditEvent::EditEvent()
-    : position(0),
-      prev(nullptr), next(nullptr)
-{ }
-
-TxtSelection::TxtSelection(TxtBuffer* txt)
+template <class Storage>
+TxtSelection<Storage>::TxtSelection(TxtBuffer<Storage>* txt)
     : _txt(txt), cursor(0), cursorLength(0)
 { }
 
-void TxtSelection::addChar(txtchr c)
+template <class Storage>
+void TxtSelection<Storage>::addChar(txtchr c)
 {
     if (c != '\0')
     {
@@ -76,18 +40,32 @@ void TxtSelection::addChar(txtchr c)
     }
 }
 
-void TxtSelection::addText(const txtchr* text)
+template <class Storage>
+void TxtSelection<Storage>::addText(const txtchr* text)
 {
-    _txt->addText(*this, text, textSize(text));
+    addText(text, txtLength(text));
+}
+
+template <class Storage>
+void TxtSelection<Storage>::addText(std::string_view text)
+{
+    addText(text.data(), txtsz(text.size()));
+}
+
+template <class Storage>
+void TxtSelection<Storage>::addText(const txtchr* text, txtsz size)
+{
+    _txt->addText(*this, text, size);
     if (this->cursorLength < 0)
     {
         this->cursor += this->cursorLength;
     }
-    this->cursor += textSize(text);
+    this->cursor += size;
     this->cursorLength = 0;
 }
 
-void TxtSelection::moveLeft(bool shift, bool ctrl)
+template <class Storage>
+void TxtSelection<Storage>::moveLeft(bool shift, bool ctrl)
 {
     if (this->cursor >= 0 && this->cursor + this->cursorLength > 0)
     {
@@ -110,7 +88,8 @@ void TxtSelection::moveLeft(bool shift, bool ctrl)
     }
 }
 
-void TxtSelection::moveRight(bool shift, bool ctrl)
+template <class Storage>
+void TxtSelection<Storage>::moveRight(bool shift, bool ctrl)
 {
     if (this->cursor < _txt->bufferSize() && this->cursor + this->cursorLength < _txt->bufferSize())
     {
@@ -133,7 +112,8 @@ void TxtSelection::moveRight(bool shift, bool ctrl)
     }
 }
 
-void TxtSelection::moveUp(bool shift, bool ctrl)
+template <class Storage>
+void TxtSelection<Storage>::moveUp(bool shift, bool ctrl)
 {
     txtcur realCursor = cursor + cursorLength;
 
@@ -162,7 +142,8 @@ void TxtSelection::moveUp(bool shift, bool ctrl)
     }
 }
 
-void TxtSelection::moveDown(bool shift, bool ctrl)
+template <class Storage>
+void TxtSelection<Storage>::moveDown(bool shift, bool ctrl)
 {
     txtcur realCursor = cursor + cursorLength;
 
@@ -190,13 +171,15 @@ void TxtSelection::moveDown(bool shift, bool ctrl)
     }
 }
 
-void TxtSelection::selectAll()
+template <class Storage>
+void TxtSelection<Storage>::selectAll()
 {
     this->cursor = 0;
     this->cursorLength = _txt->bufferSize();
 }
 
-void TxtSelection::backspace(bool shift, bool ctrl)
+template <class Storage>
+void TxtSelection<Storage>::backspace(bool shift, bool ctrl)
 {
     if (this->cursor > 0 || this->cursorLength > 0)
     {
@@ -217,7 +200,8 @@ void TxtSelection::backspace(bool shift, bool ctrl)
     }
 }
 
-void TxtSelection::del(bool shift, bool ctrl)
+template <class Storage>
+void TxtSelection<Storage>::del(bool shift, bool ctrl)
 {
     if (this->cursor < _txt->bufferSize())
     {
@@ -237,120 +221,818 @@ void TxtSelection::del(bool shift, bool ctrl)
     }
 }
 
-void TxtSelection::home(bool shift, bool ctrl)
+template <class Storage>
+void TxtSelection<Storage>::home(bool shift, bool ctrl)
 {
     cursor = ctrl ? 0 : _txt->findLineStart(cursor);
 }
 
-void TxtSelection::end(bool shift, bool ctrl)
+template <class Storage>
+void TxtSelection<Storage>::end(bool shift, bool ctrl)
+{
+    cursor = ctrl ? _txt->bufferSize() : _txt->lineEnd(_txt->lineOf(cursor));
+}
+
+// The range a selection covers, whichever end its cursor is at
+template <class Storage>
+static txtcur selectionStart(const TxtSelection<Storage>& selection)
+{
+    return selection.cursorLength < 0 ? selection.cursor + selection.cursorLength : selection.cursor;
+}
+
+template <class Storage>
+static txtcur selectionEnd(const TxtSelection<Storage>& selection)
+{
+    return selection.cursorLength < 0 ? selection.cursor : selection.cursor + selection.cursorLength;
+}
+
+template <class Storage>
+TxtMultiSelection<Storage>::TxtMultiSelection(TxtBuffer<Storage>* txt)
+    : _txt(txt)
+{
+    _selections.push_back(TxtSelection<Storage>(txt));
+}
+
+template <class Storage>
+size_t TxtMultiSelection<Storage>::count() const
+{
+    return _selections.size();
+}
+
+template <class Storage>
+const TxtSelection<Storage>& TxtMultiSelection<Storage>::operator[](size_t index) const
+{
+    return _selections[index];
+}
+
+template <class Storage>
+size_t TxtMultiSelection<Storage>::find(txtcur position) const
+{
+    auto found = std::lower_bound(_selections.begin(), _selections.end(), position,
+        [](const TxtSelection<Storage>& selection, txtcur position) { return selectionEnd(selection) < position; });
+
+    return size_t(found - _selections.begin());
+}
+
+template <class Storage>
+void TxtMultiSelection<Storage>::normalize()
+{
+    auto before = [](const TxtSelection<Storage>& a, const TxtSelection<Storage>& b)
+    {
+        return selectionStart(a) < selectionStart(b) || (selectionStart(a) == selectionStart(b) && selectionEnd(a) < selectionEnd(b));
+    };
+    if (!std::is_sorted(_selections.begin(), _selections.end(), before)) std::sort(_selections.begin(), _selections.end(), before);
+
+    // A merged selection keeps the direction of the later one
+    size_t last = 0;
+    for (size_t i = 1; i < _selections.size(); i++)
+    {
+        auto& merged = _selections[last];
+        auto& next = _selections[i];
+        auto start = selectionStart(merged), end = selectionEnd(merged);
+
+        if (selectionStart(next) < end || (selectionStart(next) == end && (start == end || next.cursorLength == 0)))
+        {
+            if (selectionEnd(next) > end) end = selectionEnd(next);
+
+            merged.cursor = next.cursorLength < 0 ? end : start;
+            merged.cursorLength = next.cursorLength < 0 ? start - end : end - start;
+        }
+        else
+        {
+            _selections[++last] = next;
+        }
+    }
+    _selections.resize(last + 1, TxtSelection<Storage>(_txt));
+}
+
+template <class Storage>
+void TxtMultiSelection<Storage>::replace(const txtchr* text, txtsz size, txtsz before, txtsz after)
+{
+    // Every selection, or before and after an empty one, is replaced by
+    // text. Merged selections never overlap, so neither do the edits.
+    _edits.clear();
+    for (auto& selection : _selections)
+    {
+        auto start = selectionStart(selection), end = selectionEnd(selection);
+        if (start == end)
+        {
+            start = start - before < 0 ? 0 : start - before;
+            end = end + after > _txt->bufferSize() ? _txt->bufferSize() : end + after;
+        }
+        _edits.push_back({ start, end - start, text, size });
+    }
+
+    txtsz shift = 0;
+    for (size_t i = 0; i < _selections.size(); i++)
+    {
+        auto& edit = _edits[i];
+        _selections[i].cursor = edit.position + shift + edit.textSize;
+        _selections[i].cursorLength = 0;
+        shift += edit.textSize - edit.size;
+    }
+
+    // edits that change nothing are left out of the batch
+    _edits.erase(std::remove_if(_edits.begin(), _edits.end(), [](const TxtEdit& edit) { return edit.size == 0 && edit.textSize == 0; }), _edits.end());
+    if (_edits.size() == 1)
+    {
+        // a single edit is typed as usual, so it can extend a run
+        auto& edit = _edits.front();
+        if (edit.textSize > 0) _txt->addText(edit.position, edit.size, edit.text, edit.textSize);
+        else _txt->removeText(edit.position, edit.size);
+    }
+    else if (!_edits.empty())
+    {
+        _txt->applyEdits(_edits);
+    }
+
+    normalize();
+}
+
+template <class Storage>
+void TxtMultiSelection<Storage>::add(txtcur cursor, txtsz cursorLength)
+{
+    TxtSelection<Storage> selection(_txt);
+    selection.cursor = cursor;
+    selection.cursorLength = cursorLength;
+
+    _selections.push_back(selection);
+    normalize();
+}
+
+template <class Storage>
+void TxtMultiSelection<Storage>::addCursorAbove()
+{
+    auto selection = _selections.front();
+    selection.cursor += selection.cursorLength;
+    selection.cursorLength = 0;
+    selection.moveUp(false, false);
+
+    _selections.push_back(selection);
+    normalize();
+}
+
+template <class Storage>
+void TxtMultiSelection<Storage>::addCursorBelow()
+{
+    auto selection = _selections.back();
+    selection.cursor += selection.cursorLength;
+    selection.cursorLength = 0;
+    selection.moveDown(false, false);
+
+    _selections.push_back(selection);
+    normalize();
+}
+
+template <class Storage>
+void TxtMultiSelection<Storage>::collapse()
+{
+    _selections.resize(1, TxtSelection<Storage>(_txt));
+}
+
+template <class Storage>
+void TxtMultiSelection<Storage>::addChar(txtchr c)
+{
+    if (c != '\0') replace(&c, 1, 0, 0);
+}
+
+template <class Storage>
+void TxtMultiSelection<Storage>::addText(const txtchr* text)
+{
+    replace(text, txtLength(text), 0, 0);
+}
+
+template <class Storage>
+void TxtMultiSelection<Storage>::addText(const txtchr* text, txtsz size)
+{
+    replace(text, size, 0, 0);
+}
+
+template <class Storage>
+void TxtMultiSelection<Storage>::addText(std::string_view text)
+{
+    replace(text.data(), txtsz(text.size()), 0, 0);
+}
+
+template <class Storage>
+void TxtMultiSelection<Storage>::backspace(bool, bool)
+{
+    replace(nullptr, 0, 1, 0);
+}
+
+template <class Storage>
+void TxtMultiSelection<Storage>::del(bool, bool)
+{
+    replace(nullptr, 0, 0, 1);
+}
+
+template <class Storage>
+void TxtMultiSelection<Storage>::moveLeft(bool shift, bool ctrl)
+{
+    for (auto& selection : _selections) selection.moveLeft(shift, ctrl);
+    normalize();
+}
+
+template <class Storage>
+void TxtMultiSelection<Storage>::moveUp(bool shift, bool ctrl)
+{
+    for (auto& selection : _selections) selection.moveUp(shift, ctrl);
+    normalize();
+}
+
+template <class Storage>
+void TxtMultiSelection<Storage>::moveRight(bool shift, bool ctrl)
+{
+    for (auto& selection : _selections) selection.moveRight(shift, ctrl);
+    normalize();
+}
+
+template <class Storage>
+void TxtMultiSelection<Storage>::moveDown(bool shift, bool ctrl)
+{
+    for (auto& selection : _selections) selection.moveDown(shift, ctrl);
+    normalize();
+}
+
+template <class Storage>
+void TxtMultiSelection<Storage>::selectAll()
+{
+    collapse();
+    _selections.front().selectAll();
+}
+
+template <class Storage>
+void TxtMultiSelection<Storage>::home(bool shift, bool ctrl)
+{
+    for (auto& selection : _selections) selection.home(shift, ctrl);
+    normalize();
+}
+
+template <class Storage>
+void TxtMultiSelection<Storage>::end(bool shift, bool ctrl)
+{
+    for (auto& selection : _selections) selection.end(shift, ctrl);
+    normalize();
+}
+
+template <class Storage>
+TxtBlockSelection<Storage>::TxtBlockSelection(TxtBuffer<Storage>* txt)
+    : _txt(txt), firstLine(0), lastLine(0), leftColumn(0), rightColumn(0)
+{ }
+
+template <class Storage>
+void TxtBlockSelection<Storage>::select(txtcur anchor, txtcur caret)
+{
+    auto anchorLine = _txt->lineOf(anchor), caretLine = _txt->lineOf(caret);
+    auto anchorColumn = anchor - _txt->lineStart(anchorLine), caretColumn = caret - _txt->lineStart(caretLine);
+
+    firstLine = std::min(anchorLine, caretLine);
+    lastLine = std::max(anchorLine, caretLine);
+    leftColumn = std::min(anchorColumn, caretColumn);
+    rightColumn = std::max(anchorColumn, caretColumn);
+}
+
+template <class Storage>
+void TxtBlockSelection<Storage>::replace(const txtchr* text, txtsz size, txtsz before, txtsz after)
+{
+    // The block, or before and after an empty one, is replaced by text
+    // on every line
+    bool empty = leftColumn == rightColumn;
+
+    _edits.clear();
+    for (auto line = firstLine; line <= lastLine && line < _txt->lineCount(); line++)
+    {
+        auto start = _txt->lineStart(line), end = _txt->lineEnd(line);
+        auto from = leftColumn < end - start ? start + leftColumn : end;
+        auto to = rightColumn < end - start ? start + rightColumn : end;
+        if (empty)
+        {
+            from = from - before < start ? start : from - before;
+            to = to + after > end ? end : to + after;
+        }
+
+        if (to > from || size > 0) _edits.push_back({ from, to - from, text, size });
+    }
+    if (!_edits.empty()) _txt->applyEdits(_edits);
+
+    leftColumn = (empty && leftColumn >= before ? leftColumn - before : leftColumn) + size;
+    rightColumn = leftColumn;
+}
+
+template <class Storage>
+void TxtBlockSelection<Storage>::addChar(txtchr c)
+{
+    if (c != '\0') replace(&c, 1, 0, 0);
+}
+
+template <class Storage>
+void TxtBlockSelection<Storage>::addText(const txtchr* text, txtsz size)
+{
+    replace(text, size, 0, 0);
+}
+
+template <class Storage>
+void TxtBlockSelection<Storage>::addText(std::string_view text)
+{
+    replace(text.data(), txtsz(text.size()), 0, 0);
+}
+
+template <class Storage>
+void TxtBlockSelection<Storage>::backspace(bool, bool)
+{
+    replace(nullptr, 0, 1, 0);
+}
+
+template <class Storage>
+void TxtBlockSelection<Storage>::del(bool, bool)
+{
+    replace(nullptr, 0, 0, 1);
+}
+
+template <class Storage>
+TxtTransaction<Storage>::TxtTransaction(TxtBuffer<Storage>* txt)
+    : _txt(txt)
+{
+    _txt->beginTransaction();
+}
+
+template <class Storage>
+TxtTransaction<Storage>::~TxtTransaction()
+{
+    if (_txt != nullptr) _txt->rollback();
+}
+
+template <class Storage>
+void TxtTransaction<Storage>::commit()
+{
+    if (_txt != nullptr) _txt->commit();
+    _txt = nullptr;
+}
+
+template <class Storage>
+TxtBuffer<Storage>::TxtBuffer()
+    : _linesValid(true), _lastVersion(0), _savedVersion(0),
+      _runOpen(false), _runLast('\0'), _runPause(TXT_RUN_PAUSE),
+      _transactions(0), _transactionStart(0)
+{
+    if constexpr (canRestore<Storage>::value) _history.setSnapshot(_storage.snapshot());
+}
+
+template <class Storage>
+TxtBuffer<Storage>::~TxtBuffer()
+{ }
+
+template <class Storage>
+void TxtBuffer<Storage>::clearEvents()
+{
+    // a loaded text starts a new history, clean
+    _history.clear(++_lastVersion);
+    _savedVersion = _lastVersion;
+    _anchors.clear();
+    _decorations.clear();
+    breakRun();
+    if constexpr (canRestore<Storage>::value) _history.setSnapshot(_storage.snapshot());
+}
+
+template <class Storage>
+void TxtBuffer<Storage>::load(const txtchr* text, txtsz size)
+{
+    _storage.load(text, size);
+    if constexpr (!hasLineIndex<Storage>::value) _lines.load(text, size);
+    _linesValid = true;
+
+    clearEvents();
+}
+
+template <class Storage>
+bool TxtBuffer<Storage>::open(const char* path, TxtAccessPatterns pattern)
+{
+    TxtFileMapping mapping;
+    if (!mapping.open(path)) return false;
+
+    mapping.advise(pattern);
+
+    if constexpr (canLoadMapping<Storage>::value) _storage.load(std::move(mapping));
+    else _storage.load(mapping.data(), mapping.size());
+    clearEvents();
+
+    // Indexing the lines reads the whole file, that waits until a line is
+    // asked for or the text is edited
+    _linesValid = false;
+
+    return true;
+}
+
+template <class Storage>
+bool TxtBuffer<Storage>::openPaged(const char* path, txtsz budget)
+{
+    if constexpr (canLoadPaged<Storage>::value)
+    {
+        TxtPagedFile paged;
+        if (!paged.open(path, budget)) return false;
+
+        _storage.load(std::move(paged));
+        _linesValid = false;
+        clearEvents();
+
+        return true;
+    }
+    else
+    {
+        return open(path);
+    }
+}
+
+template <class Storage>
+bool TxtBuffer<Storage>::save(const char* path)
+{
+    TxtFileWriter writer;
+    if (!writer.open(path)) return false;
+
+    auto written = _storage.segments([&writer](const TxtSegment* segments, int count)
+    {
+        return writer.write(segments, count);
+    });
+
+    if (!written || !writer.commit()) return false;
+
+    markSaved(version());
+    return true;
+}
+
+template <class Storage>
+unsigned long TxtBuffer<Storage>::version() const
+{
+    return _history.current().version;
+}
+
+template <class Storage>
+txtcur TxtBuffer<Storage>::mapPosition(txtcur position, unsigned long from, unsigned long to) const
+{
+    return _history.map(position, from, to);
+}
+
+template <class Storage>
+bool TxtBuffer<Storage>::dirty() const
+{
+    return _history.current().version != _savedVersion;
+}
+
+template <class Storage>
+void TxtBuffer<Storage>::markSaved(unsigned long version)
+{
+    // the saved version must stay reachable by undo
+    _savedVersion = version;
+    breakRun();
+}
+
+template <class Storage>
+std::shared_ptr<const TxtSnapshot> TxtBuffer<Storage>::snapshot() const
+{
+    return _storage.snapshot();
+}
+
+template <class Storage>
+std::unique_ptr<TxtBackgroundSave> TxtBuffer<Storage>::saveInBackground(const char* path) const
+{
+    return std::unique_ptr<TxtBackgroundSave>(new TxtBackgroundSave(snapshot(), version(), path));
+}
+
+template <class Storage>
+const TxtLineIndex& TxtBuffer<Storage>::lines() const
 {
-    cursor = ctrl ? _txt->bufferSize() : _txt->findNextLineStart(cursor);
+    if (_linesValid) return _lines;
+
+    bool blocks = false;
+    if constexpr (canLoadPaged<Storage>::value) blocks = _storage.paged();
+
+    if (!blocks)
+    {
+        _lines.load(_storage.data(), _storage.size());
+    }
+    else
+    {
+        // A paged text is never made contiguous, it is read page by page
+        std::vector<txtsz> lengths;
+        std::vector<txtchr> block(TXT_PAGE_SIZE);
+        txtcur lineStart = 0;
+
+        for (txtcur position = 0; position < _storage.size(); position += TXT_PAGE_SIZE)
+        {
+            auto count = _storage.size() - position < TXT_PAGE_SIZE ? _storage.size() - position : TXT_PAGE_SIZE;
+            _storage.copy(block.data(), position, count);
 
-    if (cursor > 0 && _txt->buffer()[cursor-1] == '\n') cursor--;
+            auto first = lengths.size();
+            auto end = TxtLineIndex::scan(block.data(), count, lengths);
+            if (lengths.size() > first)
+            {
+                lengths[first] += position - lineStart;
+                lineStart = position + end;
+            }
+        }
+
+        lengths.push_back(_storage.size() - lineStart);
+        _lines.load(lengths);
+    }
+
+    _linesValid = true;
+    return _lines;
 }
 
-TxtBuffer::TxtBuffer()
-    : _buffer(nullptr), _bufferSize(0),
-      _bufferAllocSize(0), _currentEvent(nullptr),
-      _undoEventCount(0), _redoEventCount(0)
+template <class Storage>
+void TxtBuffer<Storage>::load(std::string_view text)
 {
-    _bufferAllocSize = TXT_BLOCK_SIZE;
-    _buffer = new txtchr[_bufferAllocSize] { 0 };
+    load(text.data(), txtsz(text.size()));
+}
 
-    _firstEvent.buffer.clear();
-    _firstEvent.next = nullptr;
-    _firstEvent.position = 0;
-    _firstEvent.prev = nullptr;
-    _firstEvent.type = EditEventTypes::Insertion;
+template <class Storage>
+void TxtBuffer<Storage>::reserve(txtsz size)
+{
+    _storage.reserve(size);
+}
 
-    _currentEvent = &_firstEvent;
+template <class Storage>
+EditEvent& TxtBuffer<Storage>::addEvent(EditEventTypes type, txtcur position, txtsz size)
+{
+    return _history.add(type, position, size, ++_lastVersion);
 }
 
-void TxtBuffer::addEvent(EditEvent* event)
+template <class Storage>
+void TxtBuffer<Storage>::recordText(EditEvent& event, txtcur position, const txtchr* text, txtsz size)
 {
-    auto remove = _currentEvent->next;
-    while (remove != nullptr)
+    // A storage that restores versions needs no copy of the text, one
+    // that hands out pieces only references it
+    if constexpr (canRestore<Storage>::value) return;
+
+    auto& log = _history.pieceLog();
+    if (_storage.pieces(position, size, log))
+    {
+        event.pieceCount = log.size() - event.pieces;
+    }
+    else if (text != nullptr)
+    {
+        txtCopy(_history.addText(size), text, size);
+    }
+    else
     {
-        auto tmp = remove->next;
-        delete remove;
-        remove = tmp;
+        _storage.copy(_history.addText(size), position, size);
     }
-    _redoEventCount = 0;
+}
 
-    event->prev = _currentEvent;
-    _currentEvent->next = event;
-    _currentEvent = event;
-    _undoEventCount++;
+static bool isBlank(txtchr c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
 }
 
-void TxtBuffer::insertText(txtcur position, const txtchr* text, txtsz size)
+template <class Storage>
+bool TxtBuffer<Storage>::extendRun(EditEventTypes type, txtcur position, txtchr c)
 {
-    checkResize(_bufferSize + size);
+    if (!_runOpen || std::chrono::steady_clock::now() - _runTime > _runPause) return false;
+
+    const auto& event = _history.current();
+    if (event.type != type) return false;
 
-    moveTextUp(_buffer, _bufferAllocSize, position, size);
+    // A word and the blanks after it make one run, a backspace run meets
+    // them the other way around
+    bool front = false;
+    if (type == EditEventTypes::Insertion)
+    {
+        if (position != event.position + event.size) return false;
+        if (isBlank(_runLast) && !isBlank(c)) return false;
+    }
+    else if (position + 1 == event.position)
+    {
+        if (!isBlank(_runLast) && isBlank(c)) return false;
+        front = true;
+    }
+    else if (position == event.position)
+    {
+        if (isBlank(_runLast) && !isBlank(c)) return false;
+    }
+    else
+    {
+        return false;
+    }
 
-    copyString(_buffer + position, text, size);
+    if constexpr (!canRestore<Storage>::value)
+    {
+        if (event.pieceCount > 0)
+        {
+            _runPieces.clear();
+            _storage.pieces(position, 1, _runPieces);
+            _history.extendPieces(_runPieces.data(), _runPieces.size(), front);
+        }
+        else
+        {
+            *_history.extendText(1, front) = c;
+        }
+    }
+    _history.extend(1, front, ++_lastVersion);
 
-    _bufferSize += size;
+    return true;
 }
 
-void TxtBuffer::deleteText(txtcur position, txtsz size)
+template <class Storage>
+void TxtBuffer<Storage>::openRun(txtsz size, txtchr c)
 {
-    moveTextDown(_buffer + position, size);
+    // only single characters make runs, a paste is an edit of its own
+    _runOpen = size == 1;
+    _runLast = c;
+    if (_runOpen) _runTime = std::chrono::steady_clock::now();
+}
 
-    _bufferSize -= size;
+template <class Storage>
+void TxtBuffer<Storage>::breakRun()
+{
+    _runOpen = false;
+}
 
-    _buffer[_bufferSize] = '\0';
+template <class Storage>
+void TxtBuffer<Storage>::setRunPause(long milliseconds)
+{
+    _runPause = std::chrono::milliseconds(milliseconds);
 }
 
-void TxtBuffer::checkResize(txtsz size)
+template <class Storage>
+void TxtBuffer<Storage>::beginTransaction()
 {
-    if (_bufferAllocSize < size)
+    if (_transactions++ > 0) return;
+
+    breakRun();
+    _history.beginGroup();
+    _transactionStart = _history.undoCount();
+}
+
+template <class Storage>
+void TxtBuffer<Storage>::commit()
+{
+    if (--_transactions > 0) return;
+
+    _history.endGroup();
+    breakRun();
+}
+
+template <class Storage>
+void TxtBuffer<Storage>::rollback()
+{
+    if (--_transactions > 0) return;
+
+    _history.endGroup();
+    if (_history.undoCount() > _transactionStart)
+    {
+        undo();
+        _history.truncate();
+    }
+    breakRun();
+}
+
+template <class Storage>
+void TxtBuffer<Storage>::insertText(txtcur position, const txtchr* text, txtsz size)
+{
+    if constexpr (!hasLineIndex<Storage>::value)
+    {
+        lines();
+        _lines.insert(position, text, size);
+    }
+
+    insertMarks(position, size);
+    _storage.insert(position, text, size);
+}
+
+template <class Storage>
+void TxtBuffer<Storage>::deleteText(txtcur position, txtsz size)
+{
+    if constexpr (!hasLineIndex<Storage>::value)
+    {
+        lines();
+        _lines.erase(position, size);
+    }
+
+    eraseMarks(position, size);
+    _storage.erase(position, size);
+}
+
+template <class Storage>
+void TxtBuffer<Storage>::restoreText(const EditEvent& event)
+{
+    if (event.pieceCount == 0)
+    {
+        insertText(event.position, _history.text(event), event.size);
+    }
+    else
     {
-        while (_bufferAllocSize < size)
+        if constexpr (!hasLineIndex<Storage>::value) lines();
+        insertMarks(event.position, event.size);
+        _storage.insertPieces(event.position, _history.pieces(event), event.pieceCount);
+
+        // The pieces carry no bytes, read the restored text back for the
+        // line index in blocks
+        if constexpr (!hasLineIndex<Storage>::value)
         {
-            _bufferAllocSize += TXT_BLOCK_SIZE;
+            txtchr block[4096];
+            for (txtsz done = 0; done < event.size; done += sizeof(block))
+            {
+                auto count = event.size - done < txtsz(sizeof(block)) ? event.size - done : txtsz(sizeof(block));
+                _storage.copy(block, event.position + done, count);
+                _lines.insert(event.position + done, block, count);
+            }
         }
-        auto newBuffer = new txtchr[_bufferAllocSize] { 0 };
-        copyString(newBuffer, _buffer, _bufferSize);
-        delete []_buffer;
-        _buffer = newBuffer;
     }
 }
 
-void TxtBuffer::addText(const TxtSelection& selection, const txtchr* text, txtsz size)
+template <class Storage>
+void TxtBuffer<Storage>::insertMarks(txtcur position, txtsz size)
+{
+    _anchors.insert(position, size);
+    _decorations.insert(position, size);
+}
+
+template <class Storage>
+void TxtBuffer<Storage>::eraseMarks(txtcur position, txtsz size)
+{
+    _anchors.erase(position, size);
+    _decorations.erase(position, size);
+}
+
+template <class Storage>
+void TxtBuffer<Storage>::moveMarks(const EditEvent* events, size_t count, bool undo)
+{
+    // A restored version was not made by edits, the anchors and
+    // decorations follow the events instead
+    for (size_t i = 0; i < count; i++)
+    {
+        auto& event = undo ? events[count - 1 - i] : events[i];
+        if ((event.type == EditEventTypes::Insertion) == undo) eraseMarks(event.position, event.size);
+        else insertMarks(event.position, event.size);
+    }
+}
+
+template <class Storage>
+void TxtBuffer<Storage>::restoreVersion()
+{
+    if constexpr (canRestore<Storage>::value)
+    {
+        _storage.restore(*_history.snapshot());
+
+        // the restored text was never passed to the line index
+        if constexpr (!hasLineIndex<Storage>::value) _linesValid = false;
+    }
+}
+
+template <class Storage>
+void TxtBuffer<Storage>::addText(const TxtSelection<Storage>& selection, const txtchr* text, txtsz size)
 {
     addText(selection.cursor, selection.cursorLength, text, size);
 }
 
-void TxtBuffer::addText(txtcur position, txtsz selectionLength, const txtchr* text, txtsz size)
+template <class Storage>
+void TxtBuffer<Storage>::addText(const TxtSelection<Storage>& selection, std::string_view text)
+{
+    addText(selection.cursor, selection.cursorLength, text.data(), txtsz(text.size()));
+}
+
+template <class Storage>
+void TxtBuffer<Storage>::addText(txtcur position, txtsz selectionLength, std::string_view text)
+{
+    addText(position, selectionLength, text.data(), txtsz(text.size()));
+}
+
+template <class Storage>
+void TxtBuffer<Storage>::addText(txtcur position, txtsz selectionLength, const txtchr* text, txtsz size)
 {
     if (selectionLength != 0)
     {
+        // replacing the selection is one step
+        TxtTransaction<Storage> transaction(this);
         removeText(position, selectionLength);
         if (selectionLength < 0)
         {
             position += selectionLength;
         }
+        addText(position, 0, text, size);
+        transaction.commit();
+        return;
     }
 
-    auto insertionEvent = new EditEvent();
-    insertionEvent->buffer.assign(text, text + size);
-    insertionEvent->next = nullptr;
-    insertionEvent->position = position;
-    insertionEvent->type = EditEventTypes::Insertion;
-
     insertText(position, text, size);
 
-    addEvent(insertionEvent);
+    if (size != 1 || !extendRun(EditEventTypes::Insertion, position, *text))
+    {
+        auto& event = addEvent(EditEventTypes::Insertion, position, size);
+        recordText(event, position, text, size);
+    }
+    openRun(size, size == 1 ? *text : '\0');
+    if constexpr (canRestore<Storage>::value) _history.setSnapshot(_storage.snapshot());
 }
 
-void TxtBuffer::removeText(const TxtSelection& selection)
+template <class Storage>
+void TxtBuffer<Storage>::removeText(const TxtSelection<Storage>& selection)
 {
     removeText(selection.cursor, selection.cursorLength);
 }
 
-void TxtBuffer::removeText(txtcur position, txtsz size)
+template <class Storage>
+void TxtBuffer<Storage>::removeText(txtcur position, txtsz size)
 {
     if (size < 0)
     {
@@ -358,111 +1040,378 @@ void TxtBuffer::removeText(txtcur position, txtsz size)
         size = -size;
     }
 
-    auto deletionEvent = new EditEvent();
-    deletionEvent->buffer.assign(_buffer + position, _buffer + position + size);
-    deletionEvent->next = nullptr;
-    deletionEvent->position = position;
-    deletionEvent->type = EditEventTypes::Deletion;
+    auto c = size == 1 ? _storage.at(position) : '\0';
+    if (size != 1 || !extendRun(EditEventTypes::Deletion, position, c))
+    {
+        auto& event = addEvent(EditEventTypes::Deletion, position, size);
+        recordText(event, position, nullptr, size);
+    }
+    openRun(size, c);
 
     deleteText(position, size);
+    if constexpr (canRestore<Storage>::value) _history.setSnapshot(_storage.snapshot());
+}
 
-    addEvent(deletionEvent);
+template <class Storage>
+void TxtBuffer<Storage>::revert(const EditEvent& event)
+{
+    if (event.type == EditEventTypes::Insertion)
+    {
+        deleteText(event.position, event.size);
+    }
+    else if (event.type == EditEventTypes::Deletion)
+    {
+        restoreText(event);
+    }
 }
 
-bool TxtBuffer::undo()
+template <class Storage>
+void TxtBuffer<Storage>::replay(const EditEvent& event)
 {
-    if (_currentEvent == &_firstEvent)
+    if (event.type == EditEventTypes::Insertion)
     {
-        return false;
+        restoreText(event);
+    }
+    else if (event.type == EditEventTypes::Deletion)
+    {
+        deleteText(event.position, event.size);
     }
+}
 
-    if (_currentEvent ->type == EditEventTypes::Insertion)
+template <class Storage>
+void TxtBuffer<Storage>::applyBatch(const TxtEdit* edits, size_t count)
+{
+    if constexpr (!hasLineIndex<Storage>::value)
     {
-        deleteText(_currentEvent->position, _currentEvent->buffer.size());
+        lines();
+        for (auto edit = edits + count; edit != edits; )
+        {
+            --edit;
+            if (edit->size > 0) _lines.erase(edit->position, edit->size);
+            if (edit->textSize > 0) _lines.insert(edit->position, edit->text, edit->textSize);
+        }
     }
-    else if (_currentEvent->type == EditEventTypes::Deletion)
+
+    for (auto edit = edits + count; edit != edits; )
     {
-        insertText(_currentEvent->position, _currentEvent->buffer.data(), _currentEvent->buffer.size());
+        --edit;
+        eraseMarks(edit->position, edit->size);
+        insertMarks(edit->position, edit->textSize);
     }
 
-    _currentEvent = _currentEvent->prev;
-    _undoEventCount--;
-    _redoEventCount++;
+    _storage.apply(edits, count);
+}
+
+template <class Storage>
+bool TxtBuffer<Storage>::applyEdits(const std::vector<TxtEdit>& edits)
+{
+    return applyEdits(edits.data(), edits.size());
+}
+
+template <class Storage>
+bool TxtBuffer<Storage>::applyEdits(const TxtEdit* edits, size_t count)
+{
+    txtcur end = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        auto& edit = edits[i];
+        if (edit.position < end || edit.size < 0 || edit.textSize < 0 || edit.position + edit.size > bufferSize()) return false;
+
+        end = edit.position + edit.size;
+    }
+    if (count == 0) return true;
+
+    // The events are recorded from the back as if the edits were made one
+    // by one, so every position refers to the text in front of the batch.
+    // Their text goes to the byte log even where the storage hands out
+    // pieces, undo and redo then make the step in one pass again.
+    TxtTransaction<Storage> transaction(this);
+    for (auto edit = edits + count; edit != edits; )
+    {
+        --edit;
+        if (edit->size > 0)
+        {
+            addEvent(EditEventTypes::Deletion, edit->position, edit->size);
+            if constexpr (!canRestore<Storage>::value) _storage.copy(_history.addText(edit->size), edit->position, edit->size);
+        }
+        if (edit->textSize > 0)
+        {
+            addEvent(EditEventTypes::Insertion, edit->position, edit->textSize);
+            if constexpr (!canRestore<Storage>::value) txtCopy(_history.addText(edit->textSize), edit->text, edit->textSize);
+        }
+    }
+
+    applyBatch(edits, count);
+    if constexpr (canRestore<Storage>::value) _history.setSnapshot(_storage.snapshot());
+    transaction.commit();
 
     return true;
 }
 
-int TxtBuffer::undoCount()
+template <class Storage>
+bool TxtBuffer<Storage>::batchStep(const EditEvent* events, size_t count, bool undo)
 {
-    return _undoEventCount;
+    // A step whose events were made from the back, each one in front of
+    // the ones before it, is a sorted batch: a deletion and an insertion
+    // at the same position make one replacement. Only text in the byte
+    // log can be handed to the batch.
+    _batch.clear();
+    _batchRemoved.clear();
+
+    auto limit = std::numeric_limits<txtcur>::max();
+    for (size_t i = 0; i < count; i++)
+    {
+        TxtEdit edit = { events[i].position, 0, nullptr, 0 };
+        const txtchr* removed = nullptr;
+
+        if (events[i].type == EditEventTypes::Deletion)
+        {
+            if (events[i].pieceCount > 0) return false;
+
+            edit.size = events[i].size;
+            removed = _history.text(events[i]);
+            if (i + 1 < count && events[i + 1].type == EditEventTypes::Insertion && events[i + 1].position == edit.position) i++;
+        }
+        if (events[i].type == EditEventTypes::Insertion)
+        {
+            if (events[i].pieceCount > 0) return false;
+
+            edit.text = _history.text(events[i]);
+            edit.textSize = events[i].size;
+        }
+
+        if (edit.position + edit.size > limit) return false;
+        limit = edit.position;
+
+        _batch.push_back(edit);
+        _batchRemoved.push_back(removed);
+    }
+
+    std::reverse(_batch.begin(), _batch.end());
+    std::reverse(_batchRemoved.begin(), _batchRemoved.end());
+
+    if (undo)
+    {
+        // the inverse edits, at their positions in the text after the step
+        txtsz shift = 0;
+        for (size_t i = 0; i < _batch.size(); i++)
+        {
+            auto edit = _batch[i];
+            _batch[i] = { edit.position + shift, edit.textSize, _batchRemoved[i], edit.size };
+            shift += edit.textSize - edit.size;
+        }
+    }
+
+    applyBatch(_batch.data(), _batch.size());
+    return true;
 }
 
-bool TxtBuffer::redo()
+template <class Storage>
+bool TxtBuffer<Storage>::undo()
 {
-    if (_currentEvent->next == nullptr)
+    breakRun();
+
+    size_t count = 0;
+    auto events = _history.undo(count);
+    if (events == nullptr)
     {
         return false;
     }
 
-    _currentEvent = _currentEvent->next;
-    _undoEventCount++;
-    _redoEventCount--;
+    if constexpr (canRestore<Storage>::value)
+    {
+        restoreVersion();
+        moveMarks(events, count, true);
+    }
+    else if (count < 2 || !batchStep(events, count, true))
+    {
+        for (auto event = events + count; event != events; )
+        {
+            revert(*--event);
+        }
+    }
+
+    return true;
+}
+
+template <class Storage>
+int TxtBuffer<Storage>::undoCount()
+{
+    return _history.undoCount();
+}
+
+template <class Storage>
+bool TxtBuffer<Storage>::redo()
+{
+    breakRun();
+
+    size_t count = 0;
+    auto events = _history.redo(count);
+    if (events == nullptr)
+    {
+        return false;
+    }
 
-    if (_currentEvent ->type == EditEventTypes::Insertion)
+    if constexpr (canRestore<Storage>::value)
     {
-        insertText(_currentEvent->position, _currentEvent->buffer.data(), _currentEvent->buffer.size());
+        restoreVersion();
+        moveMarks(events, count, false);
     }
-    else if (_currentEvent->type == EditEventTypes::Deletion)
+    else if (count < 2 || !batchStep(events, count, false))
     {
-        deleteText(_currentEvent->position, _currentEvent->buffer.size());
+        for (auto event = events; event != events + count; event++)
+        {
+            replay(*event);
+        }
     }
 
     return true;
 }
 
-int TxtBuffer::redoCount()
+template <class Storage>
+int TxtBuffer<Storage>::redoCount()
 {
-    return _redoEventCount;
+    return _history.redoCount();
 }
 
-const txtchr* TxtBuffer::buffer() const
+template <class Storage>
+const txtchr* TxtBuffer<Storage>::buffer() const
 {
-    return this->_buffer;
+    return _storage.data();
 }
 
-const txtsz TxtBuffer::bufferSize() const
+template <class Storage>
+const txtsz TxtBuffer<Storage>::bufferSize() const
 {
-    return this->_bufferSize;
+    return _storage.size();
 }
 
-txtcur TxtBuffer::findLineStart(txtcur from) const
+template <class Storage>
+txtchr TxtBuffer<Storage>::at(txtcur position) const
 {
-    if (from < 0 || from > _bufferSize) return -1;
+    return _storage.at(position);
+}
 
-    auto buffer = this->buffer();
+template <class Storage>
+void TxtBuffer<Storage>::copy(txtchr* destination, txtcur position, txtsz size) const
+{
+    _storage.copy(destination, position, size);
+}
 
-    while (from > 0)
-    {
-        if (buffer[from - 1] == '\n') break;
+template <class Storage>
+txtcur TxtBuffer<Storage>::findLineStart(txtcur from) const
+{
+    if (from < 0 || from > bufferSize()) return -1;
 
-        from--;
-    }
+    return lineStart(lineOf(from));
+}
+
+template <class Storage>
+txtcur TxtBuffer<Storage>::findNextLineStart(txtcur from) const
+{
+    if (from < 0 || from >= bufferSize()) return -1;
 
-    return from;
+    auto line = lineOf(from) + 1;
+    if (line >= lineCount()) return bufferSize();
+
+    return lineStart(line);
 }
 
-txtcur TxtBuffer::findNextLineStart(txtcur from) const
+template <class Storage>
+txtsz TxtBuffer<Storage>::lineCount() const
 {
-    if (from < 0 || from >= _bufferSize) return -1;
+    if constexpr (hasLineIndex<Storage>::value) return _storage.lineCount();
+    else return lines().lineCount();
+}
 
-    auto buffer = this->buffer();
+template <class Storage>
+txtcur TxtBuffer<Storage>::lineStart(txtsz line) const
+{
+    if constexpr (hasLineIndex<Storage>::value) return _storage.lineStart(line);
+    else return lines().lineStart(line);
+}
 
-    while (from < this->bufferSize())
-    {
-        if (buffer[from] == '\n') return from + 1;
+template <class Storage>
+txtcur TxtBuffer<Storage>::lineEnd(txtsz line) const
+{
+    if (line < 0 || line >= lineCount()) return -1;
+    if (line == lineCount() - 1) return bufferSize();
 
-        from++;
-    }
+    // a CR only belongs to the line ending when a newline follows it
+    auto end = lineStart(line + 1) - 1;
+    if (end > lineStart(line) && _storage.at(end - 1) == '\r') end--;
+
+    return end;
+}
+
+template <class Storage>
+txtcur TxtBuffer<Storage>::columnOffset(txtsz line, txtsz column) const
+{
+    auto start = lineStart(line);
+    if (start < 0) return -1;
+
+    auto end = lineEnd(line);
+    return column < end - start ? start + column : end;
+}
 
-    return this->bufferSize();
+template <class Storage>
+txtsz TxtBuffer<Storage>::lineOf(txtcur position) const
+{
+    if constexpr (hasLineIndex<Storage>::value) return _storage.lineOf(position);
+    else return lines().lineOf(position);
+}
+
+template <class Storage>
+TxtAnchors& TxtBuffer<Storage>::anchors()
+{
+    return _anchors;
 }
+
+template <class Storage>
+const TxtAnchors& TxtBuffer<Storage>::anchors() const
+{
+    return _anchors;
+}
+
+template <class Storage>
+TxtDecorations& TxtBuffer<Storage>::decorations()
+{
+    return _decorations;
+}
+
+template <class Storage>
+const TxtDecorations& TxtBuffer<Storage>::decorations() const
+{
+    return _decorations;
+}
+
+template <class Storage>
+const Storage& TxtBuffer<Storage>::storage() const
+{
+    return _storage;
+}
+
+template class TxtSelection<TxtArrayStorage>;
+template class TxtSelection<TxtGapStorage>;
+template class TxtSelection<TxtPieceStorage>;
+template class TxtSelection<TxtRopeStorage>;
+
+template class TxtMultiSelection<TxtArrayStorage>;
+template class TxtMultiSelection<TxtGapStorage>;
+template class TxtMultiSelection<TxtPieceStorage>;
+template class TxtMultiSelection<TxtRopeStorage>;
+
+template class TxtBlockSelection<TxtArrayStorage>;
+template class TxtBlockSelection<TxtGapStorage>;
+template class TxtBlockSelection<TxtPieceStorage>;
+template class TxtBlockSelection<TxtRopeStorage>;
+
+template class TxtTransaction<TxtArrayStorage>;
+template class TxtTransaction<TxtGapStorage>;
+template class TxtTransaction<TxtPieceStorage>;
+template class TxtTransaction<TxtRopeStorage>;
+
+template class TxtBuffer<TxtArrayStorage>;
+template class TxtBuffer<TxtGapStorage>;
+template class TxtBuffer<TxtPieceStorage>;
+template class TxtBuffer<TxtRopeStorage>;
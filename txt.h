@@ -1,52 +1,79 @@
 #ifndef TXT_H
 #define TXT_H
 
+#include "txt-anchors.h"
+#include "txt-decorations.h"
+#include "txt-file.h"
+#include "txt-history.h"
+#include "txt-lineindex.h"
+#include "txt-storage.h"
+#include <chrono>
+#include <memory>
+#include <string_view>
 #include <vector>
 
-typedef long txtsz;     // size type, used for text buffer sizes
-typedef long txtcur;    // cursor type, used for positions within text buffers
-typedef char txtchr;    // char type, used as type of the text buffers
+template <class Storage>
+class TxtBuffer;
 
-/*
- * --- Idea for editor data system ---
- * Every change is recorded in a doubly linked list, Such a record can
- * only be of type insertion or deletion. One method can generates the
- * full text for every recorded event. By saving the resulting buffer
- * size after such an event in the record, it is cheap to determine the
- * buffer size.
- */
-
-enum class EditEventTypes
-{
-    Deletion,
-    Insertion,
-};
-
-class EditEvent
+template <class Storage>
+class TxtSelection
 {
+    TxtBuffer<Storage>* _txt;
 public:
-    EditEvent();
+    TxtSelection(TxtBuffer<Storage>* txt);
 
-    EditEventTypes type;            // 0 means deletion, 1 means insertion
-    txtcur position;                // the position in the main buffer to add or delete
-    std::vector<txtchr> buffer;     // the added or removed text in this event
+    txtcur cursor;
+    txtcur cursorLength;
 
-    // double linked list
-    EditEvent* prev;
-    EditEvent* next;
+    void addChar(txtchr c);
+    void addText(const txtchr* text);
+    void addText(const txtchr* text, txtsz size);
+    void addText(std::string_view text);
+    void moveLeft(bool shift, bool ctrl);
+    void moveUp(bool shift, bool ctrl);
+    void moveRight(bool shift, bool ctrl);
+    void moveDown(bool shift, bool ctrl);
+    void selectAll();
+    void backspace(bool shift, bool ctrl);
+    void del(bool shift, bool ctrl);
+    void home(bool shift, bool ctrl);
+    void end(bool shift, bool ctrl);
 };
 
-class TxtSelection
+/*
+ * A set of selections that are edited together, one cursor each. They
+ * are kept sorted and merged where they overlap or an empty one touches
+ * another. A keystroke becomes one batch of edits, so typing with any
+ * number of cursors is one pass over the text and one undo step.
+ */
+
+template <class Storage>
+class TxtMultiSelection
 {
-    class TxtBuffer* _txt;
+    TxtBuffer<Storage>* _txt;
+    std::vector<TxtSelection<Storage> > _selections;
+    std::vector<TxtEdit> _edits;
+
+    void normalize();
+    void replace(const txtchr* text, txtsz size, txtsz before, txtsz after);
 public:
-    TxtSelection(class TxtBuffer* txt);
+    TxtMultiSelection(TxtBuffer<Storage>* txt);
+
+    size_t count() const;
+    const TxtSelection<Storage>& operator[](size_t index) const;
 
-    long cursor;
-    long cursorLength;
+    // The first selection that ends at or behind position
+    size_t find(txtcur position) const;
+
+    void add(txtcur cursor, txtsz cursorLength = 0);
+    void addCursorAbove();
+    void addCursorBelow();
+    void collapse();
 
     void addChar(txtchr c);
     void addText(const txtchr* text);
+    void addText(const txtchr* text, txtsz size);
+    void addText(std::string_view text);
     void moveLeft(bool shift, bool ctrl);
     void moveUp(bool shift, bool ctrl);
     void moveRight(bool shift, bool ctrl);
@@ -58,28 +85,177 @@ public:
     void end(bool shift, bool ctrl);
 };
 
+/*
+ * A block (rectangular) selection spans the lines from firstLine to
+ * lastLine and on each of them the columns from leftColumn up to
+ * rightColumn, counted in bytes from the start of the line. Lines that
+ * end in front of a column are cut short there. An edit changes every
+ * line of the block in one batch, which is one pass over the text and
+ * one undo step, and leaves the block as an empty column behind it.
+ */
+
+template <class Storage>
+class TxtBlockSelection
+{
+    TxtBuffer<Storage>* _txt;
+    std::vector<TxtEdit> _edits;
+
+    void replace(const txtchr* text, txtsz size, txtsz before, txtsz after);
+public:
+    TxtBlockSelection(TxtBuffer<Storage>* txt);
+
+    txtsz firstLine;
+    txtsz lastLine;
+    txtsz leftColumn;
+    txtsz rightColumn;
+
+    // Spans the block between two positions, in whichever order
+    void select(txtcur anchor, txtcur caret);
+
+    void addChar(txtchr c);
+    void addText(const txtchr* text, txtsz size);
+    void addText(std::string_view text);
+    void backspace(bool shift, bool ctrl);
+    void del(bool shift, bool ctrl);
+};
+
+/*
+ * A transaction gathers the edits made while it is open into one step
+ * of the history, which undo and redo take back and replay at once.
+ * The guard begins it, commit() closes it, and a guard that goes out of
+ * scope without a commit rolls it back: its edits are reverted and
+ * forgotten. A transaction begun inside another one joins it, only the
+ * outermost one commits or rolls back.
+ */
+
+template <class Storage>
+class TxtTransaction
+{
+    TxtBuffer<Storage>* _txt;
+public:
+    TxtTransaction(TxtBuffer<Storage>* txt);
+    TxtTransaction(const TxtTransaction&) = delete;
+    ~TxtTransaction();
+
+    void commit();
+};
+
+/*
+ * Typing or deleting one character next to the previous edit extends
+ * its event instead of adding one, so undo takes back a run of
+ * keystrokes at once. A run ends when the cursor moves elsewhere, after
+ * a pause of more than TXT_RUN_PAUSE milliseconds, at a word boundary
+ * (a word and the blanks after it make one run) and at breakRun().
+ */
+
+#define TXT_RUN_PAUSE 1000
+
+/*
+ * TxtBuffer and TxtSelection are explicitly instantiated in txt.cpp for
+ * every storage engine in this repository (TxtArrayStorage,
+ * TxtGapStorage, TxtPieceStorage and TxtRopeStorage).
+ */
+
+template <class Storage>
 class TxtBuffer
 {
-    txtchr* _buffer;
-    txtsz _bufferSize;
-    txtsz _bufferAllocSize;
-    EditEvent _firstEvent;
-    EditEvent* _currentEvent;
-    int _undoEventCount;
-    int _redoEventCount;
+    static_assert(isTxtStorage<Storage>::value, "Storage does not implement the storage engine interface");
+
+    Storage _storage;
+    mutable TxtLineIndex _lines;    // unused when the storage has its own line index
+    mutable bool _linesValid;       // the index is built on first use after open
+    TxtHistory _history;
+    TxtAnchors _anchors;
+    TxtDecorations _decorations;
+    unsigned long _lastVersion;
+    unsigned long _savedVersion;
+    bool _runOpen;                  // the current event can be extended
+    txtchr _runLast;                // the last character typed or deleted in the run
+    std::chrono::steady_clock::time_point _runTime;
+    std::chrono::milliseconds _runPause;
+    std::vector<TxtPiece> _runPieces;
+    int _transactions;              // the depth of open transactions
+    int _transactionStart;          // the undo count when the outermost one began
+    std::vector<TxtEdit> _batch;
+    std::vector<const txtchr*> _batchRemoved;
 
-    void addEvent(EditEvent* event);
-    void checkResize(txtsz size);
+    EditEvent& addEvent(EditEventTypes type, txtcur position, txtsz size);
+    void recordText(EditEvent& event, txtcur position, const txtchr* text, txtsz size);
+    bool extendRun(EditEventTypes type, txtcur position, txtchr c);
+    void openRun(txtsz size, txtchr c);
+    void clearEvents();
+    const TxtLineIndex& lines() const;
 
     void insertText(txtcur position, const txtchr* text, txtsz size);
     void deleteText(txtcur position, txtsz size);
+    void restoreText(const EditEvent& event);
+    void revert(const EditEvent& event);
+    void replay(const EditEvent& event);
+    bool batchStep(const EditEvent* events, size_t count, bool undo);
+    void applyBatch(const TxtEdit* edits, size_t count);
+    void restoreVersion();
+    void insertMarks(txtcur position, txtsz size);
+    void eraseMarks(txtcur position, txtsz size);
+    void moveMarks(const EditEvent* events, size_t count, bool undo);
 public:
     TxtBuffer();
+    TxtBuffer(const TxtBuffer&) = delete;
+    ~TxtBuffer();
+
+    void load(const txtchr* text, txtsz size);
+    void load(std::string_view text);
+
+    // A storage that keeps the mapping of an opened file can not be saved
+    // over that file on Windows, which does not replace a mapped file;
+    // open it with openPaged to do that.
+    bool open(const char* path, TxtAccessPatterns pattern = TxtAccessPatterns::Normal);
+
+    // openPaged keeps at most budget bytes of the file in memory, but the
+    // line index built on first use still has a 40 byte node for every
+    // line, so its memory grows with the line count and not the budget,
+    // and it can not hold more than 2^31 lines.
+    bool openPaged(const char* path, txtsz budget = TXT_PAGE_CACHE_BUDGET);
+    bool save(const char* path);
+    void reserve(txtsz size);
+
+    // Every edit, undo and redo moves the text to another version, and
+    // undoing back to the saved version makes the buffer clean again.
+    // saveInBackground writes a snapshot of the current version on its
+    // own thread, the buffer can be edited while it runs; once it
+    // succeeded, pass its version to markSaved.
+    // mapPosition moves a position in the text of one version to where
+    // it is in another, like an anchor would have moved, so the results
+    // of a job on a snapshot still apply after more edits. It returns -1
+    // for a version that is gone: undone and cut off by a new edit, or
+    // merged into a run of keystrokes, call breakRun before handing out
+    // the version.
+    unsigned long version() const;
+    txtcur mapPosition(txtcur position, unsigned long from, unsigned long to) const;
+    bool dirty() const;
+    void markSaved(unsigned long version);
+    std::shared_ptr<const TxtSnapshot> snapshot() const;
+    std::unique_ptr<TxtBackgroundSave> saveInBackground(const char* path) const;
 
     void addText(txtcur position, txtsz selectionLength, const txtchr* text, txtsz size);
-    void addText(const TxtSelection& selection, const txtchr* text, txtsz size);
+    void addText(txtcur position, txtsz selectionLength, std::string_view text);
+    void addText(const TxtSelection<Storage>& selection, const txtchr* text, txtsz size);
+    void addText(const TxtSelection<Storage>& selection, std::string_view text);
     void removeText(txtcur position, txtsz size);
-    void removeText(const TxtSelection& selection);
+    void removeText(const TxtSelection<Storage>& selection);
+
+    // Makes a batch of edits in one pass over the text and one step of
+    // the history. The edits must be sorted and must not overlap, their
+    // positions refer to the text in front of the batch; if they do not,
+    // nothing is changed and false is returned.
+    bool applyEdits(const TxtEdit* edits, size_t count);
+    bool applyEdits(const std::vector<TxtEdit>& edits);
+
+    void breakRun();
+    void setRunPause(long milliseconds);
+
+    void beginTransaction();
+    void commit();
+    void rollback();
 
     bool undo();
     int undoCount();
@@ -88,9 +264,33 @@ public:
 
     const char* buffer() const;
     const txtsz bufferSize() const;
+    txtchr at(txtcur position) const;
+    void copy(txtchr* destination, txtcur position, txtsz size) const;
 
     txtcur findLineStart(txtcur from) const;
     txtcur findNextLineStart(txtcur from) const;
+
+    // Lines are counted from 0, a line starts after every newline.
+    // lineStart returns -1 for a line past the end of the text, lineEnd
+    // returns the offset in front of the "\n" or "\r\n" ending the line.
+    txtsz lineCount() const;
+    txtcur lineStart(txtsz line) const;
+    txtcur lineEnd(txtsz line) const;
+    txtsz lineOf(txtcur position) const;
+
+    // The offset of a column of a line, or of the end of a shorter line
+    txtcur columnOffset(txtsz line, txtsz column) const;
+
+    // Positions that move along with the edits, undo and redo included.
+    // Loading a text drops them.
+    TxtAnchors& anchors();
+    const TxtAnchors& anchors() const;
+
+    // Styled spans of the text for painting, moved and dropped the same way
+    TxtDecorations& decorations();
+    const TxtDecorations& decorations() const;
+
+    const Storage& storage() const;
 };
 
 #endif // TXT_H